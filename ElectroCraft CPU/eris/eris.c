@@ -23,9 +23,11 @@ THE SOFTWARE.
 
 /* Standard library headers. */
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* Not using stdbool because Visual Studio lives in the past... */
@@ -48,11 +50,22 @@ typedef int bool;
 #include "lobject.h"
 #include "lstate.h"
 #include "lstring.h"
+#include "ltable.h"
 #include "lzio.h"
 
 /* Eris header. */
 #include "eris.h"
 
+/* Platform headers, used for mapping persisted images into memory. */
+#if defined(LUA_USE_POSIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
 /*
 ** {===========================================================================
 ** Default settings.
@@ -110,20 +123,24 @@ static const lua_Unsigned kMaxComplexity = 10000;
 #define eris_savestack savestack
 #define eris_restorestack restorestack
 #define eris_reallocstack luaD_reallocstack
+#define eris_shrinkstack luaD_shrinkstack
 /* lfunc.h */
 #define eris_newproto luaF_newproto
 #define eris_newLclosure luaF_newLclosure
 #define eris_initupvals luaF_initupvals
 #define eris_findupval luaF_findupval
 /* lmem.h */
+#define eris_new luaM_new
 #define eris_reallocvector luaM_reallocvector
 /* lobject.h */
 #define eris_ttnov ttnov
+#define eris_clCvalue clCvalue
 #define eris_clLvalue clLvalue
 #define eris_setnilvalue setnilvalue
 #define eris_setclLvalue setclLvalue
 #define eris_setobj setobj
 #define eris_setsvalue2n setsvalue2n
+#define eris_tsvalue tsvalue
 /* lstate.h */
 #define eris_isLua isLua
 #define eris_gch gch
@@ -156,6 +173,8 @@ extern void eris_permcorolib(lua_State *L, bool forUnpersist);
 extern void eris_permloadlib(lua_State *L, bool forUnpersist);
 extern void eris_permiolib(lua_State *L, bool forUnpersist);
 extern void eris_permstrlib(lua_State *L, bool forUnpersist);
+extern void eris_permstrbuflib(lua_State *L, bool forUnpersist);
+extern void eris_permbytelib(lua_State *L, bool forUnpersist);
 
 /* Utility macro for populating the perms table with internal C functions. */
 #define populateperms(L, forUnpersist) {\
@@ -164,6 +183,8 @@ extern void eris_permstrlib(lua_State *L, bool forUnpersist);
   eris_permloadlib(L, forUnpersist);\
   eris_permiolib(L, forUnpersist);\
   eris_permstrlib(L, forUnpersist);\
+  eris_permstrbuflib(L, forUnpersist);\
+  eris_permbytelib(L, forUnpersist);\
 }
 
 #else
@@ -180,7 +201,10 @@ extern void eris_permstrlib(lua_State *L, bool forUnpersist);
 */
 
 #define ERIS_ERR_CFUNC "attempt to persist a light C function (%p)"
+#define ERIS_ERR_CLONE "cannot copy from the same Lua state"
+#define ERIS_ERR_CLONEFROM "cannot copy from a suspended Lua state"
 #define ERIS_ERR_COMPLEXITY "object too complex"
+#define ERIS_ERR_FROMSTACK "stack overflow in the Lua state copied from"
 #define ERIS_ERR_HOOK "cannot persist yielded hooks"
 #define ERIS_ERR_METATABLE "bad metatable, not nil or table"
 #define ERIS_ERR_NOFUNC "attempt to persist unknown function type"
@@ -188,6 +212,7 @@ extern void eris_permstrlib(lua_State *L, bool forUnpersist);
 #define ERIS_ERR_SPER_FUNC "%s did not return a function"
 #define ERIS_ERR_SPER_LOAD "bad unpersist function (%s expected, returned %s)"
 #define ERIS_ERR_SPER_PROT "attempt to persist forbidden table"
+#define ERIS_ERR_SPER_SELF "%s returned a function referencing its object"
 #define ERIS_ERR_SPER_TYPE "%d not nil, boolean, or function"
 #define ERIS_ERR_SPER_UFUNC "invalid restore function"
 #define ERIS_ERR_SPER_UPERM "bad permanent value (%s expected, got %s)"
@@ -264,9 +289,19 @@ typedef struct UnpersistInfo {
   ZIO zio;
   size_t sizeof_int;
   size_t sizeof_size_t;
+  struct StatInfo *stat; /* Only used when collecting image statistics. */
 } UnpersistInfo;
 
-/* Info shared in persist and unpersist. */
+/* State information when copying an object from another state. */
+typedef struct CloneInfo {
+  lua_State *from;
+  int perms; /* Stack indices in 'from'. */
+  int anchors;
+  int metafield;
+  bool writeDebugInfo;
+} CloneInfo;
+
+/* Info shared in persist, unpersist and copying. */
 typedef struct Info {
   lua_State *L;
   lua_Unsigned level;
@@ -278,6 +313,7 @@ typedef struct Info {
   union {
     PersistInfo pi;
     UnpersistInfo upi;
+    CloneInfo cli;
   } u;
 } Info;
 
@@ -500,6 +536,43 @@ checkboolean(lua_State *L, int narg) {                       /* ... bool? ... */
 #define READ(value, length, type) { \
     int i; for (i = 0; i < length; ++i) (value)[i] = READ_VALUE(type); }
 
+/* Reads an array of values that are persisted as 32 bit little endian values.
+ * If the host uses the same representation this is a single copy out of the
+ * input, instead of assembling every value byte by byte. */
+#define READ_ARRAY32(value, length, type, persistedsize) { \
+    if (sizeof(type) == sizeof(uint32_t) && (persistedsize) == sizeof(type) &&\
+        islittleendian()) \
+      READ_RAW((value), (length) * sizeof(type)) \
+    else \
+      READ(value, length, type) }
+
+/** ======================================================================== */
+
+/* Whether the host stores integers in the same byte order we persist them in,
+ * which is little endian. */
+static bool
+islittleendian(void) {
+  const uint32_t one = 1;
+  return *(const uint8_t*)&one == 1;
+}
+
+/* Returns a pointer to the next 'size' bytes of input and skips them if they
+ * are available in one piece in the current chunk of the reader, else NULL.
+ * Readers that hand out the complete data at once (l_unpersist, mapped image
+ * files) allow building objects straight from the input this way, without
+ * going through a temporary copy first. */
+static const char*
+read_direct(Info *info, size_t size) {
+  ZIO *z = &info->u.upi.zio;
+  const char *p = z->p;
+  if (z->n < size) {
+    return NULL;
+  }
+  z->n -= size;
+  z->p += size;
+  return p;
+}
+
 /** ======================================================================== */
 
 static void
@@ -649,30 +722,38 @@ read_uint8_t(Info *info) {
   return value;
 }
 
+/* The bytes are read first: the order in which the operands of '|' are
+ * evaluated is unspecified. */
 static uint16_t
 read_uint16_t(Info *info) {
-  return  (uint16_t)read_uint8_t(info) |
-         ((uint16_t)read_uint8_t(info) << 8);
+  uint8_t b[2];
+  READ_RAW(b, sizeof(b));
+  return  (uint16_t)b[0] |
+         ((uint16_t)b[1] << 8);
 }
 
 static uint32_t
 read_uint32_t(Info *info) {
-  return  (uint32_t)read_uint8_t(info) |
-         ((uint32_t)read_uint8_t(info) << 8) |
-         ((uint32_t)read_uint8_t(info) << 16) |
-         ((uint32_t)read_uint8_t(info) << 24);
+  uint8_t b[4];
+  READ_RAW(b, sizeof(b));
+  return  (uint32_t)b[0] |
+         ((uint32_t)b[1] << 8) |
+         ((uint32_t)b[2] << 16) |
+         ((uint32_t)b[3] << 24);
 }
 
 static uint64_t
 read_uint64_t(Info *info) {
-  return  (uint64_t)read_uint8_t(info) |
-         ((uint64_t)read_uint8_t(info) << 8) |
-         ((uint64_t)read_uint8_t(info) << 16) |
-         ((uint64_t)read_uint8_t(info) << 24) |
-         ((uint64_t)read_uint8_t(info) << 32) |
-         ((uint64_t)read_uint8_t(info) << 40) |
-         ((uint64_t)read_uint8_t(info) << 48) |
-         ((uint64_t)read_uint8_t(info) << 56);
+  uint8_t b[8];
+  READ_RAW(b, sizeof(b));
+  return  (uint64_t)b[0] |
+         ((uint64_t)b[1] << 8) |
+         ((uint64_t)b[2] << 16) |
+         ((uint64_t)b[3] << 24) |
+         ((uint64_t)b[4] << 32) |
+         ((uint64_t)b[5] << 40) |
+         ((uint64_t)b[6] << 48) |
+         ((uint64_t)b[7] << 56);
 }
 
 static int16_t
@@ -815,6 +896,15 @@ static void persist_keyed(Info*, int type);
 static void persist(Info*);
 static void unpersist(Info*);
 
+/* Hooks into unpersisting used when only collecting statistics, see eris_stat.
+ * Permanents and special persistence are replaced by stand-ins then. */
+static void stat_enter(Info*, size_t *start, size_t *children);
+static void stat_leave(Info*, int typeOrReference, int reference,
+                       size_t start, size_t children);
+static void stat_debuginfo(Info*, bool begin);
+static void stat_standin(Info*, int type);
+static void stat_permanent(Info*, int type, int reference);
+
 /*
 ** ============================================================================
 ** Simple types.
@@ -890,12 +980,19 @@ static void
 u_string(Info *info) {                                                 /* ... */
   eris_checkstack(info->L, 2);
   {
-    /* TODO Can we avoid this copy somehow? (Without it getting too nasty) */
     const size_t length = READ_VALUE(size_t);
-    char *value = lua_newuserdata(info->L, length * sizeof(char)); /* ... tmp */
-    READ_RAW(value, length);
-    lua_pushlstring(info->L, value, length);                   /* ... tmp str */
-    lua_replace(info->L, -2);                                      /* ... str */
+    const char *direct = read_direct(info, length);
+    if (direct) {
+      lua_pushlstring(info->L, direct, length);                    /* ... str */
+    }
+    else {
+      /* Data is split across chunks, so we need a contiguous copy first. */
+      char *value = lua_newuserdata(info->L, length * sizeof(char));
+                                                                   /* ... tmp */
+      READ_RAW(value, length);
+      lua_pushlstring(info->L, value, length);                 /* ... tmp str */
+      lua_replace(info->L, -2);                                    /* ... str */
+    }
   }
   registerobject(info);
 
@@ -925,10 +1022,12 @@ u_metatable(Info *info) {                                          /* ... tbl */
   eris_checkstack(info->L, 1);
   pushpath(info, "@metatable");
   unpersist(info);                                         /* ... tbl mt/nil? */
-  if (lua_istable(info->L, -1)) {                               /* ... tbl mt */
+  if (lua_istable(info->L, -1) && !info->u.upi.stat) {          /* ... tbl mt */
     lua_setmetatable(info->L, -2);                                 /* ... tbl */
   }
-  else if (lua_isnil(info->L, -1)) {                           /* ... tbl nil */
+  else if (lua_istable(info->L, -1) || lua_isnil(info->L, -1)) {
+    /* Metatables are not set when collecting statistics, to keep finalizers
+     * in the data from running. */                         /* ... tbl mt/nil */
     lua_pop(info->L, 1);                                           /* ... tbl */
   }
   else {                                                            /* tbl :( */
@@ -1130,7 +1229,12 @@ u_special(Info *info, int type, Callback literal) {                    /* ... */
       eris_error(info, ERIS_ERR_SPER_UFUNC);
     }                                                           /* ... spfunc */
 
-    if (info->passIOToPersist) {
+    if (info->u.upi.stat) {
+      /* Never run code from the data when only collecting statistics. */
+      lua_pop(info->L, 1);                                             /* ... */
+      stat_standin(info, type);                                    /* ... obj */
+    }
+    else if (info->passIOToPersist) {
       lua_pushlightuserdata(info->L, &info->u.upi.zio);     /* ... spfunc zio */
       lua_call(info->L, 1, 1);                                    /* ... obj? */
     } else {
@@ -1304,7 +1408,7 @@ u_proto(Info *info) {                                            /* ... proto */
   /* Read byte code. */
   p->sizecode = READ_VALUE(int);
   eris_reallocvector(info->L, p->code, 0, p->sizecode, Instruction);
-  READ(p->code, p->sizecode, Instruction);
+  READ_ARRAY32(p->code, p->sizecode, Instruction, sizeof(uint32_t));
 
   /* Read constants. */
   p->sizek = READ_VALUE(int);
@@ -1356,8 +1460,12 @@ u_proto(Info *info) {                                            /* ... proto */
 
   /* Read debug information if any is present. */
   if (!READ_VALUE(uint8_t)) {
+    lua_pushvalue(info->L, -1);                            /* ... proto proto */
     return;
   }
+  if (info->u.upi.stat) {
+    stat_debuginfo(info, true);
+  }
 
   /* Read function source code. */
   unpersist(info);                                           /* ... proto str */
@@ -1367,7 +1475,7 @@ u_proto(Info *info) {                                            /* ... proto */
   /* Read line information. */
   p->sizelineinfo = READ_VALUE(int);
   eris_reallocvector(info->L, p->lineinfo, 0, p->sizelineinfo, int);
-  READ(p->lineinfo, p->sizelineinfo, int);
+  READ_ARRAY32(p->lineinfo, p->sizelineinfo, int, info->u.upi.sizeof_int);
 
   /* Read locals info. */
   p->sizelocvars = READ_VALUE(int);
@@ -1398,6 +1506,9 @@ u_proto(Info *info) {                                            /* ... proto */
     poppath(info);
   }
   poppath(info);
+  if (info->u.upi.stat) {
+    stat_debuginfo(info, false);
+  }
   lua_pushvalue(info->L, -1);                              /* ... proto proto */
 
   eris_assert(lua_type(info->L, -1) == LUA_TLIGHTUSERDATA);
@@ -1692,6 +1803,32 @@ u_closure(Info *info) {                                                /* ... */
 
 /** ======================================================================== */
 
+/* Computes the stack size we store for a thread. This is what the thread's
+ * call frames actually need plus some headroom, same as luaD_shrinkstack uses,
+ * so that a thread that once recursed deeply does not keep its huge stack in
+ * the image. The stack will grow again on demand after unpersisting. */
+static int
+trimmedstacksize(lua_State *thread) {
+  const CallInfo *ci;
+  StkId lim = thread->top;
+  int inuse, size;
+  for (ci = thread->ci; ci != NULL; ci = ci->previous) {
+    if (lim < ci->top) {
+      lim = ci->top;
+    }
+  }
+  inuse = (int)(lim - thread->stack) + 1;
+  if (inuse > LUAI_MAXSTACK) {
+    /* Still handling a stack overflow, leave it alone. */
+    return thread->stacksize;
+  }
+  size = inuse + (inuse / 8) + 2 * EXTRA_STACK;
+  if (size > LUAI_MAXSTACK) {
+    size = LUAI_MAXSTACK;
+  }
+  return size < thread->stacksize ? size : thread->stacksize;
+}
+
 static void
 p_thread(Info *info) {                                          /* ... thread */
   lua_State* thread = lua_tothread(info->L, -1);
@@ -1708,8 +1845,9 @@ p_thread(Info *info) {                                          /* ... thread */
     return; /* not reached */
   }
 
-  /* Persist the stack. Save the total size and used space first. */
-  WRITE_VALUE(thread->stacksize, int);
+  /* Persist the stack. Save the total size and used space first. Slots above
+   * the top are dead, so we never write them. */
+  WRITE_VALUE(trimmedstacksize(thread), int);
   WRITE_VALUE(total, size_t);
 
   /* The Lua stack looks like this:
@@ -1769,8 +1907,15 @@ p_thread(Info *info) {                                          /* ... thread */
   level = 0;
   eris_assert(&thread->base_ci != thread->ci->next);
   for (ci = &thread->base_ci; ci != thread->ci->next; ci = ci->next) {
+    StkId func = ci->func;
+    if (thread->status == LUA_YIELD && ci == thread->ci && eris_isLua(ci)) {
+      /* Lua code that yielded because it ran out of its instruction budget.
+       * Here 'func' only protects the stack below the (empty) results, see
+       * luaG_outofbudget, so we write the actual function instead. */
+      func = eris_restorestack(thread, ci->extra);
+    }
     pushpath(info, "[%d]", level++);
-    WRITE_VALUE(eris_savestackidx(thread, ci->func), size_t);
+    WRITE_VALUE(eris_savestackidx(thread, func), size_t);
     WRITE_VALUE(eris_savestackidx(thread, ci->top), size_t);
     WRITE_VALUE(ci->nresults, int16_t);
     WRITE_VALUE(ci->callstatus, uint8_t);
@@ -1793,7 +1938,7 @@ p_thread(Info *info) {                                          /* ... thread */
       }
 
       if (eris_isLua(ci)) {
-        const LClosure *lcl = eris_ci_func(ci);
+        const LClosure *lcl = eris_clLvalue(func);
         WRITE_VALUE(eris_savestackidx(thread, ci->u.l.base), size_t);
         WRITE_VALUE(ci->u.l.savedpc - lcl->p->code, size_t);
       }
@@ -2023,6 +2168,10 @@ u_thread(Info *info) {                                                 /* ... */
     if (eris_ttnov(o) != LUA_TFUNCTION) {
       eris_error(info, ERIS_ERR_THREADCI);
     }
+    if (eris_isLua(thread->ci)) {
+      /* Yielded for its instruction budget, see p_thread. */
+      thread->ci->func = thread->top - 1;
+    }
   }
   LOCK(thread);
   poppath(info);
@@ -2100,6 +2249,12 @@ u_thread(Info *info) {                                                 /* ... */
   }
   poppath(info);
 
+  /* Images written by older versions store the full stack size, even if most
+   * of it was unused. Shrink the stack to what the call frames need, this also
+   * frees any surplus CallInfos. Upvalues are open at this point, so they are
+   * corrected along with the stack. */
+  eris_shrinkstack(thread);
+
   eris_assert(lua_type(info->L, -1) == LUA_TTHREAD);
 }
 
@@ -2248,8 +2403,13 @@ u_permanent(Info *info) {                                 /* perms reftbl ... */
   const int reference = ++(info->refcount);
   eris_checkstack(info->L, 1);
   unpersist(info);                                /* perms reftbl ... permkey */
-  lua_gettable(info->L, PERMIDX);                    /* perms reftbl ... obj? */
-  if (lua_isnil(info->L, -1)) {                       /* perms reftbl ... nil */
+  if (info->u.upi.stat) {
+    stat_permanent(info, type, reference);        /* perms reftbl ... permkey */
+    lua_pop(info->L, 1);                                  /* perms reftbl ... */
+    stat_standin(info, type);                         /* perms reftbl ... obj */
+  }
+  else if (lua_gettable(info->L, PERMIDX) == LUA_TNIL) {
+                                                      /* perms reftbl ... nil */
     /* Since we may need permanent values to rebuild other structures, namely
      * closures and threads, we cannot allow perms to fail unpersisting. */
     eris_error(info, ERIS_ERR_SPER_UPERMNIL);
@@ -2268,11 +2428,18 @@ u_permanent(Info *info) {                                 /* perms reftbl ... */
 
 static void
 unpersist(Info *info) {                                   /* perms reftbl ... */
+  /* Objects register before anything nested in them, so this is the reference
+   * of the object we read, if it gets one. */
+  const int next = info->refcount + 1;
+  size_t start = 0, children = 0;
   eris_ifassert(const int top = lua_gettop(info->L));
   if (info->level >= info->maxComplexity) {
     eris_error(info, ERIS_ERR_COMPLEXITY);
   }
   ++info->level;
+  if (info->u.upi.stat) {
+    stat_enter(info, &start, &children);
+  }
 
   eris_checkstack(info->L, 1);
   {
@@ -2327,6 +2494,9 @@ unpersist(Info *info) {                                   /* perms reftbl ... */
           eris_error(info, ERIS_ERR_TYPEU, type);
       }                                              /* perms reftbl ... obj? */
     }
+    if (info->u.upi.stat) {
+      stat_leave(info, typeOrReference, next, start, children);
+    }
   }
 
   --info->level;
@@ -2337,200 +2507,1306 @@ unpersist(Info *info) {                                   /* perms reftbl ... */
 
 /*
 ** {===========================================================================
-** Writer and reader implementation for library calls.
+** Copying between states.
 ** ============================================================================
 */
 
-/* Implementation note: we use the MBuffer struct, but we don't use the built-
- * in reallocation functions since we'll keep our working copy on the stack, to
- * allow for proper collection if we have to throw an error. This is very much
- * what the auxlib does with its buffer functionality. Which we don't use since
- * we cannot guarantee stack balance inbetween calls to luaL_add*. */
+/* Copying an object to another state is persisting and unpersisting it in one
+ * go: we read the object in the state we copy from and build the copy in
+ * 'info->L' right away, instead of writing and reading it in between. The
+ * reference table maps the addresses of objects in the other state to their
+ * copies, and likewise protos and upvalues to light userdata pointing to
+ * theirs. The state we copy from is not protected, so nothing we do in it may
+ * throw: we only read from it and grow its stack, and call special persistence
+ * functions in protected calls there. Its collector is stopped while we copy,
+ * so that the addresses we keep track of stay valid. And since both states
+ * live in the same process, C functions are copied as they are. */
 
-static int
-writer(lua_State *L, const void *p, size_t sz, void *ud) {
-                                               /* perms reftbl buff path? ... */
-  const char *value = (const char*)p;
-  Mbuffer *buff = (Mbuffer*)ud;
-  const size_t size = eris_bufflen(buff);
-  const size_t capacity = eris_sizebuffer(buff);
-  if (capacity - size < sz) {
-    size_t newcapacity = capacity * 2; /* overflow checked below */
-    if (newcapacity - size < sz) {
-      newcapacity = capacity + sz; /* overflow checked below */
-    }
-    if (newcapacity <= capacity) {
-      /* Overflow in capacity, buffer size limit reached. */
-      return 1;
-    } else {
-      char *newbuff;
-      eris_checkstack(L, 1);
-      newbuff = (char*)lua_newuserdata(L, newcapacity * sizeof(char));
-                                         /* perms reftbl buff path? ... nbuff */
-      memcpy(newbuff, eris_buffer(buff), eris_bufflen(buff));
-      lua_replace(L, BUFFIDX);                /* perms reftbl nbuff path? ... */
-      eris_buffer(buff) = newbuff;
-      eris_sizebuffer(buff) = newcapacity;
-    }
+static void clone(Info*);
+
+/* Throws the error on top of the stack of the state we copy from in ours. */
+static void
+fromerror(Info *info) {                                         /* ... error */
+  lua_State *from = info->u.cli.from;
+  eris_checkstack(info->L, 1);
+  if (lua_type(from, -1) == LUA_TSTRING) {
+    size_t length;
+    const char *message = lua_tolstring(from, -1, &length);
+    lua_pushlstring(info->L, message, length);                 /* ... error */
   }
-  memcpy(&eris_buffer(buff)[eris_bufflen(buff)], value, sz);
-  eris_bufflen(buff) += sz;
-  return 0;
+  else {
+    lua_pushfstring(info->L, "(error object is a %s value)",
+      luaL_typename(from, -1));                                /* ... error */
+  }
+  lua_error(info->L);
 }
 
-/** ======================================================================== */
+/* Makes room for 'n' more values on the stack of the state we copy from. This
+ * fails instead of throwing in there, and the error is thrown in ours. */
+static void
+checkfromstack(Info *info, int n) {
+  if (!lua_checkstack(info->u.cli.from, n)) {
+    eris_error(info, ERIS_ERR_FROMSTACK);
+  }
+}
 
-/* Readonly, interface compatible with MBuffer macros. */
-typedef struct RBuffer {
-  const char *buffer;
-  size_t n;
-  size_t buffsize;
-} RBuffer;
+/* Pushes a value of the state we copy from onto its stack. The caller has made
+ * room for it. */
+static void
+pushfrom(Info *info, const TValue *o) {
+  lua_State *from = info->u.cli.from;
+  eris_setobj(from, from->top, o);
+  ++from->top;
+}
 
-static const char*
-reader(lua_State *L, void *ud, size_t *sz) {
-  RBuffer *buff = (RBuffer*)ud;
-  (void) L; /* unused */
-  if (eris_bufflen(buff) == 0) {
+/* Maps the object with the specified address in the state we copy from to
+ * the copy on top of the stack. */
+static void
+registerclone(Info *info, const void *key) {                    /* ... copy */
+  eris_checkstack(info->L, 1);
+  lua_pushvalue(info->L, -1);                              /* ... copy copy */
+  lua_rawsetp(info->L, REFTIDX, key);                           /* ... copy */
+}
+
+/* Copies a string referenced by a proto. The source of a chunk is shared by
+ * all of its protos, so strings go through the reference table, too. The copy
+ * is anchored by the proto it is set in. */
+static TString*
+clonetstring(Info *info, TString *ts) {                               /* ... */
+  TString *copy;
+  if (ts == NULL) {
     return NULL;
   }
-  *sz = eris_bufflen(buff);
-  eris_bufflen(buff) = 0;
-  return eris_buffer(buff);
+  checkfromstack(info, 1);
+  pushtstring(info->u.cli.from, ts);                         /* from: ... str */
+  clone(info);                                                 /* L: ... str */
+  lua_pop(info->u.cli.from, 1);                                  /* from: ... */
+  copy = eris_tsvalue(info->L->top - 1);
+  lua_pop(info->L, 1);                                              /* L: ... */
+  return copy;
 }
 
-/* }======================================================================== */
-
-/*
-** {===========================================================================
-** Library functions.
-** ============================================================================
-*/
+/** ======================================================================== */
 
 static void
-p_header(Info *info) {
-  WRITE_RAW(kHeader, HEADER_LENGTH);
-  WRITE_VALUE(sizeof(lua_Number), uint8_t);
-  WRITE_VALUE(kHeaderNumber, lua_Number);
-  WRITE_VALUE(sizeof(lua_Integer), uint8_t);
-  WRITE_VALUE(sizeof(int), uint8_t);
-  WRITE_VALUE(sizeof(size_t), uint8_t);
+c_string(Info *info) {                        /* from: ... str | L: ... */
+  size_t length;
+  const char *value = lua_tolstring(info->u.cli.from, -1, &length);
+  eris_checkstack(info->L, 1);
+  lua_pushlstring(info->L, value, length);                         /* ... str */
 }
 
+/** ======================================================================== */
+
 static void
-u_header(Info *info) {
-  char header[HEADER_LENGTH];
-  uint8_t number_size;
-  READ_RAW(header, HEADER_LENGTH);
-  if (strncmp(kHeader, header, HEADER_LENGTH)) {
-    luaL_error(info->L, "invalid data");
+c_metatable(Info *info) {                     /* from: ... obj | L: ... obj */
+  lua_State *from = info->u.cli.from;
+  checkfromstack(info, 1);
+  if (!lua_getmetatable(from, -1)) {                   /* from: ... obj mt? */
+    return;
+  }                                                     /* from: ... obj mt */
+  clone(info);                                            /* L: ... obj mt */
+  lua_pop(from, 1);                                        /* from: ... obj */
+  if (!lua_istable(info->L, -1)) {                          /* L: ... obj :( */
+    eris_error(info, ERIS_ERR_METATABLE);
   }
-  number_size = READ_VALUE(uint8_t);
-  if (number_size == 0) {
-    /* Old 64-bit versions of eris wrote '\0' and then three random bytes. */
-    /* We skip them here for backwards compatibility. */
-    char throw_away[3];
-    READ_RAW(throw_away, 3);
+  lua_setmetatable(info->L, -2);                              /* L: ... obj */
+}
 
-    number_size = READ_VALUE(uint8_t);
-  }
-  if (number_size != sizeof(lua_Number)) {
-    luaL_error(info->L, "incompatible floating point type");
+/* We go over the parts of the table by index rather than with lua_next, which
+ * throws if a special persistence function removed the current key, and check
+ * the sizes in every step, in case one of those functions resized it. */
+static void
+c_literaltable(Info *info, const void *key) {     /* from: ... tbl | L: ... */
+  lua_State *from = info->u.cli.from;
+  Table *t = hvalue(from->top - 1);
+  unsigned int i;
+  int nrec = sizenode(t);
+  if (nrec == 1 && ttisnil(gval(gnode(t, 0)))) {
+    nrec = 0; /* The dummy node of tables without a hash part. */
   }
-  /* In this case we really do want floating point equality. */
-  if (READ_VALUE(lua_Number) != kHeaderNumber) {
-    luaL_error(info->L, "incompatible floating point representation");
+  eris_checkstack(info->L, 3);
+  checkfromstack(info, 1);
+
+  lua_createtable(info->L, t->sizearray, nrec);                  /* ... tbl */
+
+  /* Preregister table for handling of cycles (keys, values or metatable). */
+  registerclone(info, key);
+
+  for (i = 0; i < t->sizearray; ++i) {
+    if (!ttisnil(&t->array[i])) {
+      pushfrom(info, &t->array[i]);                      /* from: ... tbl v */
+      clone(info);                                         /* L: ... tbl v */
+      lua_pop(from, 1);                                    /* from: ... tbl */
+      lua_rawseti(info->L, -2, i + 1);                        /* L: ... tbl */
+    }
   }
-  if (READ_VALUE(uint8_t) != sizeof(lua_Integer)) {
-    luaL_error(info->L, "incompatible integer type");
+  for (i = 0; i < (unsigned int)sizenode(t); ++i) {
+    if (!ttisnil(gval(gnode(t, i)))) {
+      pushfrom(info, gkey(gnode(t, i)));                 /* from: ... tbl k */
+      clone(info);                                         /* L: ... tbl k */
+      lua_pop(from, 1);                                    /* from: ... tbl */
+      if (i >= (unsigned int)sizenode(t) || ttisnil(gval(gnode(t, i)))) {
+        lua_pop(info->L, 1);                                  /* L: ... tbl */
+        continue;
+      }
+      pushfrom(info, gval(gnode(t, i)));                 /* from: ... tbl v */
+      clone(info);                                       /* L: ... tbl k v */
+      lua_pop(from, 1);                                    /* from: ... tbl */
+      lua_rawset(info->L, -3);                                /* L: ... tbl */
+    }
   }
-  info->u.upi.sizeof_int = READ_VALUE(uint8_t);
-  info->u.upi.sizeof_size_t = READ_VALUE(uint8_t);
+
+  c_metatable(info);
 }
 
+/** ======================================================================== */
+
 static void
-unchecked_persist(lua_State *L, lua_Writer writer, void *ud) {
-  Info info;                                            /* perms buff rootobj */
-  info.L = L;
-  info.level = 0;
-  info.refcount = 0;
-  info.maxComplexity = kMaxComplexity;
-  info.passIOToPersist = kPassIOToPersist;
-  info.generatePath = kGeneratePath;
-  info.u.pi.writer = writer;
-  info.u.pi.ud = ud;
-  info.u.pi.metafield = kPersistKey;
-  info.u.pi.writeDebugInfo = kWriteDebugInformation;
+c_literaluserdata(Info *info, const void *key) { /* from: ... udata | L: ... */
+  lua_State *from = info->u.cli.from;
+  const size_t size = lua_rawlen(from, -1);
+  eris_checkstack(info->L, 1);
+  memcpy(lua_newuserdata(info->L, size), lua_touserdata(from, -1), size);
+                                                                 /* ... udata */
+  registerclone(info, key);
+  c_metatable(info);
+}
 
-  eris_checkstack(L, 3);
+/** ======================================================================== */
 
-  if (get_setting(L, (void*)&kSettingMaxComplexity)) {
-                                                  /* perms buff rootobj value */
-    info.maxComplexity = lua_tointeger(L, -1);
-    lua_pop(L, 1);                                      /* perms buff rootobj */
-  }
-  if (get_setting(L, (void*)&kSettingGeneratePath)) {
-                                                  /* perms buff rootobj value */
-    info.generatePath = lua_toboolean(L, -1);
-    lua_pop(L, 1);                                      /* perms buff rootobj */
+/* Calls a special persistence function in the state we copy from, and keeps
+ * the function it returns in the anchor table, so that it is not collected
+ * (and its address reused) while we copy. */
+static int
+l_callspecial(lua_State *L) {                            /* anchors func obj */
+  lua_call(L, 1, 1);                                       /* anchors result */
+  if (lua_isfunction(L, -1)) {
+    lua_pushvalue(L, -1);                           /* anchors result result */
+    lua_rawseti(L, 1, luaL_len(L, 1) + 1);                 /* anchors result */
   }
-  if (get_setting(L, (void*)&kSettingPassIOToPersist)) {
-                                                  /* perms buff rootobj value */
-    info.passIOToPersist = lua_toboolean(L, -1);
-    lua_pop(L, 1);                                      /* perms buff rootobj */
+  return 1;
+}
+
+typedef void (*CloneCallback) (Info*, const void*);
+
+static void
+c_special(Info *info, int type, const void *key, CloneCallback literal) {
+  lua_State *from = info->u.cli.from;                    /* from: ... obj */
+  int allow = (type == LUA_TTABLE);
+  checkfromstack(info, 5);
+
+  /* Check whether we should copy literally, or via the metafunction. */
+  if (lua_getmetatable(from, -1)) {                     /* from: ... obj mt */
+    lua_pushvalue(from, info->u.cli.metafield);    /* from: ... obj mt pkey */
+    lua_rawget(from, -2);                      /* from: ... obj mt persist? */
+    switch (lua_type(from, -1)) {
+      /* No entry, act according to default. */
+      case LUA_TNIL:                                  /* from: ... obj mt nil */
+        lua_pop(from, 2);                                  /* from: ... obj */
+        break;
+
+      /* Boolean value, tells us whether allowed or not. */
+      case LUA_TBOOLEAN:                             /* from: ... obj mt bool */
+        allow = lua_toboolean(from, -1);
+        lua_pop(from, 2);                                  /* from: ... obj */
+        break;
+
+      /* Function value, call it and don't copy literally. */
+      case LUA_TFUNCTION:                            /* from: ... obj mt func */
+        lua_replace(from, -2);                        /* from: ... obj func */
+        lua_pushcfunction(from, l_callspecial);  /* from: ... obj func call */
+        lua_insert(from, -2);                         /* from: ... obj call func */
+        lua_pushvalue(from, info->u.cli.anchors);
+                                              /* from: ... obj call func anchors */
+        lua_insert(from, -2);                 /* from: ... obj call anchors func */
+        lua_pushvalue(from, -4);          /* from: ... obj call anchors func obj */
+        if (lua_pcall(from, 3, 1, 0) != LUA_OK) {       /* from: ... obj error */
+          fromerror(info);
+        }                                            /* from: ... obj result */
+        if (!lua_isfunction(from, -1)) {                  /* from: ... obj :( */
+          eris_error(info, ERIS_ERR_SPER_FUNC,
+            lua_tostring(from, info->u.cli.metafield));
+        }                                              /* from: ... obj func */
+
+        /* Mark the object, in case the function references it. There is no
+         * copy to refer to before we called the copy of the function. */
+        eris_checkstack(info->L, 1);
+        lua_pushboolean(info->L, false);                     /* L: ... false */
+        lua_rawsetp(info->L, REFTIDX, key);                        /* L: ... */
+
+        clone(info);                                         /* L: ... func */
+        lua_pop(from, 1);                                  /* from: ... obj */
+        lua_call(info->L, 0, 1);                             /* L: ... obj? */
+        if (lua_type(info->L, -1) != type) {                   /* L: ... :( */
+          const char *want = kTypenames[type];
+          const char *have = kTypenames[lua_type(info->L, -1)];
+          eris_error(info, ERIS_ERR_SPER_LOAD, want, have);
+        }                                                     /* L: ... obj */
+        registerclone(info, key);
+        return;
+      default:                                         /* from: ... obj mt :( */
+        eris_error(info, ERIS_ERR_SPER_TYPE, info->u.cli.metafield);
+        return; /* not reached */
+    }
   }
-  if (get_setting(L, (void*)&kSettingMetafield)) {/* perms buff rootobj value */
-    info.u.pi.metafield = lua_tostring(L, -1);
-    lua_pop(L, 1);                                      /* perms buff rootobj */
+
+  if (allow) {
+    literal(info, key);                                       /* L: ... obj */
   }
-  if (get_setting(L, (void*)&kSettingWriteDebugInfo)) {
-                                                  /* perms buff rootobj value */
-    info.u.pi.writeDebugInfo = lua_toboolean(L, -1);
-    lua_pop(L, 1);                                      /* perms buff rootobj */
+  else if (type == LUA_TTABLE) {
+    eris_error(info, ERIS_ERR_SPER_PROT);
   }
-
-  lua_newtable(L);                               /* perms buff rootobj reftbl */
-  lua_insert(L, REFTIDX);                        /* perms reftbl buff rootobj */
-  if (info.generatePath) {
-    lua_newtable(L);                        /* perms reftbl buff rootobj path */
-    lua_insert(L, PATHIDX);                 /* perms reftbl buff path rootobj */
-    pushpath(&info, "root");
+  else {
+    eris_error(info, ERIS_ERR_USERDATA);
   }
+}
 
-  /* Populate perms table with Lua internals. */
-  lua_pushvalue(L, PERMIDX);         /* perms reftbl buff path? rootobj perms */
-  populateperms(L, false);
-  lua_pop(L, 1);                           /* perms reftbl buff path? rootobj */
+/** ======================================================================== */
 
-  p_header(&info);
-  persist(&info);                          /* perms reftbl buff path? rootobj */
+static void c_proto(Info*, const Proto*, Proto*);
 
-  if (info.generatePath) {                  /* perms reftbl buff path rootobj */
-    lua_remove(L, PATHIDX);                      /* perms reftbl buff rootobj */
-  }                                              /* perms reftbl buff rootobj */
-  lua_remove(L, REFTIDX);                               /* perms buff rootobj */
+/* Sets '*copy' to the copy of the proto 'p', which is created if we did not
+ * copy it before. It is set before we fill it in, so that it is anchored. */
+static void
+c_protoref(Info *info, Proto *p, Proto **copy) {                      /* ... */
+  eris_checkstack(info->L, 1);
+  if (lua_rawgetp(info->L, REFTIDX, p) == LUA_TLIGHTUSERDATA) {  /* ... proto */
+    *copy = (Proto*)lua_touserdata(info->L, -1);
+    lua_pop(info->L, 1);                                               /* ... */
+  }
+  else {                                                           /* ... nil */
+    lua_pop(info->L, 1);                                               /* ... */
+    *copy = eris_newproto(info->L);
+    lua_pushlightuserdata(info->L, *copy);                       /* ... proto */
+    lua_rawsetp(info->L, REFTIDX, p);                                  /* ... */
+    c_proto(info, p, *copy);
+  }
 }
 
+/* Byte code, line information and the upvalue descriptions are plain data,
+ * so they are copied in one piece. Only constants and names are values. */
 static void
-unchecked_unpersist(lua_State *L, lua_Reader reader, void *ud) {/* perms str? */
-  Info info;
-  info.L = L;
-  info.level = 0;
-  info.refcount = 0;
-  info.maxComplexity = kMaxComplexity;
-  info.generatePath = kGeneratePath;
-  info.passIOToPersist = kPassIOToPersist;
-  eris_init(L, &info.u.upi.zio, reader, ud);
-
-  eris_checkstack(L, 3);
-
-  if (get_setting(L, (void*)&kSettingMaxComplexity)) {
-                                                  /* perms buff rootobj value */
-    info.maxComplexity = lua_tointeger(L, -1);
-    lua_pop(L, 1);                                      /* perms buff rootobj */
+c_proto(Info *info, const Proto *p, Proto *copy) {                    /* ... */
+  lua_State *from = info->u.cli.from;
+  int i;
+  if (info->level >= info->maxComplexity) {
+    eris_error(info, ERIS_ERR_COMPLEXITY);
   }
-  if (get_setting(L, (void*)&kSettingGeneratePath)) {
-                                                 /* perms buff? rootobj value */
+  ++info->level;
+  eris_checkstack(info->L, 1);
+  checkfromstack(info, 1);
+
+  /* Copy general information. */
+  copy->linedefined = p->linedefined;
+  copy->lastlinedefined = p->lastlinedefined;
+  copy->numparams = p->numparams;
+  copy->is_vararg = p->is_vararg;
+  copy->maxstacksize = p->maxstacksize;
+
+  /* Copy byte code. */
+  eris_reallocvector(info->L, copy->code, 0, p->sizecode, Instruction);
+  copy->sizecode = p->sizecode;
+  memcpy(copy->code, p->code, p->sizecode * sizeof(Instruction));
+
+  /* Copy upvalue descriptions, the names are set below. */
+  eris_reallocvector(info->L, copy->upvalues, 0, p->sizeupvalues, Upvaldesc);
+  for (i = 0; i < p->sizeupvalues; ++i) {
+    copy->upvalues[i].name = NULL;
+    copy->upvalues[i].instack = p->upvalues[i].instack;
+    copy->upvalues[i].idx = p->upvalues[i].idx;
+  }
+  copy->sizeupvalues = p->sizeupvalues;
+
+  /* Copy constants. Set all values to nil first to avoid confusing the GC. */
+  eris_reallocvector(info->L, copy->k, 0, p->sizek, TValue);
+  for (i = 0; i < p->sizek; ++i) {
+    eris_setnilvalue(&copy->k[i]);
+  }
+  copy->sizek = p->sizek;
+  for (i = 0; i < p->sizek; ++i) {
+    pushfrom(info, &p->k[i]);                                /* from: ... obj */
+    clone(info);                                               /* L: ... obj */
+    lua_pop(from, 1);                                            /* from: ... */
+    eris_setobj(info->L, &copy->k[i], info->L->top - 1);
+    lua_pop(info->L, 1);                                            /* L: ... */
+  }
+
+  /* Copy child protos. Null all entries first to avoid confusing the GC. */
+  eris_reallocvector(info->L, copy->p, 0, p->sizep, Proto*);
+  memset(copy->p, 0, p->sizep * sizeof(Proto*));
+  copy->sizep = p->sizep;
+  for (i = 0; i < p->sizep; ++i) {
+    c_protoref(info, p->p[i], &copy->p[i]);
+  }
+
+  /* Copy debug information if we would persist it. */
+  if (info->u.cli.writeDebugInfo) {
+    copy->source = clonetstring(info, p->source);
+
+    eris_reallocvector(info->L, copy->lineinfo, 0, p->sizelineinfo, int);
+    copy->sizelineinfo = p->sizelineinfo;
+    memcpy(copy->lineinfo, p->lineinfo, p->sizelineinfo * sizeof(int));
+
+    eris_reallocvector(info->L, copy->locvars, 0, p->sizelocvars, LocVar);
+    for (i = 0; i < p->sizelocvars; ++i) {
+      copy->locvars[i].varname = NULL;
+    }
+    copy->sizelocvars = p->sizelocvars;
+    for (i = 0; i < p->sizelocvars; ++i) {
+      copy->locvars[i].startpc = p->locvars[i].startpc;
+      copy->locvars[i].endpc = p->locvars[i].endpc;
+      copy->locvars[i].varname = clonetstring(info, p->locvars[i].varname);
+    }
+
+    for (i = 0; i < p->sizeupvalues; ++i) {
+      copy->upvalues[i].name = clonetstring(info, p->upvalues[i].name);
+    }
+  }
+
+  --info->level;
+}
+
+/** ======================================================================== */
+
+/* Upvalues are shared by address like protos. Upvalues that are open in the
+ * state we copy from are created closed, the same as when unpersisting, and
+ * are opened when we copy the thread they belong to, see c_thread. Since we
+ * have the upvalue itself, we do not need to keep track of the closures that
+ * use it for that. */
+static void
+c_upval(Info *info, UpVal *uv, UpVal **copy) {                        /* ... */
+  lua_State *from = info->u.cli.from;
+  UpVal *nuv;
+  eris_checkstack(info->L, 1);
+  if (lua_rawgetp(info->L, REFTIDX, uv) == LUA_TLIGHTUSERDATA) {    /* ... uv */
+    *copy = (UpVal*)lua_touserdata(info->L, -1);
+    (*copy)->refcount++;
+    lua_pop(info->L, 1);                                               /* ... */
+    return;
+  }                                                                /* ... nil */
+  lua_pop(info->L, 1);                                                 /* ... */
+
+  nuv = eris_new(info->L, UpVal);
+  nuv->refcount = 1;
+  nuv->v = &nuv->u.value;
+  eris_setnilvalue(nuv->v);
+  *copy = nuv;
+  lua_pushlightuserdata(info->L, nuv);                              /* ... uv */
+  lua_rawsetp(info->L, REFTIDX, uv);                                   /* ... */
+
+  checkfromstack(info, 1);
+  pushfrom(info, uv->v);                                     /* from: ... obj */
+  clone(info);                                                 /* L: ... obj */
+  lua_pop(from, 1);                                              /* from: ... */
+  /* Copying the value may have copied the thread the upvalue belongs to, in
+   * which case it is open now and the value is on that thread's stack. */
+  if (!upisopen(nuv)) {
+    eris_setobj(info->L, nuv->v, info->L->top - 1);
+  }
+  lua_pop(info->L, 1);                                              /* L: ... */
+}
+
+static void
+c_closure(Info *info, const void *key) {         /* from: ... func | L: ... */
+  lua_State *from = info->u.cli.from;
+  int nup;
+  eris_checkstack(info->L, 2);
+  checkfromstack(info, 1);
+  switch (ttype(from->top - 1)) {
+    case LUA_TLCF: /* light C function */
+      /* Valid in the other state, too, since it's the same process. */
+      lua_pushcfunction(info->L, lua_tocfunction(from, -1));      /* ... func */
+      break;
+    case LUA_TCCL: /* C closure */ {
+      CClosure *cl = eris_clCvalue(from->top - 1);
+      /* Create the closure with all nil first, then fill the upvalues in, to
+       * handle cycles. */
+      eris_checkstack(info->L, cl->nupvalues);
+      for (nup = 1; nup <= cl->nupvalues; ++nup) {
+        lua_pushnil(info->L);                      /* ... nil[1] ... nil[nup] */
+      }
+      lua_pushcclosure(info->L, cl->f, cl->nupvalues);             /* ... ccl */
+      registerclone(info, key);
+      for (nup = 1; nup <= cl->nupvalues; ++nup) {
+        pushfrom(info, &cl->upvalue[nup - 1]);               /* from: ... obj */
+        clone(info);                                       /* L: ... ccl obj */
+        lua_pop(from, 1);                                        /* from: ... */
+        lua_setupvalue(info->L, -2, nup);                      /* L: ... ccl */
+      }
+      break;
+    }
+    case LUA_TLCL: /* Lua function */ {
+      LClosure *cl = eris_clLvalue(from->top - 1);
+      /* Create closure and anchor it on the stack (avoid collection via GC).
+       * Its upvalues are all NULL until we set them. */
+      LClosure *copy = eris_newLclosure(info->L, cl->nupvalues);
+      eris_setclLvalue(info->L, info->L->top, copy);               /* ... lcl */
+      eris_incr_top(info->L);
+
+      /* Preregister closure for handling of cycles (upvalues). */
+      registerclone(info, key);
+
+      c_protoref(info, cl->p, &copy->p);
+      for (nup = 0; nup < cl->nupvalues; ++nup) {
+        c_upval(info, cl->upvals[nup], &copy->upvals[nup]);
+      }
+      break;
+    }
+    default:
+      eris_error(info, ERIS_ERR_NOFUNC);
+      return; /* not reached */
+  }
+}
+
+/** ======================================================================== */
+
+/* Stack positions are copied as offsets, which are the same in both stacks,
+ * and so are the saved stack positions (errfunc, extra, old_errfunc). */
+#define clonestkid(p) (copy->stack + ((p) - thread->stack))
+
+static void
+c_thread(Info *info, const void *key) {        /* from: ... thread | L: ... */
+  lua_State *from = info->u.cli.from;
+  lua_State *thread = lua_tothread(from, -1), *copy;
+  size_t level, total = thread->top - thread->stack;
+  CallInfo *ci;
+  UpVal *uv, **next;
+
+  /* We use the stack of the state we copy from, so we cannot copy that one. */
+  if (thread == from || thread == info->L) {
+    eris_error(info, ERIS_ERR_THREAD);
+  }
+  eris_checkstack(info->L, 2);
+  checkfromstack(info, 1);
+
+  copy = lua_newthread(info->L);                                /* ... thread */
+  registerclone(info, key);
+
+  /* Copy the stack, with the same size we would persist. The slots are all nil
+   * to begin with, so the GC is fine with the top set right away. */
+  eris_reallocstack(copy, trimmedstacksize(thread));
+  copy->top = copy->stack + total;
+  for (level = 0; level < total; ++level) {
+    pushfrom(info, thread->stack + level);                   /* from: ... obj */
+    clone(info);                                        /* L: ... thread obj */
+    lua_pop(from, 1);                                            /* from: ... */
+    eris_setobj(copy, copy->stack + level, info->L->top - 1);
+    lua_pop(info->L, 1);                                     /* L: ... thread */
+  }
+
+  /* Copy general information. See p_thread for what we leave out. */
+  copy->status = thread->status;
+  copy->errfunc = thread->errfunc;
+  copy->nCcalls = thread->nCcalls;
+  copy->oldpc = NULL;
+
+  /* Copy call information (stack frames). */
+  copy->ci = &copy->base_ci;
+  for (ci = &thread->base_ci;; ci = ci->next) {
+    CallInfo *nci = copy->ci;
+    nci->func = clonestkid(ci->func);
+    nci->top = clonestkid(ci->top);
+    nci->nresults = ci->nresults;
+    nci->callstatus = ci->callstatus;
+    nci->extra = ci->extra;
+    if (ci->callstatus & CIST_HOOKYIELD) {
+      eris_error(info, ERIS_ERR_HOOK);
+    }
+    if (eris_isLua(ci)) {
+      /* See p_thread for Lua code that yielded for its instruction budget. */
+      StkId func = thread->status == LUA_YIELD && ci == thread->ci ?
+        eris_restorestack(thread, ci->extra) : ci->func;
+      const Proto *p = eris_clLvalue(func)->p, *np;
+      if (!ttisLclosure(clonestkid(func))) {
+        eris_error(info, ERIS_ERR_THREADCI);
+      }
+      np = eris_clLvalue(clonestkid(func))->p;
+      if (np->sizecode != p->sizecode) {
+        eris_error(info, ERIS_ERR_THREADPC);
+      }
+      nci->u.l.base = clonestkid(ci->u.l.base);
+      nci->u.l.savedpc = np->code + (ci->u.l.savedpc - p->code);
+    }
+    else {
+      nci->u.c = ci->u.c;
+    }
+    if (ci == thread->ci) {
+      break;
+    }
+    copy->ci = eris_extendCI(copy);
+  }
+
+  /* Open the upvalues that belong to this thread. They are in the same order
+   * as in the original list, which is sorted by stack level. The ones closures
+   * we copied already use are the same, the others are created unused. */
+  next = &copy->openupval;
+  for (uv = thread->openupval; uv != NULL; uv = uv->u.open.next) {
+    UpVal *nuv;
+    bool used = lua_rawgetp(info->L, REFTIDX, uv) == LUA_TLIGHTUSERDATA;
+                                                     /* L: ... thread uv/nil */
+    if (used) {
+      nuv = (UpVal*)lua_touserdata(info->L, -1);
+    }
+    else {
+      nuv = eris_new(info->L, UpVal);
+      nuv->refcount = 0;
+    }
+    lua_pop(info->L, 1);                                     /* L: ... thread */
+    nuv->v = clonestkid(uv->v);
+    nuv->u.open.next = NULL;
+    nuv->u.open.touched = 1;
+    *next = nuv;
+    next = &nuv->u.open.next;
+    if (!used) {
+      lua_pushlightuserdata(info->L, nuv);                /* L: ... thread uv */
+      lua_rawsetp(info->L, REFTIDX, uv);                     /* L: ... thread */
+    }
+  }
+  if (copy->openupval != NULL && !isintwups(copy)) {
+    copy->twups = G(copy)->twups;
+    G(copy)->twups = copy;
+  }
+}
+
+#undef clonestkid
+
+/** ======================================================================== */
+
+static void
+c_permanent(Info *info, int type, const void *key) {
+                                          /* from: ... obj permkey | L: ... */
+  clone(info);                                                /* ... permkey */
+  lua_gettable(info->L, PERMIDX);                                 /* ... obj? */
+  if (lua_isnil(info->L, -1)) {                                     /* ... nil */
+    eris_error(info, ERIS_ERR_SPER_UPERMNIL);
+  }
+  else if (lua_type(info->L, -1) != type) {                          /* ... :( */
+    const char *want = kTypenames[type];
+    const char *have = kTypenames[lua_type(info->L, -1)];
+    eris_error(info, ERIS_ERR_SPER_UPERM, want, have);
+  }                                                                /* ... obj */
+  if (key) {
+    registerclone(info, key);
+  }
+}
+
+/* Top-level delegating copy function, the counterpart of persist. */
+static void
+clone(Info *info) {                              /* from: ... obj | L: ... */
+  lua_State *from = info->u.cli.from;
+  const int type = lua_type(from, -1);
+  const void *key = NULL;
+
+  eris_checkstack(info->L, 1);
+
+  /* Copy simple values directly, same as when persisting. */
+  if (type == LUA_TNIL ||
+      type == LUA_TBOOLEAN ||
+      type == LUA_TLIGHTUSERDATA ||
+      type == LUA_TNUMBER)
+  {
+    eris_setobj(info->L, info->L->top, from->top - 1);
+    eris_incr_top(info->L);                                      /* L: ... obj */
+    return;
+  }
+
+  /* Look up objects we already copied. Short strings are interned anyway, so
+   * we save ourselves the lookup for them, and light C functions have no
+   * identity. */
+  if (iscollectable(from->top - 1) && !ttisshrstring(from->top - 1)) {
+    key = gcvalue(from->top - 1);
+    switch (lua_rawgetp(info->L, REFTIDX, key)) {          /* L: ... copy? */
+      case LUA_TNIL:                                          /* L: ... nil */
+        lua_pop(info->L, 1);                                      /* L: ... */
+        break;
+      case LUA_TBOOLEAN:                                      /* L: ... :( */
+        eris_error(info, ERIS_ERR_SPER_SELF,
+          lua_tostring(from, info->u.cli.metafield));
+        return; /* not reached */
+      default:                                               /* L: ... copy */
+        return;
+    }
+  }
+
+  /* At this point, we'll give the permanents table a chance to play. We look
+   * it up raw, so that no metamethod of the state we copy from is called. */
+  checkfromstack(info, 1);
+  lua_pushvalue(from, -1);                              /* from: ... obj obj */
+  if (lua_rawget(from, info->u.cli.perms) != LUA_TNIL) {
+                                                    /* from: ... obj permkey */
+    c_permanent(info, type, key);                              /* L: ... obj */
+    lua_pop(from, 1);                                      /* from: ... obj */
+    return;
+  }                                                     /* from: ... obj nil */
+  lua_pop(from, 1);                                        /* from: ... obj */
+
+  if (info->level >= info->maxComplexity) {
+    eris_error(info, ERIS_ERR_COMPLEXITY);
+  }
+  ++info->level;
+
+  switch (type) {
+    case LUA_TSTRING:
+      c_string(info);
+      if (key) {
+        registerclone(info, key);
+      }
+      break;
+    case LUA_TTABLE:
+      c_special(info, LUA_TTABLE, key, c_literaltable);
+      break;
+    case LUA_TFUNCTION:
+      c_closure(info, key);
+      break;
+    case LUA_TUSERDATA:
+      c_special(info, LUA_TUSERDATA, key, c_literaluserdata);
+      break;
+    case LUA_TTHREAD:
+      c_thread(info, key);
+      break;
+    default:
+      eris_error(info, ERIS_ERR_TYPEP, type);
+  }                                                            /* L: ... obj */
+
+  --info->level;
+}
+
+/** ======================================================================== */
+
+/* Gets the settings of the state we copy from and pushes the anchor table.
+ * This is called in a protected call in that state, since pushing the name of
+ * the metafield may allocate memory. */
+static int
+l_clonesettings(lua_State *L) {                                        /* ... */
+  eris_checkstack(L, 4);
+  lua_newtable(L);                                             /* ... anchors */
+  if (!get_setting(L, (void*)&kSettingMetafield)) {
+    lua_pushstring(L, kPersistKey);
+  }                                                  /* ... anchors metafield */
+  if (!get_setting(L, (void*)&kSettingMaxComplexity)) {
+    lua_pushinteger(L, (lua_Integer)kMaxComplexity);
+  }                                           /* ... anchors metafield maxrec */
+  if (!get_setting(L, (void*)&kSettingWriteDebugInfo)) {
+    lua_pushboolean(L, kWriteDebugInformation);
+  }                                     /* ... anchors metafield maxrec debug */
+  return 4;
+}
+
+static int
+l_clone(lua_State *L) {                            /* perms from fperms value */
+  Info info;
+  lua_State *from = (lua_State*)lua_touserdata(L, 2);
+  const int value = (int)lua_tointeger(L, 4);
+  int base;
+  info.L = L;
+  info.level = 0;
+  info.refcount = 0;
+  info.maxComplexity = kMaxComplexity;
+  info.generatePath = false;
+  info.passIOToPersist = false;
+  info.u.cli.from = from;
+  info.u.cli.perms = (int)lua_tointeger(L, 3);
+
+  lua_settop(L, 1);                                                  /* perms */
+  lua_newtable(L);                                            /* perms reftbl */
+
+  checkfromstack(&info, 6);
+  lua_pushcfunction(from, l_clonesettings);     /* from: ... l_clonesettings */
+  if (lua_pcall(from, 0, 4, 0) != LUA_OK) {                /* from: ... error */
+    fromerror(&info);
+  }                                /* from: ... anchors metafield maxrec debug */
+  base = lua_gettop(from) - 3;
+  info.u.cli.anchors = base;
+  info.u.cli.metafield = base + 1;
+  info.maxComplexity = lua_tointeger(from, base + 2);
+  info.u.cli.writeDebugInfo = lua_toboolean(from, base + 3);
+  lua_pop(from, 2);                           /* from: ... anchors metafield */
+
+  lua_pushvalue(from, value);           /* from: ... anchors metafield rootobj */
+  clone(&info);                                      /* perms reftbl rootobj */
+  return 1;
+}
+
+/* }======================================================================== */
+
+/*
+** {===========================================================================
+** Writer and reader implementation for library calls.
+** ============================================================================
+*/
+
+/* Implementation note: we use the MBuffer struct, but we don't use the built-
+ * in reallocation functions since we'll keep our working copy on the stack, to
+ * allow for proper collection if we have to throw an error. This is very much
+ * what the auxlib does with its buffer functionality. Which we don't use since
+ * we cannot guarantee stack balance inbetween calls to luaL_add*. */
+
+static int
+writer(lua_State *L, const void *p, size_t sz, void *ud) {
+                                               /* perms reftbl buff path? ... */
+  const char *value = (const char*)p;
+  Mbuffer *buff = (Mbuffer*)ud;
+  const size_t size = eris_bufflen(buff);
+  const size_t capacity = eris_sizebuffer(buff);
+  if (capacity - size < sz) {
+    size_t newcapacity = capacity * 2; /* overflow checked below */
+    if (newcapacity - size < sz) {
+      newcapacity = capacity + sz; /* overflow checked below */
+    }
+    if (newcapacity <= capacity) {
+      /* Overflow in capacity, buffer size limit reached. */
+      return 1;
+    } else {
+      char *newbuff;
+      eris_checkstack(L, 1);
+      newbuff = (char*)lua_newuserdata(L, newcapacity * sizeof(char));
+                                         /* perms reftbl buff path? ... nbuff */
+      memcpy(newbuff, eris_buffer(buff), eris_bufflen(buff));
+      lua_replace(L, BUFFIDX);                /* perms reftbl nbuff path? ... */
+      eris_buffer(buff) = newbuff;
+      eris_sizebuffer(buff) = newcapacity;
+    }
+  }
+  memcpy(&eris_buffer(buff)[eris_bufflen(buff)], value, sz);
+  eris_bufflen(buff) += sz;
+  return 0;
+}
+
+/** ======================================================================== */
+
+/* Readonly, interface compatible with MBuffer macros. */
+typedef struct RBuffer {
+  const char *buffer;
+  size_t n;
+  size_t buffsize;
+} RBuffer;
+
+static const char*
+reader(lua_State *L, void *ud, size_t *sz) {
+  RBuffer *buff = (RBuffer*)ud;
+  (void) L; /* unused */
+  if (eris_bufflen(buff) == 0) {
+    return NULL;
+  }
+  *sz = eris_bufflen(buff);
+  eris_bufflen(buff) = 0;
+  return eris_buffer(buff);
+}
+
+/** ======================================================================== */
+
+/* A persisted image loaded from a file. On POSIX systems the file is mapped
+ * into memory, so the reader hands out the complete image as a single chunk
+ * and restoring it is bounded by page faults rather than by copying it into
+ * and out of intermediate buffers. Elsewhere we read the file into a single
+ * heap block, which still saves us the chunked reads. */
+typedef struct Image {
+  RBuffer buff;
+  void *base;
+  size_t size;
+} Image;
+
+#if defined(LUA_USE_POSIX)
+
+static bool
+mapimage(Image *image, int fd) {
+  struct stat st;
+  image->base = NULL;
+  image->size = 0;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+  if ((off_t)(size_t)st.st_size != st.st_size) {
+    errno = EFBIG;
+    return false;
+  }
+  image->size = (size_t)st.st_size;
+  if (image->size > 0) {
+    image->base = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image->base == MAP_FAILED) {
+      image->base = NULL;
+      return false;
+    }
+#if defined(MADV_SEQUENTIAL)
+    /* We read front to back exactly once, let the kernel read ahead. */
+    madvise(image->base, image->size, MADV_SEQUENTIAL);
+#endif
+  }
+  eris_buffer(&image->buff) = (const char*)image->base;
+  eris_bufflen(&image->buff) = image->size;
+  eris_sizebuffer(&image->buff) = image->size;
+  return true;
+}
+
+static void
+closeimage(Image *image) {
+  if (image->base) {
+    munmap(image->base, image->size);
+    image->base = NULL;
+  }
+}
+
+static bool
+openimage(Image *image, const char *filename) {
+  bool result;
+  int error;
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  result = mapimage(image, fd);
+  error = errno;
+  close(fd); /* The mapping stays valid after closing the descriptor. */
+  errno = error;
+  return result;
+}
+
+#else
+
+static bool
+openimage(Image *image, const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  long size;
+  image->base = NULL;
+  image->size = 0;
+  if (f == NULL) {
+    return false;
+  }
+  if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0)
+  {
+    fclose(f);
+    return false;
+  }
+  image->size = (size_t)size;
+  if (image->size > 0) {
+    image->base = malloc(image->size);
+    if (image->base == NULL) {
+      fclose(f);
+      errno = ENOMEM;
+      return false;
+    }
+    if (fread(image->base, 1, image->size, f) != image->size) {
+      free(image->base);
+      image->base = NULL;
+      fclose(f);
+      return false;
+    }
+  }
+  fclose(f);
+  eris_buffer(&image->buff) = (const char*)image->base;
+  eris_bufflen(&image->buff) = image->size;
+  eris_sizebuffer(&image->buff) = image->size;
+  return true;
+}
+
+static void
+closeimage(Image *image) {
+  free(image->base);
+  image->base = NULL;
+}
+
+#endif
+
+/* }======================================================================== */
+
+/*
+** {===========================================================================
+** Byte code cache.
+** ============================================================================
+*/
+
+/* Compiling the sources dominates booting a fresh state, and every state we
+ * boot compiles the same sources again. eris_loadcached keeps the compiled
+ * byte code of chunks in a cache directory, in files named after a hash of the
+ * chunk name and source. Each entry starts with a header, followed by the
+ * chunk name and source it was compiled from and the output of lua_dump, whose
+ * own header (version, format, type sizes) is validated by the undumper. The
+ * name and source are compared byte for byte on load, so a hash collision
+ * cannot hand out byte code compiled from another chunk. Entries that fail to
+ * validate are removed and recompiled. */
+
+/* File name suffix of cache entries, their names are the hash in hex. */
+#define CACHE_SUFFIX ".luac"
+#define CACHE_KEYLENGTH 16
+
+/* Written at the start of each cache entry. Bump the last digit whenever the
+ * layout of CacheHeader changes. */
+static const char kCacheMagic[8] = {'E', 'R', 'I', 'S', 'B', 'C', '2', '\n'};
+
+typedef struct CacheHeader {
+  char magic[8];
+  uint32_t version;                                        /* LUA_VERSION_NUM */
+  uint32_t namelength;
+  uint64_t hash;                                /* FNV-1a of name '\0' source */
+  uint64_t sourcelength;
+} CacheHeader;
+
+typedef struct CacheRequest {
+  const char *buff;
+  size_t size;
+  const char *name;
+  const char *cachedir;
+  size_t limit;
+} CacheRequest;
+
+static uint64_t
+cachehash(uint64_t hash, const char *data, size_t size) {
+  const unsigned char *p = (const unsigned char*)data;
+  const unsigned char *end = p + size;
+  for (; p < end; ++p) {
+    hash = (hash ^ *p) * UINT64_C(0x100000001b3);
+  }
+  return hash;
+}
+
+static void
+cacheheader(CacheHeader *header, const CacheRequest *request) {
+  uint64_t hash = UINT64_C(0xcbf29ce484222325);
+  memset(header, 0, sizeof(CacheHeader));
+  memcpy(header->magic, kCacheMagic, sizeof(kCacheMagic));
+  header->version = LUA_VERSION_NUM;
+  header->namelength = (uint32_t)strlen(request->name);
+  hash = cachehash(hash, request->name, header->namelength + 1);
+  header->hash = cachehash(hash, request->buff, request->size);
+  header->sourcelength = request->size;
+}
+
+static int
+cachewriter(lua_State *L, const void *p, size_t sz, void *ud) {
+  (void) L; /* unused */
+  return fwrite(p, 1, sz, (FILE*)ud) != sz;
+}
+
+#if defined(LUA_USE_POSIX)
+
+/* Marks a cache entry as recently used, eviction goes by modification time. */
+static void
+touchcache(const char *path) {
+  utime(path, NULL);
+}
+
+static bool
+iscachename(const char *name) {
+  const size_t length = strlen(name);
+  return length == CACHE_KEYLENGTH + sizeof(CACHE_SUFFIX) - 1 &&
+         strcmp(name + CACHE_KEYLENGTH, CACHE_SUFFIX) == 0;
+}
+
+typedef struct CacheEntry {
+  char name[CACHE_KEYLENGTH + sizeof(CACHE_SUFFIX)];
+  time_t mtime;
+  size_t size;
+} CacheEntry;
+
+static int
+cacheentrycmp(const void *a, const void *b) {
+  const time_t ta = ((const CacheEntry*)a)->mtime;
+  const time_t tb = ((const CacheEntry*)b)->mtime;
+  return ta < tb ? -1 : ta > tb;
+}
+
+/* Removes the least recently used entries until the entries in 'cachedir'
+ * take up no more than 'limit' bytes. The directory is scanned once, then the
+ * entries are removed oldest first. */
+static void
+evictcache(const char *cachedir, size_t limit) {
+  char path[FILENAME_MAX];
+  CacheEntry *entries = NULL;
+  size_t count = 0, capacity = 0, total = 0, i;
+  struct dirent *entry;
+  struct stat st;
+  DIR *dir = opendir(cachedir);
+  if (dir == NULL) {
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (!iscachename(entry->d_name) ||
+        (size_t)snprintf(path, sizeof(path), "%s/%s", cachedir,
+                         entry->d_name) >= sizeof(path) ||
+        stat(path, &st) != 0)
+    {
+      continue;
+    }
+    if (count == capacity) {
+      CacheEntry *grown;
+      capacity = capacity ? capacity * 2 : 64;
+      grown = (CacheEntry*)realloc(entries, capacity * sizeof(CacheEntry));
+      if (grown == NULL) {
+        break;
+      }
+      entries = grown;
+    }
+    strcpy(entries[count].name, entry->d_name);
+    entries[count].mtime = st.st_mtime;
+    entries[count].size = (size_t)st.st_size;
+    total += entries[count].size;
+    ++count;
+  }
+  closedir(dir);
+  if (total > limit) {
+    qsort(entries, count, sizeof(CacheEntry), cacheentrycmp);
+    for (i = 0; i < count && total > limit; ++i) {
+      snprintf(path, sizeof(path), "%s/%s", cachedir, entries[i].name);
+      if (remove(path) == 0) {
+        total -= entries[i].size;
+      }
+    }
+  }
+  free(entries);
+}
+
+#else
+
+/* Without a portable way to list directories we never evict entries. */
+#define touchcache(path) ((void)(path))
+#define evictcache(cachedir, limit) ((void)(cachedir), (void)(limit))
+
+#endif
+
+/* Loads the function cached in 'path', if its header, name and source match
+ * the request. Entries that do not match or fail to load are removed. */
+static bool
+loadcacheentry(lua_State *L, const char *path, const CacheHeader *header,
+               const CacheRequest *request) {                          /* ... */
+  const size_t offset = sizeof(CacheHeader) + header->namelength +
+                        request->size;
+  const char *base;
+  Image image;
+  int status;
+  if (!openimage(&image, path)) {
+    return false;
+  }
+  base = (const char*)image.base;
+  if (image.size < offset ||
+      memcmp(base, header, sizeof(CacheHeader)) != 0 ||
+      memcmp(base + sizeof(CacheHeader), request->name,
+             header->namelength) != 0 ||
+      memcmp(base + sizeof(CacheHeader) + header->namelength, request->buff,
+             request->size) != 0)
+  {
+    closeimage(&image);
+    remove(path);
+    return false;
+  }
+  eris_buffer(&image.buff) += offset;
+  eris_bufflen(&image.buff) -= offset;
+  status = lua_load(L, reader, &image.buff, request->name, "b");
+                                                            /* ... func/error */
+  closeimage(&image);
+  if (status != LUA_OK) {
+    lua_pop(L, 1);                                                     /* ... */
+    if (status == LUA_ERRSYNTAX) {
+      remove(path);
+    }
+    return false;
+  }
+  if (request->limit > 0) {
+    touchcache(path);
+  }
+  return true;
+}
+
+/* Writes the function on top of the stack to the cache entry 'path'. We write
+ * to a temporary file first and rename it, so that concurrent loads never see
+ * partially written entries. Failing to write the entry is not an error, the
+ * cache is just not populated then. */
+static void
+writecacheentry(lua_State *L, const char *path, const CacheHeader *header,
+                const CacheRequest *request) {                    /* ... func */
+  const char *temp;
+  FILE *f;
+  bool ok;
+#if defined(LUA_USE_POSIX)
+  temp = lua_pushfstring(L, "%s.%d.%p.tmp", path, (int)getpid(), (void*)L);
+#else
+  temp = lua_pushfstring(L, "%s.%p.tmp", path, (void*)L);
+#endif
+                                                             /* ... func temp */
+  f = fopen(temp, "wb");
+  if (f == NULL) {
+    lua_pop(L, 1);                                                /* ... func */
+    return;
+  }
+  ok = fwrite(header, sizeof(CacheHeader), 1, f) == 1 &&
+       fwrite(request->name, 1, header->namelength, f) == header->namelength &&
+       fwrite(request->buff, 1, request->size, f) == request->size;
+  lua_pushvalue(L, -2);                                 /* ... func temp func */
+  ok = ok && lua_dump(L, cachewriter, f, 0) == 0;
+  lua_pop(L, 1);                                             /* ... func temp */
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(temp, path) != 0) {
+    remove(temp);
+  }
+  else if (request->limit > 0) {
+    evictcache(request->cachedir, request->limit);
+  }
+  lua_pop(L, 1);                                                  /* ... func */
+}
+
+/* Does the actual work for eris_loadcached in a protected call, so that
+ * memory errors while building paths do not escape it. Returns the function
+ * or error message and the status of the load. */
+static int
+l_loadcached(lua_State *L) {                                       /* request */
+  const CacheRequest *request = (const CacheRequest*)lua_touserdata(L, 1);
+  CacheHeader header;
+  char key[CACHE_KEYLENGTH + 1];
+  const char *path;
+  int status;
+  cacheheader(&header, request);
+  snprintf(key, sizeof(key), "%08lx%08lx",
+           (unsigned long)(header.hash >> 32),
+           (unsigned long)(header.hash & 0xffffffffu));
+  path = lua_pushfstring(L, "%s/%s" CACHE_SUFFIX, request->cachedir, key);
+                                                              /* request path */
+  if (loadcacheentry(L, path, &header, request)) {       /* request path func */
+    lua_pushinteger(L, LUA_OK);                   /* request path func status */
+    return 2;
+  }
+  status = luaL_loadbufferx(L, request->buff, request->size, request->name,
+                            "t");                   /* request path func/error */
+  if (status == LUA_OK) {
+    writecacheentry(L, path, &header, request);          /* request path func */
+  }
+  lua_pushinteger(L, status);               /* request path func/error status */
+  return 2;
+}
+
+/* }======================================================================== */
+
+/*
+** {===========================================================================
+** Library functions.
+** ============================================================================
+*/
+
+static void
+p_header(Info *info) {
+  WRITE_RAW(kHeader, HEADER_LENGTH);
+  WRITE_VALUE(sizeof(lua_Number), uint8_t);
+  WRITE_VALUE(kHeaderNumber, lua_Number);
+  WRITE_VALUE(sizeof(lua_Integer), uint8_t);
+  WRITE_VALUE(sizeof(int), uint8_t);
+  WRITE_VALUE(sizeof(size_t), uint8_t);
+}
+
+static void
+u_header(Info *info) {
+  char header[HEADER_LENGTH];
+  uint8_t number_size;
+  READ_RAW(header, HEADER_LENGTH);
+  if (strncmp(kHeader, header, HEADER_LENGTH)) {
+    luaL_error(info->L, "invalid data");
+  }
+  number_size = READ_VALUE(uint8_t);
+  if (number_size == 0) {
+    /* Old 64-bit versions of eris wrote '\0' and then three random bytes. */
+    /* We skip them here for backwards compatibility. */
+    char throw_away[3];
+    READ_RAW(throw_away, 3);
+
+    number_size = READ_VALUE(uint8_t);
+  }
+  if (number_size != sizeof(lua_Number)) {
+    luaL_error(info->L, "incompatible floating point type");
+  }
+  /* In this case we really do want floating point equality. */
+  if (READ_VALUE(lua_Number) != kHeaderNumber) {
+    luaL_error(info->L, "incompatible floating point representation");
+  }
+  if (READ_VALUE(uint8_t) != sizeof(lua_Integer)) {
+    luaL_error(info->L, "incompatible integer type");
+  }
+  info->u.upi.sizeof_int = READ_VALUE(uint8_t);
+  info->u.upi.sizeof_size_t = READ_VALUE(uint8_t);
+}
+
+static void
+unchecked_persist(lua_State *L, lua_Writer writer, void *ud) {
+  Info info;                                            /* perms buff rootobj */
+  info.L = L;
+  info.level = 0;
+  info.refcount = 0;
+  info.maxComplexity = kMaxComplexity;
+  info.passIOToPersist = kPassIOToPersist;
+  info.generatePath = kGeneratePath;
+  info.u.pi.writer = writer;
+  info.u.pi.ud = ud;
+  info.u.pi.metafield = kPersistKey;
+  info.u.pi.writeDebugInfo = kWriteDebugInformation;
+
+  eris_checkstack(L, 3);
+
+  if (get_setting(L, (void*)&kSettingMaxComplexity)) {
+                                                  /* perms buff rootobj value */
+    info.maxComplexity = lua_tointeger(L, -1);
+    lua_pop(L, 1);                                      /* perms buff rootobj */
+  }
+  if (get_setting(L, (void*)&kSettingGeneratePath)) {
+                                                  /* perms buff rootobj value */
+    info.generatePath = lua_toboolean(L, -1);
+    lua_pop(L, 1);                                      /* perms buff rootobj */
+  }
+  if (get_setting(L, (void*)&kSettingPassIOToPersist)) {
+                                                  /* perms buff rootobj value */
+    info.passIOToPersist = lua_toboolean(L, -1);
+    lua_pop(L, 1);                                      /* perms buff rootobj */
+  }
+  if (get_setting(L, (void*)&kSettingMetafield)) {/* perms buff rootobj value */
+    info.u.pi.metafield = lua_tostring(L, -1);
+    lua_pop(L, 1);                                      /* perms buff rootobj */
+  }
+  if (get_setting(L, (void*)&kSettingWriteDebugInfo)) {
+                                                  /* perms buff rootobj value */
+    info.u.pi.writeDebugInfo = lua_toboolean(L, -1);
+    lua_pop(L, 1);                                      /* perms buff rootobj */
+  }
+
+  lua_newtable(L);                               /* perms buff rootobj reftbl */
+  lua_insert(L, REFTIDX);                        /* perms reftbl buff rootobj */
+  if (info.generatePath) {
+    lua_newtable(L);                        /* perms reftbl buff rootobj path */
+    lua_insert(L, PATHIDX);                 /* perms reftbl buff path rootobj */
+    pushpath(&info, "root");
+  }
+
+  /* Populate perms table with Lua internals. */
+  lua_pushvalue(L, PERMIDX);         /* perms reftbl buff path? rootobj perms */
+  populateperms(L, false);
+  lua_pop(L, 1);                           /* perms reftbl buff path? rootobj */
+
+  p_header(&info);
+  persist(&info);                          /* perms reftbl buff path? rootobj */
+
+  if (info.generatePath) {                  /* perms reftbl buff path rootobj */
+    lua_remove(L, PATHIDX);                      /* perms reftbl buff rootobj */
+  }                                              /* perms reftbl buff rootobj */
+  lua_remove(L, REFTIDX);                               /* perms buff rootobj */
+}
+
+static void
+unchecked_unpersist(lua_State *L, lua_Reader reader, void *ud) {/* perms str? */
+  Info info;
+  info.L = L;
+  info.level = 0;
+  info.refcount = 0;
+  info.maxComplexity = kMaxComplexity;
+  info.generatePath = kGeneratePath;
+  info.passIOToPersist = kPassIOToPersist;
+  info.u.upi.stat = NULL;
+  eris_init(L, &info.u.upi.zio, reader, ud);
+
+  eris_checkstack(L, 3);
+
+  if (get_setting(L, (void*)&kSettingMaxComplexity)) {
+                                                  /* perms buff rootobj value */
+    info.maxComplexity = lua_tointeger(L, -1);
+    lua_pop(L, 1);                                      /* perms buff rootobj */
+  }
+  if (get_setting(L, (void*)&kSettingGeneratePath)) {
+                                                 /* perms buff? rootobj value */
     info.generatePath = lua_toboolean(L, -1);
     lua_pop(L, 1);                                     /* perms buff? rootobj */
   }
@@ -2716,6 +3992,334 @@ LUA_API int luaopen_eris(lua_State *L) {
 
 /* }======================================================================== */
 
+/*
+** {===========================================================================
+** Image statistics.
+** ============================================================================
+*/
+
+/* This unpersists data with the regular unpersist functions, which report
+ * every value they read to the hooks below. That way we collect some
+ * statistics on what takes up how much space, which is helpful when trying to
+ * figure out why some image is larger than expected. The unpersisted objects
+ * are discarded afterwards. Permanents are replaced by stand-ins of the same
+ * type and special persistence functions are never called, so no perms table
+ * is needed and no code from the data runs. */
+
+/* Number of entries in the lists of the largest strings and tables. */
+#define STAT_TOPN 10
+
+/* Number of characters of strings included in the list of largest strings. */
+#define STAT_PREVIEW 32
+
+/* Pseudo type used to count references to previously read objects. */
+#define STAT_REFERENCE ERIS_REFERENCE_OFFSET
+
+/* Entry in the list of largest strings or tables. */
+typedef struct StatEntry {
+  size_t size;
+  int reference;
+  char preview[STAT_PREVIEW + 1];
+} StatEntry;
+
+typedef struct StatInfo {
+  lua_Reader reader;
+  void *ud;
+  size_t fed;       /* total bytes handed to the ZIO by the reader so far */
+  size_t children;  /* total size of values nested in the current value */
+  size_t debugstart;/* position of the debug information being read */
+  lua_Unsigned count[STAT_REFERENCE + 1];
+  size_t bytes[STAT_REFERENCE + 1];
+  size_t code;
+  size_t debug;
+  StatEntry strings[STAT_TOPN];
+  StatEntry tables[STAT_TOPN];
+  int permsidx;     /* stack index of table reference -> permanent name */
+  int hitsidx;      /* stack index of table permanent name -> hit count */
+} StatInfo;
+
+static const char *
+stat_typename(int type) {
+  switch (type) {
+    case LUA_TPROTO: return "proto";
+    case LUA_TUPVAL: return "upval";
+    case ERIS_PERMANENT: return "permanent";
+    case STAT_REFERENCE: return "reference";
+    default: return kTypenames[type];
+  }
+}
+
+/* Reader wrapper keeping track of our position in the data. */
+static const char*
+stat_reader(lua_State *L, void *ud, size_t *sz) {
+  StatInfo *st = (StatInfo*)ud;
+  const char *data = st->reader(L, st->ud, sz);
+  if (data) {
+    st->fed += *sz;
+  }
+  return data;
+}
+
+static size_t
+stat_position(Info *info) {
+  return info->u.upi.stat->fed - info->u.upi.zio.n;
+}
+
+/* Inserts an entry into a list of largest objects if it is large enough. */
+static void
+stat_rank(StatEntry *list, size_t size, int reference,
+          const char *preview, size_t length)
+{
+  int i;
+  if (size <= list[STAT_TOPN - 1].size) {
+    return;
+  }
+  for (i = STAT_TOPN - 1; i > 0 && list[i - 1].size < size; --i) {
+    list[i] = list[i - 1];
+  }
+  list[i].size = size;
+  list[i].reference = reference;
+  if (length > STAT_PREVIEW) {
+    length = STAT_PREVIEW;
+  }
+  memcpy(list[i].preview, preview, length);
+  list[i].preview[length] = '\0';
+}
+
+/* Counts a hit for the permanent with the name on top of the stack. */
+static void
+stat_hit(Info *info) {                                            /* ... name */
+  StatInfo *st = info->u.upi.stat;
+  lua_Integer hits;
+  lua_pushvalue(info->L, -1);                                /* ... name name */
+  lua_rawget(info->L, st->hitsidx);                          /* ... name hits */
+  hits = lua_tointeger(info->L, -1);
+  lua_pop(info->L, 1);                                          /* ... name */
+  lua_pushinteger(info->L, hits + 1);                      /* ... name hits+1 */
+  lua_rawset(info->L, st->hitsidx);                                   /* ... */
+}
+
+/* Stand-in for permanent C functions, never called. */
+static int
+stat_function(lua_State *L) {
+  return luaL_error(L, "stand-in for a permanent value called");
+}
+
+static void
+stat_enter(Info *info, size_t *start, size_t *children) {
+  StatInfo *st = info->u.upi.stat;
+  *start = stat_position(info);
+  *children = st->children;
+  st->children = 0;
+}
+
+/* Tracks count and size per type of the value just read, which is on top of
+ * the stack. The size of a value does not include the size of values nested
+ * in it. */
+static void
+stat_leave(Info *info, int typeOrReference, int reference,
+           size_t start, size_t children)
+{                                                                /* ... obj */
+  StatInfo *st = info->u.upi.stat;
+  const size_t size = stat_position(info) - start;
+  int type = typeOrReference;
+  eris_checkstack(info->L, 2);
+  if (typeOrReference > ERIS_REFERENCE_OFFSET) {
+    type = STAT_REFERENCE;
+    lua_rawgeti(info->L, st->permsidx, typeOrReference - ERIS_REFERENCE_OFFSET);
+    if (!lua_isnil(info->L, -1)) {                          /* ... obj name */
+      stat_hit(info);                                              /* ... obj */
+    }
+    else {
+      lua_pop(info->L, 1);                                         /* ... obj */
+    }
+  }
+  else if (type == LUA_TSTRING) {
+    size_t length;
+    const char *value = lua_tolstring(info->L, -1, &length);
+    stat_rank(st->strings, length, reference, value, length);
+  }
+  else if (type == LUA_TTABLE) {
+    size_t entries = 0;
+    lua_pushnil(info->L);                                      /* ... obj nil */
+    while (lua_next(info->L, -2)) {                          /* ... obj k v */
+      lua_pop(info->L, 1);                                       /* ... obj k */
+      ++entries;
+    }                                                              /* ... obj */
+    stat_rank(st->tables, entries, reference, "", 0);
+  }
+  else if (type == LUA_TPROTO) {
+    st->code += ((Proto*)lua_touserdata(info->L, -1))->sizecode *
+                sizeof(uint32_t);
+  }
+  ++st->count[type];
+  st->bytes[type] += size - st->children;
+  st->children = children + size;
+}
+
+static void
+stat_debuginfo(Info *info, bool begin) {
+  StatInfo *st = info->u.upi.stat;
+  if (begin) {
+    st->debugstart = stat_position(info);
+  }
+  else {
+    st->debug += stat_position(info) - st->debugstart;
+  }
+}
+
+/* Pushes a value of the specified type in place of a permanent value or an
+ * object with special persistence. */
+static void
+stat_standin(Info *info, int type) {                                   /* ... */
+  eris_checkstack(info->L, 1);
+  switch (type) {
+    case LUA_TBOOLEAN:
+      lua_pushboolean(info->L, false);
+      break;
+    case LUA_TLIGHTUSERDATA:
+      lua_pushlightuserdata(info->L, NULL);
+      break;
+    case LUA_TNUMBER:
+      lua_pushinteger(info->L, 0);
+      break;
+    case LUA_TSTRING:
+      lua_pushliteral(info->L, "");
+      break;
+    case LUA_TTABLE:
+      lua_newtable(info->L);
+      break;
+    case LUA_TFUNCTION:
+      lua_pushcfunction(info->L, stat_function);
+      break;
+    case LUA_TUSERDATA:
+      lua_newuserdata(info->L, 0);
+      break;
+    case LUA_TTHREAD:
+      lua_newthread(info->L);
+      break;
+    default:
+      eris_error(info, ERIS_ERR_TYPEU, type);
+  }                                                                /* ... obj */
+}
+
+/* Names the permanent with the key on top of the stack and counts a hit. */
+static void
+stat_permanent(Info *info, int type, int reference) {          /* ... permkey */
+  StatInfo *st = info->u.upi.stat;
+  eris_checkstack(info->L, 3);
+  if (lua_type(info->L, -1) == LUA_TSTRING) {
+    lua_pushvalue(info->L, -1);                         /* ... permkey name */
+  }
+  else {
+    lua_pushfstring(info->L, "<%s #%d>", stat_typename(type), reference);
+  }                                                     /* ... permkey name */
+  lua_pushvalue(info->L, -1);                      /* ... permkey name name */
+  lua_rawseti(info->L, st->permsidx, reference);        /* ... permkey name */
+  stat_hit(info);                                            /* ... permkey */
+}
+
+/* Pushes a list of largest objects as an array of tables. */
+static void
+stat_pushlist(lua_State *L, const StatEntry *list, const char *sizekey,
+              bool withpreview)
+{                                                                      /* ... */
+  int i;
+  lua_createtable(L, STAT_TOPN, 0);                                /* ... list */
+  for (i = 0; i < STAT_TOPN && list[i].size > 0; ++i) {
+    lua_createtable(L, 0, 3);                                /* ... list entry */
+    lua_pushinteger(L, (lua_Integer)list[i].size);
+    lua_setfield(L, -2, sizekey);
+    lua_pushinteger(L, list[i].reference);
+    lua_setfield(L, -2, "id");
+    if (withpreview) {
+      lua_pushstring(L, list[i].preview);
+      lua_setfield(L, -2, "preview");
+    }
+    lua_rawseti(L, -2, i + 1);                                     /* ... list */
+  }
+}
+
+/* Unpersists in a call of its own, so that the perms and reference tables are
+ * at the stack indices the unpersist functions expect them at. */
+static int
+l_stat(lua_State *L) {                                                  /* st */
+  StatInfo *st = (StatInfo*)lua_touserdata(L, 1);
+  Info info;
+  int type, result;
+
+  info.L = L;
+  info.level = 0;
+  info.refcount = 0;
+  info.maxComplexity = kMaxComplexity;
+  info.generatePath = false;
+  info.passIOToPersist = false;
+  info.u.upi.stat = st;
+  eris_init(L, &info.u.upi.zio, stat_reader, st);
+
+  eris_checkstack(L, 7);
+  if (get_setting(L, (void*)&kSettingMaxComplexity)) {            /* st value */
+    info.maxComplexity = lua_tointeger(L, -1);
+  }
+  lua_settop(L, 0);
+  lua_newtable(L);                                                   /* perms */
+  lua_newtable(L);                                            /* perms reftbl */
+  lua_newtable(L);                                        /* perms reftbl res */
+  result = lua_gettop(L);
+  lua_newtable(L);                                  /* perms reftbl res perms */
+  st->permsidx = lua_gettop(L);
+  lua_newtable(L);                             /* perms reftbl res perms hits */
+  st->hitsidx = lua_gettop(L);
+
+  u_header(&info);
+  unpersist(&info);                    /* perms reftbl res perms hits rootobj */
+  lua_pop(L, 1);                               /* perms reftbl res perms hits */
+
+  lua_setfield(L, result, "perms");                  /* perms reftbl res perms */
+  lua_pop(L, 1);                                          /* perms reftbl res */
+
+  lua_pushinteger(L, (lua_Integer)stat_position(&info));
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, (lua_Integer)st->code);
+  lua_setfield(L, -2, "code");
+  lua_pushinteger(L, (lua_Integer)st->debug);
+  lua_setfield(L, -2, "debug");
+
+  lua_newtable(L);                                  /* perms reftbl res count */
+  lua_newtable(L);                            /* perms reftbl res count bytes */
+  for (type = 0; type <= STAT_REFERENCE; ++type) {
+    if (st->count[type] > 0) {
+      lua_pushinteger(L, (lua_Integer)st->count[type]);
+      lua_setfield(L, -3, stat_typename(type));
+      lua_pushinteger(L, (lua_Integer)st->bytes[type]);
+      lua_setfield(L, -2, stat_typename(type));
+    }
+  }
+  lua_setfield(L, result, "bytes");                 /* perms reftbl res count */
+  lua_setfield(L, result, "count");                       /* perms reftbl res */
+
+  stat_pushlist(L, st->strings, "length", true);     /* perms reftbl res list */
+  lua_setfield(L, -2, "strings");                         /* perms reftbl res */
+  stat_pushlist(L, st->tables, "entries", false);    /* perms reftbl res list */
+  lua_setfield(L, -2, "tables");                          /* perms reftbl res */
+  return 1;
+}
+
+static void
+unchecked_stat(lua_State *L, lua_Reader reader, void *ud) {            /* ... */
+  StatInfo st;
+  memset(&st, 0, sizeof(StatInfo));
+  st.reader = reader;
+  st.ud = ud;
+
+  eris_checkstack(L, 2);
+  lua_pushcfunction(L, l_stat);                              /* ... l_stat */
+  lua_pushlightuserdata(L, &st);                          /* ... l_stat st */
+  lua_call(L, 1, 1);                                                /* ... res */
+}
+
+/* }======================================================================== */
+
 /*
 ** {===========================================================================
 ** Public API functions.
@@ -2744,6 +4348,100 @@ eris_undump(lua_State *L, lua_Reader reader, void *ud) {            /* perms? */
   unchecked_unpersist(L, reader, ud);                        /* perms rootobj */
 }
 
+/* Unpersists from an image in a protected call, so that we get a chance to
+ * release the image again if unpersisting fails. */
+static int
+l_undumpimage(lua_State *L) {                                  /* perms image */
+  RBuffer *buff = (RBuffer*)lua_touserdata(L, 2);
+  lua_settop(L, 1);                                                  /* perms */
+  unchecked_unpersist(L, reader, buff);                      /* perms rootobj */
+  return 1;
+}
+
+static void
+undumpimage(lua_State *L, Image *image) {                            /* perms */
+  int status;
+  lua_pushcfunction(L, l_undumpimage);                /* perms l_undumpimage */
+  lua_pushvalue(L, 1);                          /* perms l_undumpimage perms */
+  lua_pushlightuserdata(L, &image->buff);
+                                          /* perms l_undumpimage perms image */
+  status = lua_pcall(L, 2, 1, 0);                    /* perms rootobj/error */
+  closeimage(image);
+  if (status != LUA_OK) {
+    lua_error(L);
+  }
+}
+
+LUA_API void
+eris_stat(lua_State *L, lua_Reader reader, void *ud) {                 /* ... */
+  unchecked_stat(L, reader, ud);                                    /* ... res */
+}
+
+LUA_API void
+eris_undumpfile(lua_State *L, const char *filename) {               /* perms? */
+  Image image;
+  if (lua_gettop(L) > 1) {
+    luaL_error(L, "too many arguments");
+  }
+  luaL_checktype(L, 1, LUA_TTABLE);                                  /* perms */
+  eris_checkstack(L, 3);
+  if (!openimage(&image, filename)) {
+    luaL_error(L, "cannot read %s: %s", filename, strerror(errno));
+  }
+  undumpimage(L, &image);                                    /* perms rootobj */
+}
+
+LUA_API void
+eris_undumpfd(lua_State *L, int fd) {                               /* perms? */
+#if defined(LUA_USE_POSIX)
+  Image image;
+  if (lua_gettop(L) > 1) {
+    luaL_error(L, "too many arguments");
+  }
+  luaL_checktype(L, 1, LUA_TTABLE);                                  /* perms */
+  eris_checkstack(L, 3);
+  if (!mapimage(&image, fd)) {
+    luaL_error(L, "cannot map file descriptor %d: %s", fd, strerror(errno));
+  }
+  undumpimage(L, &image);                                    /* perms rootobj */
+#else
+  (void)fd;
+  luaL_error(L, "file descriptors are not supported on this platform");
+#endif
+}
+
+/** ======================================================================== */
+
+LUA_API int
+eris_loadcached(lua_State *L, const char *buff, size_t size, const char *name,
+                const char *cachedir, size_t limit) {                  /* ... */
+  CacheRequest request;
+  int status;
+  if (name == NULL) {
+    name = "?";
+  }
+  if (cachedir == NULL || (size > 0 && buff[0] == LUA_SIGNATURE[0])) {
+    /* Nothing to gain from caching chunks that are already compiled. */
+    return luaL_loadbufferx(L, buff, size, name, NULL);
+  }
+  if (!lua_checkstack(L, 6)) {
+    return luaL_loadbufferx(L, buff, size, name, "t");
+  }
+  request.buff = buff;
+  request.size = size;
+  request.name = name;
+  request.cachedir = cachedir;
+  request.limit = limit;
+  lua_pushcfunction(L, l_loadcached);                     /* ... l_loadcached */
+  lua_pushlightuserdata(L, &request);             /* ... l_loadcached request */
+  status = lua_pcall(L, 1, 2, 0);                /* ... func/error status? */
+  if (status == LUA_OK) {
+    status = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);                                          /* ... func/error */
+  }
+  return status;
+}
+
 /** ======================================================================== */
 
 LUA_API void
@@ -2764,6 +4462,49 @@ eris_unpersist(lua_State *L, int perms, int value) {                   /* ... */
   lua_call(L, 2, 1);                                           /* ... rootobj */
 }
 
+LUA_API void
+eris_clone(lua_State *L, int perms, lua_State *from, int fromperms,
+           int value) {                                                /* ... */
+  const int top = lua_gettop(from);
+  int running, fromrunning, status;
+  if (from == L || G(from) == G(L)) {
+    luaL_error(L, ERIS_ERR_CLONE);
+  }
+  if (lua_status(from) != LUA_OK) {
+    luaL_error(L, ERIS_ERR_CLONEFROM);
+  }
+  eris_checkstack(L, 5);
+  perms = lua_absindex(L, perms);
+  fromperms = lua_absindex(from, fromperms);
+  value = lua_absindex(from, value);
+
+  /* Objects of 'from' are tracked by address, so they must not be collected
+   * while we copy. Ours are anchored, but collecting in between is a waste of
+   * time, since we do not create any garbage. */
+  running = lua_gc(L, LUA_GCISRUNNING, 0);
+  fromrunning = lua_gc(from, LUA_GCISRUNNING, 0);
+  lua_gc(L, LUA_GCSTOP, 0);
+  lua_gc(from, LUA_GCSTOP, 0);
+
+  lua_pushcfunction(L, l_clone);                               /* ... l_clone */
+  lua_pushvalue(L, perms);                               /* ... l_clone perms */
+  lua_pushlightuserdata(L, from);                   /* ... l_clone perms from */
+  lua_pushinteger(L, fromperms);             /* ... l_clone perms from fperms */
+  lua_pushinteger(L, value);           /* ... l_clone perms from fperms value */
+  status = lua_pcall(L, 4, 1, 0);                          /* ... rootobj/err */
+
+  lua_settop(from, top);
+  if (fromrunning) {
+    lua_gc(from, LUA_GCRESTART, 0);
+  }
+  if (running) {
+    lua_gc(L, LUA_GCRESTART, 0);
+  }
+  if (status != LUA_OK) {
+    lua_error(L);
+  }                                                            /* ... rootobj */
+}
+
 LUA_API void
 eris_get_setting(lua_State *L, const char *name) {                     /* ... */
   eris_checkstack(L, 2);
@@ -68,6 +68,82 @@ LUA_API void eris_dump(lua_State* L, lua_Writer writer, void* ud);
  */
 LUA_API void eris_undump(lua_State* L, lua_Reader reader, void* ud);
 
+/**
+ * This is a variant of eris_undump that reads the persisted data from a file.
+ *
+ * When called, the stack in 'L' must look like this:
+ * 1: perms:table
+ *
+ * On POSIX systems the file is mapped into memory instead of being read, and
+ * strings and byte code are built right from the mapped data. Elsewhere the
+ * file is read into memory in one go.
+ *
+ * The result of the operation will be pushed onto the stack.
+ *
+ * [-0, +1, e]
+ */
+LUA_API void eris_undumpfile(lua_State* L, const char* filename);
+
+/**
+ * Same as eris_undumpfile, but maps an already open file descriptor 'fd'.
+ * The descriptor is not closed. Only supported on POSIX systems, throws an
+ * error on other platforms.
+ *
+ * [-0, +1, e]
+ */
+LUA_API void eris_undumpfd(lua_State* L, int fd);
+
+/**
+ * Loads a chunk of source code like luaL_loadbufferx, but keeps the compiled
+ * byte code in the directory 'cachedir', which must exist. Entries are named
+ * after a hash of 'name' and the source, so later loads of the same source
+ * skip the compiler and undump the byte code instead. Entries keep a copy of
+ * the name and source, which must match for the entry to be used. Entries
+ * written by a different Lua version or build are detected, removed and
+ * recompiled.
+ *
+ * If 'limit' is not zero, the least recently used entries are removed after
+ * writing a new one, until all entries take up at most 'limit' bytes. This is
+ * only supported on POSIX systems, elsewhere entries are never removed.
+ *
+ * Failing to read or write the cache is not an error, the chunk is compiled
+ * from source then. Chunks that are already precompiled are loaded as-is.
+ *
+ * Returns the same status codes as lua_load and pushes the compiled function
+ * or the error message onto the stack.
+ *
+ * [-0, +1, -]
+ */
+LUA_API int eris_loadcached(lua_State* L, const char* buff, size_t size,
+                            const char* name, const char* cachedir,
+                            size_t limit);
+
+/**
+ * Collects statistics about persisted data read via a reader. The data is
+ * unpersisted and the result discarded. No perms table is required: permanent
+ * values are replaced by stand-ins of the same type, special persistence
+ * functions are not called and metatables are not set, so no code from the
+ * data runs.
+ *
+ * The result is a table pushed onto the stack, with these fields:
+ * - 'size'    total size of the data in bytes.
+ * - 'count'   number of values read per type ('string', 'table', 'proto',
+ *             'thread', 'permanent', 'reference', ...).
+ * - 'bytes'   bytes used per type, not counting values nested in them.
+ * - 'code'    total size of function byte code in bytes.
+ * - 'debug'   total size of function debug information in bytes.
+ * - 'strings' array of the largest strings, each a table with the fields
+ *             'length', 'id' (the reference number) and 'preview'.
+ * - 'tables'  array of the largest tables, each a table with the fields
+ *             'entries' and 'id'.
+ * - 'perms'   maps the names of used permanent values to the number of times
+ *             they are referenced. Permanents are named by their perms key if
+ *             it is a string.
+ *
+ * [-0, +1, e]
+ */
+LUA_API void eris_stat(lua_State* L, lua_Reader reader, void* ud);
+
 /**
  * This is a stack-based alternative to eris_dump.
  *
@@ -90,6 +166,31 @@ LUA_API void eris_persist(lua_State* L, int perms, int value);
  */
 LUA_API void eris_unpersist(lua_State* L, int perms, int value);
 
+/**
+ * Copies a value from the Lua state 'from' into 'L', without going through
+ * persisted data in between.
+ *
+ * It expects the perms table of 'L' at the specified index 'perms', and the
+ * perms table of 'from' as used for persisting at the index 'fromperms' and
+ * the value to copy at the index 'value' of the stack of 'from'. It will push
+ * the copy onto the stack of 'L' on success. The result is the same as that of
+ * persisting the value in 'from' and unpersisting it in 'L', with these
+ * differences:
+ * - C functions that are not in the perms table are copied as they are,
+ *   since both states live in the same process.
+ * - Special persistence functions are called without IO objects, see the
+ *   'spio' setting.
+ * - The perms table of 'from' is accessed raw.
+ * The settings of 'from' apply. Nothing is shared between the two states, so
+ * either may be closed afterwards. 'from' must be a different state that is
+ * not suspended. Errors, including those of special persistence functions,
+ * are thrown in 'L', and 'from' is left as it was.
+ *
+ * [-0, +1, e]
+ */
+LUA_API void eris_clone(lua_State* L, int perms, lua_State* from,
+                        int fromperms, int value);
+
 /**
  * Pushes the current value of a setting onto the stack.
  *
@@ -1069,6 +1069,126 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCHEADROOM: {
+      /* can 'data' bytes be allocated, and a short string be interned,
+         without running a collector step or resizing the string table? */
+      res = (g->GCdebt + data <= 0 && !luaS_overloaded(g));
+      break;
+    }
+    case LUA_GCFINCOUNT: {
+      /* number of objects whose finalizers have not run yet */
+      GCObject *o;
+      for (o = g->finobj; o != NULL; o = o->next) res++;
+      for (o = g->tobefnz; o != NULL; o = o->next) res++;
+      break;
+    }
+    default: res = -1;  /* invalid option */
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** String table statistics and growth policy
+*/
+
+LUA_API int lua_strtab (lua_State *L, int what, int data) {
+  int res = 0;
+  global_State *g;
+  lua_lock(L);
+  g = G(L);
+  switch (what) {
+    case LUA_STRTSIZE: {
+      res = g->strt.size;
+      break;
+    }
+    case LUA_STRTCOUNT: {
+      res = g->strt.nuse;
+      break;
+    }
+    case LUA_STRTUSED: {
+      int longest;
+      luaS_chainstats(L, &res, &longest);
+      break;
+    }
+    case LUA_STRTMAXCHAIN: {
+      int used;
+      luaS_chainstats(L, &used, &res);
+      break;
+    }
+    case LUA_STRTSETGROW: {
+      res = g->strtgrow;
+      if (data < 10) data = 10;  /* avoid ridiculous low values (and 0) */
+      g->strtgrow = data;
+      if (g->strtshrink >= data / 2)  /* would shrink right after growing? */
+        g->strtshrink = data / 2 - 1;
+      break;
+    }
+    case LUA_STRTSETSHRINK: {
+      res = g->strtshrink;
+      if (data < 0) data = 0;  /* never shrink */
+      else if (data >= g->strtgrow / 2)  /* would grow right after shrinking? */
+        data = g->strtgrow / 2 - 1;
+      g->strtshrink = data;
+      break;
+    }
+    case LUA_STRTRESIZE: {
+      int size = MINSTRTABSIZE;
+      while (size < data && size <= MAX_INT/2) size *= 2;  /* power of 2 */
+      luaS_resize(L, size);
+      res = size;
+      break;
+    }
+    default: res = -1;  /* invalid option */
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** CPU usage of a thread: instructions executed, time spent running in
+** 'lua_resume' (in nanoseconds, only measured after LUA_CPUSETTIMING) and
+** the instruction budget. A thread that runs out of its budget yields, or
+** raises an error if it cannot yield; LUA_CPUYIELDED tells such a yield
+** from others. Budgets are the number of instructions left, -1 for no
+** budget.
+*/
+LUA_API lua_Integer lua_cpuusage (lua_State *L, int what, lua_Integer data) {
+  lua_Integer res;
+  lua_lock(L);
+  switch (what) {
+    case LUA_CPUCOUNT: {
+      res = l_castU2S(instrcount(L));
+      break;
+    }
+    case LUA_CPUTIME: {
+      res = l_castU2S(L->cputime);
+      break;
+    }
+    case LUA_CPUBUDGET: {
+      res = (L->instrbudget == NOINSTRBUDGET) ? -1 : L->instrleft;
+      break;
+    }
+    case LUA_CPUSETBUDGET: {
+      res = (L->instrbudget == NOINSTRBUDGET) ? -1 : L->instrleft;
+      L->ninstr = instrcount(L);  /* start counting anew */
+      if (data < 0 || data > NOINSTRBUDGET - 1)  /* no budget? */
+        data = NOINSTRBUDGET;
+      L->instrleft = L->instrbudget = data;
+      break;
+    }
+    case LUA_CPUSETTIMING: {
+      res = L->cputiming;
+      L->cputiming = (data != 0);
+      break;
+    }
+    case LUA_CPUYIELDED: {
+      res = (L->status == LUA_YIELD &&
+             (L->ci->callstatus & CIST_BUDGETYIELD) != 0);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1134,6 +1254,25 @@ LUA_API void lua_len (lua_State *L, int idx) {
 }
 
 
+/*
+** Sorts t[1..n] in place with the primitive '<' if 't' has no metatable and
+** those elements are all in its array part and all integers, all floats or
+** all strings. Returns 0 without changing the table otherwise, leaving the
+** sort to the caller.
+*/
+LUA_API int lua_sortarray (lua_State *L, int idx, lua_Integer n) {
+  StkId t;
+  int res = 0;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(ttistable(t), "table expected");
+  if (hvalue(t)->metatable == NULL && 0 <= n && n <= MAX_INT)
+    res = luaH_sortarray(L, hvalue(t), cast(unsigned int, n));
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
   lua_Alloc f;
   lua_lock(L);
@@ -1164,6 +1303,26 @@ LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
 }
 
 
+/*
+** Pushes a new string with undefined contents and returns its buffer, which
+** must be filled in before the string is used. Only strings longer than
+** LUAI_MAXSHORTLEN can be created like this, as shorter ones are interned by
+** contents; for those it returns NULL and pushes nothing.
+*/
+LUA_API char *lua_newstring (lua_State *L, size_t len) {
+  TString *ts;
+  if (len <= LUAI_MAXSHORTLEN)
+    return NULL;
+  lua_lock(L);
+  luaC_checkGC(L);
+  ts = luaS_createlngstr(L, len);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  lua_unlock(L);
+  return getaddrstr(ts);
+}
+
+
 
 static const char *aux_upvalue (StkId fi, int n, TValue **val,
                                 CClosure **owner, UpVal **uv) {
@@ -0,0 +1,437 @@
+/*
+** Byte arrays: mutable blocks of bytes with typed access, meant to model
+** the memory of emulated machines.
+** See Copyright Notice in lua.h
+*/
+
+#define lbytelib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+#define BYTES		"bytes"
+
+
+/*
+** A byte array owns its contents, which follow this header in the same
+** userdata, so that they count against the memory limits of the state and
+** never move. A view is a header alone, pointing into the contents of the
+** array it was made from, which is kept alive as its user value.
+*/
+typedef struct Bytes {
+  unsigned char *p;  /* first byte */
+  size_t n;  /* number of bytes */
+} Bytes;
+
+
+#define checkbytes(L,i)	((Bytes *)luaL_checkudata(L, i, BYTES))
+
+
+/* returns the contents of the byte array at 'arg', or NULL if it is not one */
+LUALIB_API unsigned char *luaL_testbytes (lua_State *L, int arg, size_t *len) {
+  Bytes *b = (Bytes *)luaL_testudata(L, arg, BYTES);
+  if (b == NULL) return NULL;
+  if (len) *len = b->n;
+  return b->p;
+}
+
+
+/* source operand of a copy, comparison or bitwise operation */
+static const unsigned char *checksource (lua_State *L, int arg, size_t *len) {
+  const unsigned char *p = luaL_testbytes(L, arg, len);
+  if (p == NULL)
+    p = (const unsigned char *)luaL_checklstring(L, arg, len);
+  return p;
+}
+
+
+/* translate a relative position, negative means back from the end */
+static lua_Integer posrelat (lua_Integer pos, size_t len) {
+  if (pos >= 0) return pos;
+  else if (0u - (size_t)pos > len) return 0;
+  else return (lua_Integer)len + pos + 1;
+}
+
+
+/*
+** Reads the optional range 'i'..'j' at 'arg' and 'arg' + 1 the way
+** 'string.sub' does. Returns the offset of the first byte and sets 'len'
+** to the length of the range.
+*/
+static size_t getrange (lua_State *L, const Bytes *b, int arg, size_t *len) {
+  lua_Integer i = posrelat(luaL_optinteger(L, arg, 1), b->n);
+  lua_Integer j = posrelat(luaL_optinteger(L, arg + 1, -1), b->n);
+  if (i < 1) i = 1;
+  if (j > (lua_Integer)b->n) j = (lua_Integer)b->n;
+  *len = (i <= j) ? (size_t)(j - i) + 1 : 0;
+  return (i <= j) ? (size_t)i - 1 : 0;
+}
+
+
+/* checks that 'size' bytes starting at position 'arg' are in the array */
+static unsigned char *checkpos (lua_State *L, const Bytes *b, int arg,
+                                size_t size) {
+  lua_Integer pos = luaL_checkinteger(L, arg);
+  luaL_argcheck(L, pos >= 1 && size <= b->n &&
+                   (lua_Unsigned)pos - 1 <= b->n - size, arg,
+                   "position out of range");
+  return b->p + (pos - 1);
+}
+
+
+static Bytes *newbytes (lua_State *L, size_t n) {
+  Bytes *b;
+  if (n > (size_t)(~(size_t)0) - sizeof(Bytes))
+    luaL_error(L, "byte array too large");
+  b = (Bytes *)lua_newuserdata(L, sizeof(Bytes) + n);
+  b->p = (unsigned char *)(b + 1);
+  b->n = n;
+  luaL_setmetatable(L, BYTES);
+  return b;
+}
+
+
+/*
+** Creates a byte array, either 'size' bytes set to 'value' (zero by
+** default) or a copy of a string. Arrays are persisted as a closure of
+** this function with their contents as upvalue (see 'b_persist'); Eris
+** adds it to the permanents by itself (see 'eris_permbytelib').
+*/
+static int b_new (lua_State *L) {
+  int init = lua_upvalueindex(1);
+  Bytes *b;
+  if (lua_type(L, init) == LUA_TNONE)  /* not restoring a persisted one? */
+    init = 1;
+  if (lua_type(L, init) == LUA_TNUMBER) {
+    lua_Integer size = luaL_checkinteger(L, init);
+    int value = (int)luaL_optinteger(L, init + 1, 0);
+    luaL_argcheck(L, size >= 0, init, "invalid size");
+    b = newbytes(L, (size_t)size);
+    memset(b->p, value, b->n);
+  }
+  else {
+    size_t len;
+    const char *s = luaL_checklstring(L, init, &len);
+    b = newbytes(L, len);
+    memcpy(b->p, s, len);
+  }
+  return 1;
+}
+
+
+/*
+** Returns a view of the bytes 'i'..'j', which shares the contents of the
+** array; writes through either are seen by both. Views are persisted as a
+** closure of this function with the array and range as upvalues, so that
+** Eris keeps them sharing the same array.
+*/
+static int b_view (lua_State *L) {
+  const Bytes *b;
+  Bytes *v;
+  size_t off, len;
+  if (lua_type(L, lua_upvalueindex(1)) != LUA_TNONE) {  /* restoring? */
+    lua_settop(L, 0);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_pushvalue(L, lua_upvalueindex(3));
+  }
+  b = checkbytes(L, 1);
+  off = getrange(L, b, 2, &len);
+  v = (Bytes *)lua_newuserdata(L, sizeof(Bytes));
+  v->p = b->p + off;
+  v->n = len;
+  luaL_setmetatable(L, BYTES);
+  if (lua_getuservalue(L, 1) == LUA_TNIL) {  /* 'b' owns its contents? */
+    lua_pop(L, 1);
+    lua_pushvalue(L, 1);
+  }
+  lua_setuservalue(L, -2);  /* view keeps the owner alive */
+  return 1;
+}
+
+
+/* returns a string with a copy of the bytes 'i'..'j' */
+static int b_tostring (lua_State *L) {
+  const Bytes *b = checkbytes(L, 1);
+  size_t len;
+  size_t off = getrange(L, b, 2, &len);
+  lua_pushlstring(L, (const char *)b->p + off, len);
+  return 1;
+}
+
+
+/* sets the bytes 'i'..'j' to 'value' */
+static int b_fill (lua_State *L) {
+  Bytes *b = checkbytes(L, 1);
+  int value = (int)luaL_checkinteger(L, 2);
+  size_t len;
+  size_t off = getrange(L, b, 3, &len);
+  memset(b->p + off, value, len);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** b:copy(pos, src [, i [, j]]) copies the bytes 'i'..'j' of 'src', a byte
+** array or a string, to 'b' starting at 'pos'. The source and destination
+** may overlap.
+*/
+static int b_copy (lua_State *L) {
+  Bytes *b = checkbytes(L, 1);
+  Bytes src;
+  size_t off, len;
+  unsigned char *dest;
+  src.p = (unsigned char *)checksource(L, 3, &src.n);
+  off = getrange(L, &src, 4, &len);
+  dest = checkpos(L, b, 2, len);
+  memmove(dest, src.p + off, len);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** Compares two byte arrays or strings byte by byte, returning a negative
+** number, zero or a positive number like 'memcmp'. A prefix sorts first.
+*/
+static int b_compare (lua_State *L) {
+  size_t l1, l2;
+  const unsigned char *p1 = checksource(L, 1, &l1);
+  const unsigned char *p2 = checksource(L, 2, &l2);
+  int res = memcmp(p1, p2, (l1 < l2) ? l1 : l2);
+  if (res == 0 && l1 != l2)
+    res = (l1 < l2) ? -1 : 1;
+  lua_pushinteger(L, (res > 0) - (res < 0));
+  return 1;
+}
+
+
+static int b_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkbytes(L, 1)->n);
+  return 1;
+}
+
+
+/*
+** {======================================================
+** Typed access
+** =======================================================
+*/
+
+static lua_Unsigned getuint (const unsigned char *p, int size, int islittle) {
+  lua_Unsigned res = 0;
+  int i;
+  for (i = 0; i < size; i++)
+    res = (res << 8) | p[islittle ? size - 1 - i : i];
+  return res;
+}
+
+
+static void setuint (unsigned char *p, lua_Unsigned v, int size,
+                     int islittle) {
+  int i;
+  for (i = 0; i < size; i++) {
+    p[islittle ? i : size - 1 - i] = (unsigned char)(v & 0xFF);
+    v >>= 8;
+  }
+}
+
+
+static int getint (lua_State *L, int size, int islittle) {
+  const Bytes *b = checkbytes(L, 1);
+  const unsigned char *p = checkpos(L, b, 2, size);
+  lua_pushinteger(L, (lua_Integer)getuint(p, size, islittle));
+  return 1;
+}
+
+
+/* values are truncated to 'size' bytes, as 'bit32' truncates to 32 bits */
+static int setint (lua_State *L, int size, int islittle) {
+  Bytes *b = checkbytes(L, 1);
+  unsigned char *p = checkpos(L, b, 2, size);
+  setuint(p, (lua_Unsigned)luaL_checkinteger(L, 3), size, islittle);
+  return 0;
+}
+
+
+static int b_u8 (lua_State *L) {
+  const Bytes *b = checkbytes(L, 1);
+  lua_pushinteger(L, *checkpos(L, b, 2, 1));
+  return 1;
+}
+
+static int b_u16le (lua_State *L) { return getint(L, 2, 1); }
+static int b_u16be (lua_State *L) { return getint(L, 2, 0); }
+static int b_u32le (lua_State *L) { return getint(L, 4, 1); }
+static int b_u32be (lua_State *L) { return getint(L, 4, 0); }
+static int b_i64le (lua_State *L) { return getint(L, 8, 1); }
+static int b_i64be (lua_State *L) { return getint(L, 8, 0); }
+
+
+static int b_setu8 (lua_State *L) {
+  Bytes *b = checkbytes(L, 1);
+  unsigned char *p = checkpos(L, b, 2, 1);
+  *p = (unsigned char)luaL_checkinteger(L, 3);
+  return 0;
+}
+
+static int b_setu16le (lua_State *L) { return setint(L, 2, 1); }
+static int b_setu16be (lua_State *L) { return setint(L, 2, 0); }
+static int b_setu32le (lua_State *L) { return setint(L, 4, 1); }
+static int b_setu32be (lua_State *L) { return setint(L, 4, 0); }
+static int b_seti64le (lua_State *L) { return setint(L, 8, 1); }
+static int b_seti64be (lua_State *L) { return setint(L, 8, 0); }
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Bitwise operations
+** =======================================================
+*/
+
+#define OP_AND	0
+#define OP_OR	1
+#define OP_XOR	2
+
+
+/*
+** b:band(pos, src) and friends combine the bytes of 'src', a byte array or
+** a string, into 'b' starting at 'pos'.
+*/
+static int bitop (lua_State *L, int op) {
+  Bytes *b = checkbytes(L, 1);
+  size_t len, i;
+  const unsigned char *src = checksource(L, 3, &len);
+  unsigned char *dest = checkpos(L, b, 2, len);
+  switch (op) {
+    case OP_AND: for (i = 0; i < len; i++) dest[i] &= src[i]; break;
+    case OP_OR: for (i = 0; i < len; i++) dest[i] |= src[i]; break;
+    default: for (i = 0; i < len; i++) dest[i] ^= src[i]; break;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int b_band (lua_State *L) { return bitop(L, OP_AND); }
+static int b_bor (lua_State *L) { return bitop(L, OP_OR); }
+static int b_bxor (lua_State *L) { return bitop(L, OP_XOR); }
+
+
+/* inverts the bytes 'i'..'j' */
+static int b_bnot (lua_State *L) {
+  Bytes *b = checkbytes(L, 1);
+  size_t len, i;
+  unsigned char *p = b->p + getrange(L, b, 2, &len);
+  for (i = 0; i < len; i++)
+    p[i] = (unsigned char)~p[i];
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/* Eris: persist as a closure that rebuilds the array or the view */
+static int b_persist (lua_State *L) {
+  const Bytes *b = checkbytes(L, 1);
+  if (lua_getuservalue(L, 1) == LUA_TNIL) {  /* owns its contents? */
+    lua_pushlstring(L, (const char *)b->p, b->n);
+    lua_pushcclosure(L, b_new, 1);
+  }
+  else {
+    const Bytes *owner = (const Bytes *)lua_touserdata(L, -1);
+    lua_Integer i = (lua_Integer)(b->p - owner->p) + 1;
+    lua_pushinteger(L, i);
+    lua_pushinteger(L, i + (lua_Integer)b->n - 1);
+    lua_pushcclosure(L, b_view, 3);
+  }
+  return 1;
+}
+
+
+static const luaL_Reg b_funcs[] = {
+  {"new", b_new},
+  {"view", b_view},
+  {"tostring", b_tostring},
+  {"fill", b_fill},
+  {"copy", b_copy},
+  {"compare", b_compare},
+  {"u8", b_u8},
+  {"u16le", b_u16le},
+  {"u16be", b_u16be},
+  {"u32le", b_u32le},
+  {"u32be", b_u32be},
+  {"i64le", b_i64le},
+  {"i64be", b_i64be},
+  {"setu8", b_setu8},
+  {"setu16le", b_setu16le},
+  {"setu16be", b_setu16be},
+  {"setu32le", b_setu32le},
+  {"setu32be", b_setu32be},
+  {"seti64le", b_seti64le},
+  {"seti64be", b_seti64be},
+  {"band", b_band},
+  {"bor", b_bor},
+  {"bxor", b_bxor},
+  {"bnot", b_bnot},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg b_meta[] = {
+  {"__len", b_len},
+  {"__tostring", b_tostring},
+  {"__persist", b_persist},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_bytes (lua_State *L) {
+  luaL_newlib(L, b_funcs);
+  luaL_newmetatable(L, BYTES);
+  luaL_setfuncs(L, b_meta, 0);
+  lua_pushvalue(L, -2);
+  lua_setfield(L, -2, "__index");  /* metatable.__index = bytes */
+  lua_pop(L, 1);  /* pop metatable */
+  return 1;
+}
+
+
+void eris_permbytelib(lua_State *L, int forUnpersist) {
+  luaL_checktype(L, -1, LUA_TTABLE);
+  luaL_checkstack(L, 2, NULL);
+
+  if (forUnpersist) {
+    lua_pushstring(L, "__eris.bytelib_new");
+    lua_pushcfunction(L, b_new);
+  }
+  else {
+    lua_pushcfunction(L, b_new);
+    lua_pushstring(L, "__eris.bytelib_new");
+  }
+  lua_rawset(L, -3);
+
+  if (forUnpersist) {
+    lua_pushstring(L, "__eris.bytelib_view");
+    lua_pushcfunction(L, b_view);
+  }
+  else {
+    lua_pushcfunction(L, b_view);
+    lua_pushstring(L, "__eris.bytelib_view");
+  }
+  lua_rawset(L, -3);
+}
+
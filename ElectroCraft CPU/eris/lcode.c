@@ -12,12 +12,14 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lua.h"
 
 #include "lcode.h"
 #include "ldebug.h"
 #include "ldo.h"
+#include "lfunc.h"
 #include "lgc.h"
 #include "llex.h"
 #include "lmem.h"
@@ -952,3 +954,559 @@ void luaK_setlist (FuncState *fs, int base, int nelems, int tostore) {
   fs->freereg = base + 1;  /* free registers with list values */
 }
 
+
+
+/*
+** {======================================================
+** Peephole optimizer
+** =======================================================
+*/
+
+/*
+** Optional pass over the code of a freshly loaded function, enabled by
+** an 'o' in the load mode (see 'f_parser'). It folds comparisons between
+** constants, threads jumps, removes unreachable code, no-op jumps and dead
+** stores to temporaries, and lets instructions write their result straight
+** to the destination of a following MOVE. It only ever runs before the
+** function is first called, so no 'savedpc' can point into the code it
+** rewrites. Line information is kept per instruction.
+*/
+
+/* words in a register set */
+#define REGWORDS	(256 / 32)
+
+/* instruction flags */
+#define OF_REACHED	1  /* reachable from the function entry */
+#define OF_TARGET	2  /* reached other than by falling through */
+#define OF_FIXED	4  /* must stay right after its predecessor */
+#define OF_DEAD		8  /* removed */
+
+typedef struct OptState {
+  lua_State *L;
+  Proto *f;
+  Instruction *code;
+  int n;  /* number of instructions */
+  unsigned int *live;  /* registers live before each instruction */
+  int *map;  /* old pc -> new pc */
+  lu_byte *flags;
+  unsigned int pinned[REGWORDS];  /* registers captured by closures */
+} OptState;
+
+
+static void addreg (unsigned int *set, int r) {
+  if (r < 256)
+    set[r / 32] |= 1u << (r % 32);
+}
+
+
+static void addrange (unsigned int *set, int from, int to) {
+  for (; from < to; from++)
+    addreg(set, from);
+}
+
+
+static void addrk (unsigned int *set, int rk) {
+  if (!ISK(rk))
+    addreg(set, rk);
+}
+
+
+static int hasreg (const unsigned int *set, int r) {
+  return (set[r / 32] & (1u << (r % 32))) != 0;
+}
+
+
+static int jumpdest (Instruction i, int pc) {
+  return pc + 1 + GETARG_sBx(i);
+}
+
+
+static int hasjump (OpCode op) {
+  return (op == OP_JMP || op == OP_FORLOOP || op == OP_FORPREP ||
+          op == OP_TFORLOOP || op == OP_FORILOOP || op == OP_FORIPREP);
+}
+
+
+/*
+** Instructions that skip or consume the next instruction, which thus has
+** to stay right after them.
+*/
+static int fixesnext (Instruction i) {
+  switch (GET_OPCODE(i)) {
+    case OP_LOADBOOL: return (GETARG_C(i) != 0);
+    case OP_SETLIST: return (GETARG_C(i) == 0);
+    case OP_LOADKX: case OP_TFORCALL: return 1;
+    default: return testTMode(GET_OPCODE(i));
+  }
+}
+
+
+/* collects the successors of instruction 'pc'; returns their number */
+static int successors (const OptState *os, int pc, int *succ) {
+  Instruction i = os->code[pc];
+  switch (GET_OPCODE(i)) {
+    case OP_JMP: case OP_FORPREP: case OP_FORIPREP:
+      succ[0] = jumpdest(i, pc);
+      return 1;
+    case OP_FORLOOP: case OP_TFORLOOP: case OP_FORILOOP:
+      succ[0] = jumpdest(i, pc);
+      succ[1] = pc + 1;
+      return 2;
+    case OP_RETURN: case OP_EXTRAARG:
+      return 0;
+    case OP_EQ: case OP_LT: case OP_LE: case OP_TEST: case OP_TESTSET:
+      succ[0] = pc + 1;
+      succ[1] = pc + 2;
+      return 2;
+    case OP_LOADBOOL: case OP_SETLIST: case OP_LOADKX:
+      succ[0] = pc + 1 + fixesnext(i);
+      return 1;
+    default:
+      succ[0] = pc + 1;
+      return 1;
+  }
+}
+
+
+/*
+** Registers read ('use') and written ('def') by instruction 'pc'. Writes
+** that may not happen are left out and reads up to 'top' cover the whole
+** frame, so both sets err on the side of keeping registers alive.
+*/
+static void regeffects (const OptState *os, int pc, unsigned int *use,
+                                                    unsigned int *def) {
+  Instruction i = os->code[pc];
+  int a = GETARG_A(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  int top = os->f->maxstacksize;
+  memset(use, 0, REGWORDS * sizeof(unsigned int));
+  memset(def, 0, REGWORDS * sizeof(unsigned int));
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: case OP_UNM: case OP_BNOT: case OP_NOT: case OP_LEN:
+      addreg(use, b); addreg(def, a);
+      break;
+    case OP_LOADK: case OP_LOADKX: case OP_LOADBOOL: case OP_GETUPVAL:
+    case OP_NEWTABLE: case OP_CLOSURE:
+      addreg(def, a);
+      break;
+    case OP_LOADNIL:
+      addrange(def, a, a + b + 1);
+      break;
+    case OP_GETTABUP:
+      addrk(use, c); addreg(def, a);
+      break;
+    case OP_GETTABLE:
+      addreg(use, b); addrk(use, c); addreg(def, a);
+      break;
+    case OP_SETTABUP:
+      addrk(use, b); addrk(use, c);
+      break;
+    case OP_SETUPVAL: case OP_TEST:
+      addreg(use, a);
+      break;
+    case OP_SETTABLE:
+      addreg(use, a); addrk(use, b); addrk(use, c);
+      break;
+    case OP_SELF:
+      addreg(use, b); addrk(use, c); addrange(def, a, a + 2);
+      break;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_POW:
+    case OP_DIV: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR:
+    case OP_SHL: case OP_SHR:
+      addrk(use, b); addrk(use, c); addreg(def, a);
+      break;
+    case OP_CONCAT:
+      addrange(use, b, c + 1); addreg(def, a);
+      break;
+    case OP_EQ: case OP_LT: case OP_LE:
+      addrk(use, b); addrk(use, c);
+      break;
+    case OP_TESTSET:
+      addreg(use, b);
+      break;
+    case OP_CALL: case OP_TAILCALL:
+      addrange(use, a, b ? a + b : top);
+      if (c > 1) addrange(def, a, a + c - 1);
+      break;
+    case OP_RETURN:
+      addrange(use, a, b ? a + b - 1 : top);
+      break;
+    case OP_FORLOOP: case OP_FORPREP: case OP_FORILOOP: case OP_FORIPREP:
+      addrange(use, a, a + 3);
+      break;
+    case OP_TFORCALL:
+      addrange(use, a, a + 3); addrange(def, a + 3, a + 3 + c);
+      break;
+    case OP_TFORLOOP:
+      addreg(use, a + 1);
+      break;
+    case OP_SETLIST:
+      addrange(use, a, b ? a + b + 1 : top);
+      break;
+    case OP_VARARG:
+      if (b > 1) addrange(def, a, a + b - 1);
+      break;
+    default:  /* OP_JMP, OP_EXTRAARG */
+      break;
+  }
+}
+
+
+/*
+** Replaces comparisons between two constants by jumps: one over the
+** following jump if it is never taken, or a no-op if it always is.
+** Order comparisons of strings depend on the locale, so only numbers
+** are folded there.
+*/
+static void foldcompares (OptState *os) {
+  int pc;
+  for (pc = 0; pc + 1 < os->n; pc++) {
+    Instruction i = os->code[pc];
+    OpCode op = GET_OPCODE(i);
+    const TValue *rb, *rc;
+    int res;
+    if ((op != OP_EQ && op != OP_LT && op != OP_LE) ||
+        !ISK(GETARG_B(i)) || !ISK(GETARG_C(i)) ||
+        GET_OPCODE(os->code[pc + 1]) != OP_JMP)
+      continue;
+    rb = &os->f->k[INDEXK(GETARG_B(i))];
+    rc = &os->f->k[INDEXK(GETARG_C(i))];
+    if (op == OP_EQ)
+      res = luaV_rawequalobj(rb, rc);
+    else if (ttisnumber(rb) && ttisnumber(rc))
+      res = (op == OP_LT) ? luaV_lessthan(os->L, rb, rc)
+                          : luaV_lessequal(os->L, rb, rc);
+    else
+      continue;  /* may raise an error or depend on the locale */
+    os->code[pc] = CREATE_ABx(OP_JMP, 0,
+                              MAXARG_sBx + (res == GETARG_A(i) ? 0 : 1));
+  }
+}
+
+
+/*
+** Retargets jumps to jumps to their final destination, merging the
+** upvalue levels they close, and replaces unconditional jumps to a
+** return by the return itself.
+*/
+static void threadjumps (OptState *os) {
+  int pc;
+  for (pc = 0; pc < os->n; pc++) {
+    Instruction i = os->code[pc];
+    int a, dest, hops;
+    if (GET_OPCODE(i) != OP_JMP)
+      continue;
+    a = GETARG_A(i);
+    dest = jumpdest(i, pc);
+    for (hops = 0; hops < os->n && dest >= 0 && dest < os->n &&
+                   dest != pc && GET_OPCODE(os->code[dest]) == OP_JMP; hops++) {
+      Instruction j = os->code[dest];
+      int next = jumpdest(j, dest);
+      if (GETARG_A(j) != 0 && a != 0 && GETARG_A(j) != a)
+        break;  /* would close upvalues at different levels */
+      if (next < 0 || next >= os->n)
+        break;
+      if (a == 0) a = GETARG_A(j);
+      dest = next;
+    }
+    if (dest < 0 || dest >= os->n)
+      continue;  /* malformed code */
+    if (GET_OPCODE(os->code[dest]) == OP_RETURN &&
+        GETARG_B(os->code[dest]) != 0 &&
+        !(pc > 0 && testTMode(GET_OPCODE(os->code[pc - 1]))))
+      os->code[pc] = os->code[dest];  /* 'return' closes upvalues anyway */
+    else {
+      SETARG_A(os->code[pc], a);
+      SETARG_sBx(os->code[pc], dest - pc - 1);
+    }
+  }
+}
+
+
+/*
+** Flags reachable instructions, jump targets and instructions that must
+** stay after their predecessor, and removes unreachable ones. Returns 0
+** if the code jumps outside of the function.
+*/
+static int markcode (OptState *os) {
+  int *stack = os->map;  /* not in use yet */
+  int top = 0;
+  int pc;
+  memset(os->flags, 0, os->n * sizeof(lu_byte));
+  for (pc = 1; pc < os->n; pc++) {
+    if (fixesnext(os->code[pc - 1]))
+      os->flags[pc] |= OF_FIXED;
+  }
+  os->flags[0] |= OF_REACHED;
+  stack[top++] = 0;
+  while (top > 0) {
+    int succ[3];
+    int k, ns;
+    pc = stack[--top];
+    ns = successors(os, pc, succ);
+    if (fixesnext(os->code[pc]))
+      succ[ns++] = pc + 1;  /* keep what it skips or consumes */
+    for (k = 0; k < ns; k++) {
+      int t = succ[k];
+      if (t < 0 || t >= os->n)
+        return 0;
+      if (t != pc + 1)
+        os->flags[t] |= OF_TARGET;
+      if (!(os->flags[t] & OF_REACHED)) {
+        os->flags[t] |= OF_REACHED;
+        stack[top++] = t;
+      }
+    }
+  }
+  for (pc = 0; pc < os->n; pc++) {
+    if (!(os->flags[pc] & OF_REACHED))
+      os->flags[pc] |= OF_DEAD;
+  }
+  return 1;
+}
+
+
+/* registers live right after instruction 'pc' */
+static void liveout (const OptState *os, int pc, unsigned int *out) {
+  int succ[2];
+  int k, w, ns = successors(os, pc, succ);
+  memcpy(out, os->pinned, REGWORDS * sizeof(unsigned int));
+  for (k = 0; k < ns; k++) {
+    const unsigned int *in = &os->live[succ[k] * REGWORDS];
+    for (w = 0; w < REGWORDS; w++)
+      out[w] |= in[w];
+  }
+}
+
+
+/*
+** Computes the registers live before each reachable instruction.
+** Registers captured by closures count as always live.
+*/
+static void liveness (OptState *os) {
+  unsigned int out[REGWORDS], use[REGWORDS], def[REGWORDS];
+  int pc, w, changed;
+  memset(os->pinned, 0, sizeof(os->pinned));
+  memset(os->live, 0, os->n * REGWORDS * sizeof(unsigned int));
+  for (pc = 0; pc < os->n; pc++) {
+    Instruction i = os->code[pc];
+    if (GET_OPCODE(i) == OP_CLOSURE && !(os->flags[pc] & OF_DEAD)) {
+      Proto *p = os->f->p[GETARG_Bx(i)];
+      int k;
+      for (k = 0; k < p->sizeupvalues; k++) {
+        if (p->upvalues[k].instack)
+          addreg(os->pinned, p->upvalues[k].idx);
+      }
+    }
+  }
+  do {
+    changed = 0;
+    for (pc = os->n - 1; pc >= 0; pc--) {
+      unsigned int *in = &os->live[pc * REGWORDS];
+      if (os->flags[pc] & OF_DEAD)
+        continue;
+      liveout(os, pc, out);
+      regeffects(os, pc, use, def);
+      for (w = 0; w < REGWORDS; w++) {
+        unsigned int v = use[w] | (out[w] & ~def[w]);
+        if (v != in[w]) {
+          in[w] = v;
+          changed = 1;
+        }
+      }
+    }
+  } while (changed);
+}
+
+
+/*
+** Whether register 'r' may be dropped after instruction 'pc': it is
+** not read again and not a named local, so that debug information still
+** shows the values of all locals.
+*/
+static int istempdead (const OptState *os, int pc, int r) {
+  unsigned int out[REGWORDS];
+  liveout(os, pc, out);
+  return (!hasreg(out, r) &&
+          luaF_getlocalname(os->f, r + 1, pc) == NULL &&
+          luaF_getlocalname(os->f, r + 1, pc + 1) == NULL);
+}
+
+
+/* instructions writing only R(A), that may write it somewhere else */
+static int writesonlya (Instruction i) {
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: case OP_LOADK: case OP_GETUPVAL: case OP_GETTABUP:
+    case OP_GETTABLE: case OP_NEWTABLE: case OP_ADD: case OP_SUB:
+    case OP_MUL: case OP_MOD: case OP_POW: case OP_DIV: case OP_IDIV:
+    case OP_BAND: case OP_BOR: case OP_BXOR: case OP_SHL: case OP_SHR:
+    case OP_UNM: case OP_BNOT: case OP_NOT: case OP_LEN: case OP_CONCAT:
+    case OP_CLOSURE:
+      return 1;
+    case OP_LOADBOOL:
+      return (GETARG_C(i) == 0);
+    default:
+      return 0;
+  }
+}
+
+
+/*
+** Turns 'R(T) := x; R(C) := R(T)' into 'R(C) := x' when T is a dead
+** temporary. Chains of moves collapse one step at a time.
+*/
+static void collapsemoves (OptState *os) {
+  int pc;
+  for (pc = 1; pc < os->n; pc++) {
+    Instruction i = os->code[pc];
+    int prev = pc - 1;
+    if (GET_OPCODE(i) != OP_MOVE ||
+        (os->flags[pc] & (OF_DEAD | OF_TARGET | OF_FIXED)))
+      continue;
+    while (prev >= 0 && (os->flags[prev] & OF_DEAD) &&
+           !(os->flags[prev] & OF_TARGET))
+      prev--;
+    if (prev < 0 || (os->flags[prev] & OF_DEAD) ||
+        !writesonlya(os->code[prev]) ||
+        GETARG_A(os->code[prev]) != GETARG_B(i) ||
+        luaF_getlocalname(os->f, GETARG_B(i) + 1, prev) != NULL ||
+        !istempdead(os, pc, GETARG_B(i)))
+      continue;
+    SETARG_A(os->code[prev], GETARG_A(i));
+    os->flags[pc] |= OF_DEAD;
+  }
+}
+
+
+/*
+** Removes instructions without side effects that only write dead
+** temporaries.
+*/
+static void removedeadstores (OptState *os) {
+  int pc;
+  for (pc = 0; pc < os->n; pc++) {
+    Instruction i = os->code[pc];
+    int a = GETARG_A(i);
+    int last = a;
+    if (os->flags[pc] & (OF_DEAD | OF_FIXED))
+      continue;
+    switch (GET_OPCODE(i)) {
+      case OP_MOVE: case OP_LOADK: case OP_GETUPVAL: case OP_NEWTABLE:
+      case OP_NOT:
+        break;
+      case OP_LOADBOOL:
+        if (GETARG_C(i) != 0) continue;
+        break;
+      case OP_LOADNIL:
+        last = a + GETARG_B(i);
+        break;
+      default:
+        continue;
+    }
+    for (; a <= last && istempdead(os, pc, a); a++) ;
+    if (a > last)
+      os->flags[pc] |= OF_DEAD;
+  }
+}
+
+
+/* removes unconditional jumps to the next remaining instruction */
+static void removenopjumps (OptState *os) {
+  int pc;
+  for (pc = os->n - 1; pc >= 0; pc--) {
+    Instruction i = os->code[pc];
+    int dest, k;
+    if (GET_OPCODE(i) != OP_JMP || GETARG_A(i) != 0 ||
+        (os->flags[pc] & (OF_DEAD | OF_FIXED)))
+      continue;
+    dest = jumpdest(i, pc);
+    if (dest <= pc)
+      continue;
+    for (k = pc + 1; k < dest && (os->flags[k] & OF_DEAD); k++) ;
+    if (k == dest)
+      os->flags[pc] |= OF_DEAD;
+  }
+}
+
+
+/*
+** Moves the remaining instructions together, fixing jumps, line
+** information and local variable ranges. Returns the new code size.
+*/
+static int compactcode (OptState *os) {
+  Proto *f = os->f;
+  int haslines = (f->sizelineinfo == os->n);
+  int pc, k = 0;
+  for (pc = 0; pc < os->n; pc++) {
+    os->map[pc] = k;
+    if (!(os->flags[pc] & OF_DEAD)) k++;
+  }
+  os->map[os->n] = k;
+  for (pc = 0; pc < os->n; pc++) {
+    Instruction i = os->code[pc];
+    if (os->flags[pc] & OF_DEAD)
+      continue;
+    if (hasjump(GET_OPCODE(i)))
+      SETARG_sBx(i, os->map[jumpdest(i, pc)] - os->map[pc] - 1);
+    os->code[os->map[pc]] = i;
+    if (haslines)
+      f->lineinfo[os->map[pc]] = f->lineinfo[pc];
+  }
+  for (pc = 0; pc < f->sizelocvars; pc++) {
+    LocVar *var = &f->locvars[pc];
+    if (var->startpc >= 0 && var->startpc <= os->n)
+      var->startpc = os->map[var->startpc];
+    if (var->endpc >= 0 && var->endpc <= os->n)
+      var->endpc = os->map[var->endpc];
+  }
+  return k;
+}
+
+
+static void optimizeproto (lua_State *L, Proto *f) {
+  OptState os;
+  size_t livesize = f->sizecode * REGWORDS * sizeof(unsigned int);
+  size_t mapsize = (f->sizecode + 1) * sizeof(int);
+  size_t size = livesize + mapsize + f->sizecode;
+  char *block;
+  int n = f->sizecode;
+  if (n == 0)
+    return;
+  block = cast(char *, luaM_malloc(L, size));
+  os.L = L;
+  os.f = f;
+  os.code = f->code;
+  os.n = n;
+  os.live = cast(unsigned int *, block);
+  os.map = cast(int *, block + livesize);
+  os.flags = cast(lu_byte *, block + livesize + mapsize);
+  foldcompares(&os);
+  threadjumps(&os);
+  if (markcode(&os)) {
+    liveness(&os);
+    removedeadstores(&os);
+    collapsemoves(&os);
+    removenopjumps(&os);
+    n = compactcode(&os);
+  }
+  luaM_freemem(L, block, size);
+  if (n < f->sizecode) {
+    if (f->sizelineinfo == f->sizecode) {
+      luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, n, int);
+      f->sizelineinfo = n;
+    }
+    luaM_reallocvector(L, f->code, f->sizecode, n, Instruction);
+    f->sizecode = n;
+  }
+}
+
+
+void luaK_optimize (lua_State *L, Proto *f) {
+  int i;
+  optimizeproto(L, f);
+  for (i = 0; i < f->sizep; i++)
+    luaK_optimize(L, f->p[i]);
+}
+
+/* }====================================================== */
@@ -135,6 +135,17 @@ static int luaB_costatus (lua_State *L) {
 }
 
 
+/*
+** Whether the coroutine is suspended because it ran out of its instruction
+** budget, rather than by a call to 'yield' (with no values, perhaps).
+*/
+static int luaB_cooutofbudget (lua_State *L) {
+  lua_State *co = getco(L);
+  lua_pushboolean(L, lua_cpuusage(co, LUA_CPUYIELDED, 0));
+  return 1;
+}
+
+
 static int luaB_yieldable (lua_State *L) {
   lua_pushboolean(L, lua_isyieldable(L));
   return 1;
@@ -156,6 +167,7 @@ static const luaL_Reg co_funcs[] = {
   {"wrap", luaB_cowrap},
   {"yield", luaB_yield},
   {"isyieldable", luaB_yieldable},
+  {"outofbudget", luaB_cooutofbudget},
   {NULL, NULL}
 };
 
@@ -395,6 +395,32 @@ static int db_debug (lua_State *L) {
 }
 
 
+/* returns the instructions left in the budget of a thread, -1 for none */
+static int db_getbudget (lua_State *L) {
+  int arg;
+  lua_State *L1 = getthread(L, &arg);
+  lua_pushinteger(L, lua_cpuusage(L1, LUA_CPUBUDGET, 0));
+  return 1;
+}
+
+
+/*
+** sets the budget of a thread (none if negative); returns the old one.
+** Active threads (the running one and those waiting for it) are refused,
+** so that a throttled coroutine cannot lift its own budget.
+*/
+static int db_setbudget (lua_State *L) {
+  int arg;
+  lua_State *L1 = getthread(L, &arg);
+  lua_Integer n = luaL_checkinteger(L, arg + 1);
+  lua_Debug ar;
+  if (L1 == L || (lua_status(L1) == LUA_OK && lua_getstack(L1, 0, &ar) > 0))
+    return luaL_error(L, "cannot change the budget of an active thread");
+  lua_pushinteger(L, lua_cpuusage(L1, LUA_CPUSETBUDGET, n));
+  return 1;
+}
+
+
 static int db_traceback (lua_State *L) {
   int arg;
   lua_State *L1 = getthread(L, &arg);
@@ -411,6 +437,7 @@ static int db_traceback (lua_State *L) {
 
 static const luaL_Reg dblib[] = {
   {"debug", db_debug},
+  {"getbudget", db_getbudget},
   {"getuservalue", db_getuservalue},
   {"gethook", db_gethook},
   {"getinfo", db_getinfo},
@@ -420,6 +447,7 @@ static const luaL_Reg dblib[] = {
   {"getupvalue", db_getupvalue},
   {"upvaluejoin", db_upvaluejoin},
   {"upvalueid", db_upvalueid},
+  {"setbudget", db_setbudget},
   {"setuservalue", db_setuservalue},
   {"sethook", db_sethook},
   {"setlocal", db_setlocal},
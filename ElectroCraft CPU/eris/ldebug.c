@@ -35,6 +35,8 @@
 
 
 static const char *getfuncname (lua_State *L, CallInfo *ci, const char **name);
+static const char *funcnamefromcode (lua_State *L, Proto *p, int pc,
+                                     const char **name);
 
 
 static int currentpc (CallInfo *ci) {
@@ -295,6 +297,61 @@ LUA_API int lua_getinfo (lua_State *L, const char *what, lua_Debug *ar) {
 }
 
 
+/*
+** Index of the current instruction of an activation record, or -1 if it
+** is not a Lua function. Together with the function itself this is enough
+** to get its debug information later on, see 'lua_getinfoat'.
+*/
+LUA_API int lua_getpc (lua_State *L, lua_Debug *ar) {
+  CallInfo *ci = ar->i_ci;
+  UNUSED(L);
+  return isLua(ci) ? currentpc(ci) : -1;
+}
+
+
+/*
+** Like 'lua_getinfo' with '>', as if the function on top of the stack were
+** suspended at instruction 'pc'. Supports 'S', 'l' and 'n', where 'n' is the
+** name of the function called by the instruction at 'pc'. Pops the function.
+*/
+LUA_API int lua_getinfoat (lua_State *L, int pc, const char *what,
+                           lua_Debug *ar) {
+  int status = 1;
+  Closure *cl;
+  Proto *p;
+  lua_lock(L);
+  api_check(ttisfunction(L->top - 1), "function expected");
+  cl = ttisclosure(L->top - 1) ? clvalue(L->top - 1) : NULL;
+  p = noLuaClosure(cl) ? NULL : cl->l.p;
+  api_check(p == NULL || (0 <= pc && pc < p->sizecode), "invalid pc");
+  for (; *what; what++) {
+    switch (*what) {
+      case 'S': {
+        funcinfo(ar, cl);
+        break;
+      }
+      case 'l': {
+        ar->currentline = (p != NULL) ? getfuncline(p, pc) : -1;
+        break;
+      }
+      case 'n': {
+        ar->namewhat = (p != NULL) ? funcnamefromcode(L, p, pc, &ar->name)
+                                   : NULL;
+        if (ar->namewhat == NULL) {
+          ar->namewhat = "";  /* not found */
+          ar->name = NULL;
+        }
+        break;
+      }
+      default: status = 0;  /* invalid option */
+    }
+  }
+  L->top--;  /* pop function */
+  lua_unlock(L);
+  return status;
+}
+
+
 /*
 ** {======================================================
 ** Symbolic Execution
@@ -439,14 +496,21 @@ static const char *getobjname (Proto *p, int lastpc, int reg,
 
 
 static const char *getfuncname (lua_State *L, CallInfo *ci, const char **name) {
-  TMS tm = (TMS)0;  /* to avoid warnings */
-  Proto *p = ci_func(ci)->p;  /* calling function */
-  int pc = currentpc(ci);  /* calling instruction index */
-  Instruction i = p->code[pc];  /* calling instruction */
   if (ci->callstatus & CIST_HOOKED) {  /* was it called inside a hook? */
     *name = "?";
     return "hook";
   }
+  return funcnamefromcode(L, ci_func(ci)->p, currentpc(ci), name);
+}
+
+
+/*
+** name of the function called by instruction 'pc' of 'p'
+*/
+static const char *funcnamefromcode (lua_State *L, Proto *p, int pc,
+                                     const char **name) {
+  TMS tm = (TMS)0;  /* to avoid warnings */
+  Instruction i = p->code[pc];  /* calling instruction */
   switch (GET_OPCODE(i)) {
     case OP_CALL:
     case OP_TAILCALL:  /* get function name */
@@ -609,6 +673,26 @@ l_noret luaG_runerror (lua_State *L, const char *fmt, ...) {
 }
 
 
+/*
+** Called when a thread runs out of its instruction budget, before running
+** the current instruction. Yields if possible, so that the instruction
+** runs when the thread is resumed (with a larger budget); otherwise, it is
+** an error.
+*/
+l_noret luaG_outofbudget (lua_State *L) {
+  CallInfo *ci = L->ci;
+  L->instrleft++;  /* instruction was not executed */
+  if (L->nny > 0)
+    luaG_runerror(L, "instruction budget exceeded");
+  L->status = LUA_YIELD;
+  ci->extra = savestack(L, ci->func);  /* save current 'func' */
+  ci->u.l.savedpc--;  /* undo increment (resume will increment it again) */
+  ci->callstatus |= CIST_BUDGETYIELD;  /* mark that it yielded */
+  ci->func = L->top - 1;  /* protect stack below results */
+  luaD_throw(L, LUA_YIELD);
+}
+
+
 void luaG_traceexec (lua_State *L) {
   CallInfo *ci = L->ci;
   lu_byte mask = L->hookmask;
@@ -17,6 +17,7 @@
 #include "lua.h"
 
 #include "lapi.h"
+#include "lcode.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -524,6 +525,62 @@ static l_noret resume_error (lua_State *L, const char *msg, StkId firstArg) {
 }
 
 
+/*
+** {======================================================
+** l_nanotime: monotonic clock in nanoseconds, used to measure the
+** time threads spend running
+** =======================================================
+*/
+
+#if !defined(l_nanotime)		/* { */
+
+#if defined(__APPLE__)			/* { */
+
+#include <mach/mach_time.h>
+
+static lua_Unsigned l_nanotime (void) {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (lua_Unsigned)mach_absolute_time() * tb.numer / tb.denom;
+}
+
+#elif defined(LUA_USE_POSIX)		/* }{ */
+
+#include <time.h>
+
+static lua_Unsigned l_nanotime (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (lua_Unsigned)ts.tv_sec * 1000000000u + (lua_Unsigned)ts.tv_nsec;
+}
+
+#elif defined(LUA_USE_WINDOWS)		/* }{ */
+
+#include <windows.h>
+
+static lua_Unsigned l_nanotime (void) {
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (lua_Unsigned)(now.QuadPart / freq.QuadPart) * 1000000000u +
+         (lua_Unsigned)(now.QuadPart % freq.QuadPart) * 1000000000u /
+         (lua_Unsigned)freq.QuadPart;
+}
+
+#else					/* }{ */
+
+/* ISO C definition: processor time instead of wall-clock time */
+#include <time.h>
+#define l_nanotime()  ((lua_Unsigned)((double)clock() * (1e9 / CLOCKS_PER_SEC)))
+
+#endif					/* } */
+
+#endif					/* } */
+
+/* }====================================================== */
+
+
 /*
 ** Do the work for 'lua_resume' in protected mode. Most of the work
 ** depends on the status of the coroutine: initial state, suspended
@@ -548,10 +605,16 @@ static void resume (lua_State *L, void *ud) {
     resume_error(L, "cannot resume dead coroutine", firstArg);
   else {  /* resuming from previous yield */
     L->status = LUA_OK;  /* mark that it is running (again) */
-    ci->func = restorestack(L, ci->extra);
-    if (isLua(ci))  /* yielded inside a hook? */
+    if (isLua(ci)) {  /* yielded inside a hook or for the budget? */
+      /* the instruction may use values up to the top it had; drop arguments
+         and anything else pushed since */
+      L->top = ci->func + 1;
+      ci->func = restorestack(L, ci->extra);
+      ci->callstatus &= ~CIST_BUDGETYIELD;  /* erase mark */
       luaV_execute(L);  /* just continue running Lua code */
+    }
     else {  /* 'common' yield */
+      ci->func = restorestack(L, ci->extra);
       if (ci->u.c.k != NULL) {  /* does it have a continuation function? */
         int n;
         lua_unlock(L);
@@ -568,10 +631,22 @@ static void resume (lua_State *L, void *ud) {
 }
 
 
+/*
+** If measured, the time between entering and leaving 'lua_resume' is
+** charged to the resumed thread, except for the time of other measured
+** resumes nested in it, which is charged to their own threads.
+*/
 LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   int status;
   int oldnny = L->nny;  /* save "number of non-yieldable" calls */
+  global_State *g = G(L);
+  lua_Unsigned outertime = 0, start = 0;
   lua_lock(L);
+  if (L->cputiming) {
+    outertime = g->nestedtime;
+    g->nestedtime = 0;
+    start = l_nanotime();
+  }
   luai_userstateresume(L, nargs);
   L->nCcalls = (from) ? from->nCcalls + 1 : 1;
   L->nny = 0;  /* allow yields */
@@ -594,6 +669,11 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   L->nny = oldnny;  /* restore 'nny' */
   L->nCcalls--;
   lua_assert(L->nCcalls == ((from) ? from->nCcalls : 0));
+  if (L->cputiming) {
+    lua_Unsigned elapsed = l_nanotime() - start;
+    L->cputime += elapsed - g->nestedtime;
+    g->nestedtime = outertime + elapsed;
+  }
   lua_unlock(L);
   return status;
 }
@@ -691,6 +771,8 @@ static void f_parser (lua_State *L, void *ud) {
     cl = luaY_parser(L, p->z, &p->buff, &p->dyd, p->name, c);
   }
   lua_assert(cl->nupvalues == cl->p->sizeupvalues);
+  if (p->mode && strchr(p->mode, 'o'))  /* optimize? */
+    luaK_optimize(L, cl->p);
   luaF_initupvals(L, cl);
 }
 
@@ -11,6 +11,7 @@
 
 
 #include <stddef.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -105,6 +106,7 @@ Proto *luaF_newproto (lua_State *L) {
   f->sizep = 0;
   f->code = NULL;
   f->cache = NULL;
+  f->icache = NULL;
   f->sizecode = 0;
   f->lineinfo = NULL;
   f->sizelineinfo = 0;
@@ -124,6 +126,7 @@ Proto *luaF_newproto (lua_State *L) {
 
 void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->code, f->sizecode);
+  luaM_freearray(L, f->icache, f->sizecode);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
@@ -133,6 +136,17 @@ void luaF_freeproto (lua_State *L, Proto *f) {
 }
 
 
+/*
+** Creates the inline caches of a function, one per instruction. They are
+** only hints, so any initial value will do.
+*/
+void luaF_newicache (lua_State *L, Proto *f) {
+  unsigned int *icache = luaM_newvector(L, f->sizecode, unsigned int);
+  memset(icache, 0, f->sizecode * sizeof(unsigned int));
+  f->icache = icache;
+}
+
+
 /*
 ** Look for n-th local variable at line 'line' in function 'func'.
 ** Returns NULL if not found.
@@ -54,6 +54,8 @@ static const luaL_Reg loadedlibs[] = {
   {LUA_BITLIBNAME, luaopen_bit32},
 #endif
   {LUA_ERISLIBNAME, luaopen_eris},
+  {LUA_STRBUFLIBNAME, luaopen_strbuf},
+  {LUA_BYTESLIBNAME, luaopen_bytes},
   {NULL, NULL}
 };
 
@@ -193,6 +193,9 @@ typedef struct lua_TValue TValue;
 #define setivalue(obj,x) \
   { TValue *io=(obj); val_(io).i=(x); settt_(io, LUA_TNUMINT); }
 
+#define chgivalue(obj,x) \
+  { TValue *io=(obj); lua_assert(ttisinteger(io)); val_(io).i=(x); }
+
 #define setnilvalue(obj) settt_(obj, LUA_TNIL)
 
 #define setfvalue(obj,x) \
@@ -415,6 +418,7 @@ typedef struct Proto {
   LocVar *locvars;  /* information about local variables (debug information) */
   Upvaldesc *upvalues;  /* upvalue information */
   struct LClosure *cache;  /* last created closure with this prototype */
+  unsigned int *icache;  /* inline caches of table accesses (see lvm.c) */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
 } Proto;
@@ -65,6 +65,8 @@ LUAI_DDEF const char *const luaP_opnames[NUM_OPCODES+1] = {
   "CLOSURE",
   "VARARG",
   "EXTRAARG",
+  "FORILOOP",
+  "FORIPREP",
   NULL
 };
 
@@ -120,5 +122,7 @@ LUAI_DDEF const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 1, OpArgU, OpArgN, iABx)		/* OP_CLOSURE */
  ,opmode(0, 1, OpArgU, OpArgN, iABC)		/* OP_VARARG */
  ,opmode(0, 0, OpArgU, OpArgU, iAx)		/* OP_EXTRAARG */
+ ,opmode(0, 1, OpArgR, OpArgN, iAsBx)		/* OP_FORILOOP */
+ ,opmode(0, 1, OpArgR, OpArgN, iAsBx)		/* OP_FORIPREP */
 };
 
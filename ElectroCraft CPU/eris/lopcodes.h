@@ -228,11 +228,14 @@ OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx])			*/
 
 OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-2) = vararg		*/
 
-OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
+OP_EXTRAARG,/*	Ax	extra (larger) argument for previous opcode	*/
+
+OP_FORILOOP,/*	A sBx	OP_FORLOOP for integer loops (see note)		*/
+OP_FORIPREP/*	A sBx	OP_FORPREP for integer loops (see note)		*/
 } OpCode;
 
 
-#define NUM_OPCODES	(cast(int, OP_EXTRAARG) + 1)
+#define NUM_OPCODES	(cast(int, OP_FORIPREP) + 1)
 
 
 
@@ -257,6 +260,12 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
 
   (*) All 'skips' (pc++) assume that next instruction is a jump.
 
+  (*) OP_FORIPREP/OP_FORILOOP replace OP_FORPREP/OP_FORLOOP in loops
+  whose initial value and step are integer constants, which makes the
+  whole loop count with integers. They come after OP_EXTRAARG so that
+  the numbers of all other opcodes stay the same. OP_FORILOOP stores
+  the internal index with its tag, as debug.setlocal may have changed it.
+
 ===========================================================================*/
 
 
@@ -1275,24 +1275,28 @@ static void repeatstat (LexState *ls, int line) {
 
 
 static int exp1 (LexState *ls) {
+  /* returns whether the expression is an integer constant */
   expdesc e;
-  int reg;
+  int isint;
   expr(ls, &e);
+  isint = (e.k == VKINT);
   luaK_exp2nextreg(ls->fs, &e);
   lua_assert(e.k == VNONRELOC);
-  reg = e.u.info;
-  return reg;
+  return isint;
 }
 
 
 static void forbody (LexState *ls, int base, int line, int nvars, int isnum) {
   /* forbody -> DO block */
+  /* 'isnum' is 2 for numeric loops that only count with integers */
   BlockCnt bl;
   FuncState *fs = ls->fs;
   int prep, endfor;
   adjustlocalvars(ls, 3);  /* control variables */
   checknext(ls, TK_DO);
-  prep = isnum ? luaK_codeAsBx(fs, OP_FORPREP, base, NO_JUMP) : luaK_jump(fs);
+  prep = isnum ? luaK_codeAsBx(fs, (isnum == 2) ? OP_FORIPREP : OP_FORPREP,
+                               base, NO_JUMP)
+               : luaK_jump(fs);
   enterblock(fs, &bl, 0);  /* scope for declared variables */
   adjustlocalvars(ls, nvars);
   luaK_reserveregs(fs, nvars);
@@ -1300,7 +1304,8 @@ static void forbody (LexState *ls, int base, int line, int nvars, int isnum) {
   leaveblock(fs);  /* end of scope for declared variables */
   luaK_patchtohere(fs, prep);
   if (isnum)  /* numeric for? */
-    endfor = luaK_codeAsBx(fs, OP_FORLOOP, base, NO_JUMP);
+    endfor = luaK_codeAsBx(fs, (isnum == 2) ? OP_FORILOOP : OP_FORLOOP,
+                           base, NO_JUMP);
   else {  /* generic for */
     luaK_codeABC(fs, OP_TFORCALL, base, 0, nvars);
     luaK_fixline(fs, line);
@@ -1315,21 +1320,24 @@ static void fornum (LexState *ls, TString *varname, int line) {
   /* fornum -> NAME = exp1,exp1[,exp1] forbody */
   FuncState *fs = ls->fs;
   int base = fs->freereg;
+  int isint;  /* initial value and step are integer constants? */
   new_localvarliteral(ls, "(for index)");
   new_localvarliteral(ls, "(for limit)");
   new_localvarliteral(ls, "(for step)");
   new_localvar(ls, varname);
   checknext(ls, '=');
-  exp1(ls);  /* initial value */
+  isint = exp1(ls);  /* initial value */
   checknext(ls, ',');
   exp1(ls);  /* limit */
   if (testnext(ls, ','))
-    exp1(ls);  /* optional step */
+    isint = exp1(ls) && isint;  /* optional step */
   else {  /* default step = 1 */
     luaK_codek(fs, fs->freereg, luaK_intK(fs, 1));
     luaK_reserveregs(fs, 1);
   }
-  forbody(ls, base, line, 1, 1);
+  /* with an integer initial value and step, the loop counts with integers
+     whatever the limit is (see 'forlimit') */
+  forbody(ls, base, line, 1, isint ? 2 : 1);
 }
 
 
@@ -229,6 +229,10 @@ static void preinit_thread (lua_State *L, global_State *g) {
   L->basehookcount = 0;
   L->allowhook = 1;
   resethookcount(L);
+  L->instrleft = L->instrbudget = NOINSTRBUDGET;
+  L->ninstr = 0;
+  L->cputime = 0;
+  L->cputiming = 0;
   L->openupval = NULL;
   L->nny = 1;
   L->status = LUA_OK;
@@ -270,6 +274,7 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   L1->basehookcount = L->basehookcount;
   L1->hook = L->hook;
   resethookcount(L1);
+  L1->cputiming = L->cputiming;
   /* initialize L1 extra space */
   memcpy(lua_getextraspace(L1), lua_getextraspace(g->mainthread),
          LUA_EXTRASPACE);
@@ -327,6 +332,9 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->strtgrow = LUAI_STRTGROW;
+  g->nestedtime = 0;
+  g->strtshrink = LUAI_STRTSHRINK;
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
@@ -94,6 +94,7 @@ typedef struct CallInfo {
 #define CIST_YPCALL	(1<<4)	/* call is a yieldable protected call */
 #define CIST_TAIL	(1<<5)	/* call was tail called */
 #define CIST_HOOKYIELD	(1<<6)	/* last hook called yielded */
+#define CIST_BUDGETYIELD	(1<<7)	/* yielded for its instruction budget */
 
 #define isLua(ci)	((ci)->callstatus & CIST_LUA)
 
@@ -134,6 +135,9 @@ typedef struct global_State {
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int strtgrow;  /* load (in %) at which the string table grows */
+  int strtshrink;  /* load (in %) below which the string table shrinks */
+  lua_Unsigned nestedtime;  /* time of resumes nested in the running one */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
   const lua_Number *version;  /* pointer to version number */
@@ -146,6 +150,14 @@ typedef struct global_State {
 /*
 ** 'per thread' state
 */
+/* 'instrbudget' of threads without an instruction budget */
+#define NOINSTRBUDGET	LUA_MAXINTEGER
+
+/* number of VM instructions executed by a thread */
+#define instrcount(L)  \
+	((L)->ninstr + l_castS2U((L)->instrbudget - (L)->instrleft))
+
+
 struct lua_State {
   CommonHeader;
   lu_byte status;
@@ -165,10 +177,15 @@ struct lua_State {
   int stacksize;
   int basehookcount;
   int hookcount;
+  lua_Integer instrleft;  /* instructions left in the budget */
+  lua_Integer instrbudget;  /* 'instrleft' when the budget was set */
+  lua_Unsigned ninstr;  /* instructions executed under earlier budgets */
+  lua_Unsigned cputime;  /* nanoseconds spent running in 'lua_resume' */
   unsigned short nny;  /* number of non-yieldable calls in stack */
   unsigned short nCcalls;  /* number of nested C calls */
   lu_byte hookmask;
   lu_byte allowhook;
+  lu_byte cputiming;  /* true if 'cputime' is measured */
 };
 
 
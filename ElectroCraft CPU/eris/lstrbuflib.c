@@ -0,0 +1,251 @@
+/*
+** String builders: mutable buffers to build long strings piece by piece
+** without creating a new string per step.
+** See Copyright Notice in lua.h
+*/
+
+#define lstrbuflib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+#define STRBUF		"strbuf"
+
+/* smallest capacity allocated for a non-empty builder */
+#define MINCAPACITY	32
+
+
+/*
+** The contents are kept in a second userdata, the user value of the
+** builder, so that the collector accounts for them and they count against
+** the memory limits of the state. Growing replaces that userdata, which
+** leaves the builder's identity unchanged.
+*/
+typedef struct StrBuf {
+  char *b;  /* contents */
+  size_t n;  /* number of bytes in use */
+  size_t size;  /* capacity */
+} StrBuf;
+
+
+#define checkbuf(L,i)	((StrBuf *)luaL_checkudata(L, i, STRBUF))
+
+
+/*
+** Resizes the contents of 'sb', the builder at 'arg', to 'newsize' bytes,
+** which must not be less than the bytes in use.
+*/
+static void resizebuf (lua_State *L, StrBuf *sb, int arg, size_t newsize) {
+  char *newb = NULL;
+  if (newsize > 0) {
+    newb = (char *)lua_newuserdata(L, newsize);
+    if (sb->n > 0)
+      memcpy(newb, sb->b, sb->n);
+  }
+  else
+    lua_pushnil(L);
+  lua_setuservalue(L, arg);  /* old contents become garbage */
+  sb->b = newb;
+  sb->size = newsize;
+}
+
+
+/* makes room for at least 'len' more bytes */
+static char *prepbuf (lua_State *L, StrBuf *sb, int arg, size_t len) {
+  if (sb->size - sb->n < len) {
+    size_t newsize = sb->size * 2;
+    if (len > (size_t)(~(size_t)0) - sb->n)
+      luaL_error(L, "string builder too large");
+    if (newsize < sb->n + len)
+      newsize = sb->n + len;
+    if (newsize < MINCAPACITY)
+      newsize = MINCAPACITY;
+    resizebuf(L, sb, arg, newsize);
+  }
+  return sb->b + sb->n;
+}
+
+
+static void addbuf (lua_State *L, StrBuf *sb, int arg, const char *s,
+                    size_t len) {
+  if (len > 0) {
+    memcpy(prepbuf(L, sb, arg, len), s, len);
+    sb->n += len;
+  }
+}
+
+
+/*
+** Creates a builder. The argument is either the initial capacity or the
+** initial contents. Builders are persisted as a closure of this function
+** with their contents as upvalue (see 'sb_persist'); Eris adds it to the
+** permanents by itself (see 'eris_permstrbuflib').
+*/
+static int sb_new (lua_State *L) {
+  int init = lua_upvalueindex(1);
+  int arg;
+  StrBuf *sb;
+  if (lua_type(L, init) == LUA_TNONE) {  /* not restoring a persisted one? */
+    init = 1;
+    lua_settop(L, 1);
+  }
+  sb = (StrBuf *)lua_newuserdata(L, sizeof(StrBuf));
+  sb->b = NULL;
+  sb->n = sb->size = 0;
+  luaL_setmetatable(L, STRBUF);
+  arg = lua_gettop(L);
+  switch (lua_type(L, init)) {
+    case LUA_TNIL: break;
+    case LUA_TNUMBER: {
+      lua_Integer size = luaL_checkinteger(L, init);
+      luaL_argcheck(L, size >= 0, init, "invalid capacity");
+      if (size > 0) resizebuf(L, sb, arg, (size_t)size);
+      break;
+    }
+    default: {
+      size_t len;
+      const char *s = luaL_checklstring(L, init, &len);
+      addbuf(L, sb, arg, s, len);
+      break;
+    }
+  }
+  return 1;
+}
+
+
+/* appends all arguments, which must be strings or numbers */
+static int sb_append (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  int i, n = lua_gettop(L);
+  for (i = 2; i <= n; i++) {
+    size_t len;
+    const char *s = luaL_checklstring(L, i, &len);
+    addbuf(L, sb, 1, s, len);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* appends 'string.format(fmt, ...)' */
+static int sb_appendf (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  size_t len;
+  const char *s;
+  luaL_checkstring(L, 2);
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  if (lua_getfield(L, -1, LUA_STRLIBNAME) != LUA_TTABLE ||
+      lua_getfield(L, -1, "format") != LUA_TFUNCTION)
+    return luaL_error(L, "string library not loaded");
+  lua_replace(L, -3);  /* format function replaces _LOADED */
+  lua_pop(L, 1);  /* pop string table */
+  lua_insert(L, 2);  /* buffer format fmt ... */
+  lua_call(L, lua_gettop(L) - 2, 1);
+  s = lua_tolstring(L, -1, &len);
+  addbuf(L, sb, 1, s, len);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int sb_tostring (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  lua_pushlstring(L, sb->b, sb->n);
+  return 1;
+}
+
+
+/* empties the builder; its memory is released if 'release' is true */
+static int sb_clear (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  sb->n = 0;
+  if (lua_toboolean(L, 2))
+    resizebuf(L, sb, 1, 0);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* returns the capacity, after making it at least 'size' if given */
+static int sb_capacity (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  if (!lua_isnoneornil(L, 2)) {
+    lua_Integer size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0, 2, "invalid capacity");
+    if ((size_t)size > sb->size)
+      resizebuf(L, sb, 1, (size_t)size);
+  }
+  lua_pushinteger(L, (lua_Integer)sb->size);
+  return 1;
+}
+
+
+static int sb_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkbuf(L, 1)->n);
+  return 1;
+}
+
+
+/* Eris: persist as a closure that rebuilds the builder with its contents */
+static int sb_persist (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  lua_pushlstring(L, sb->b, sb->n);
+  lua_pushcclosure(L, sb_new, 1);
+  return 1;
+}
+
+
+static const luaL_Reg sb_funcs[] = {
+  {"new", sb_new},
+  {"append", sb_append},
+  {"appendf", sb_appendf},
+  {"tostring", sb_tostring},
+  {"clear", sb_clear},
+  {"capacity", sb_capacity},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg sb_meta[] = {
+  {"__len", sb_len},
+  {"__tostring", sb_tostring},
+  {"__persist", sb_persist},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_strbuf (lua_State *L) {
+  luaL_newlib(L, sb_funcs);
+  luaL_newmetatable(L, STRBUF);
+  luaL_setfuncs(L, sb_meta, 0);
+  lua_pushvalue(L, -2);
+  lua_setfield(L, -2, "__index");  /* metatable.__index = strbuf */
+  lua_pop(L, 1);  /* pop metatable */
+  return 1;
+}
+
+
+void eris_permstrbuflib(lua_State *L, int forUnpersist) {
+  luaL_checktype(L, -1, LUA_TTABLE);
+  luaL_checkstack(L, 2, NULL);
+
+  if (forUnpersist) {
+    lua_pushstring(L, "__eris.strbuflib_new");
+    lua_pushcfunction(L, sb_new);
+  }
+  else {
+    lua_pushcfunction(L, sb_new);
+    lua_pushstring(L, "__eris.strbuflib_new");
+  }
+  lua_rawset(L, -3);
+}
+
@@ -44,16 +44,54 @@ int luaS_eqlngstr (TString *a, TString *b) {
 }
 
 
+/*
+** Short strings are hashed in full, a word at a time; many keys share
+** long prefixes, so sampling only some of their bytes would cluster them.
+** Long strings keep using a sample of at most ~(2^LUAI_HASHLIMIT) bytes.
+*/
 unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
   unsigned int h = seed ^ cast(unsigned int, l);
-  size_t l1;
-  size_t step = (l >> LUAI_HASHLIMIT) + 1;
-  for (l1 = l; l1 >= step; l1 -= step)
-    h = h ^ ((h<<5) + (h>>2) + cast_byte(str[l1 - 1]));
+  if (l <= LUAI_MAXSHORTLEN) {
+    unsigned int w;
+    for (; l >= sizeof(w); str += sizeof(w), l -= sizeof(w)) {
+      memcpy(&w, str, sizeof(w));  /* unaligned load */
+      h = (h ^ w) * 0x9e3779b1u;
+      h ^= h >> 15;
+    }
+    for (; l > 0; str++, l--)
+      h = (h ^ cast_byte(*str)) * 0x01000193u;
+    h ^= h >> 16;  /* mix high bits into the low ones used by 'lmod' */
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+  }
+  else {
+    size_t l1;
+    size_t step = (l >> LUAI_HASHLIMIT) + 1;
+    for (l1 = l; l1 >= step; l1 -= step)
+      h = h ^ ((h<<5) + (h>>2) + cast_byte(str[l1 - 1]));
+  }
   return h;
 }
 
 
+/*
+** collects statistics on the collision chains of the string table:
+** the number of non-empty buckets and the length of the longest chain
+*/
+void luaS_chainstats (lua_State *L, int *used, int *longest) {
+  stringtable *tb = &G(L)->strt;
+  int i;
+  *used = *longest = 0;
+  for (i = 0; i < tb->size; i++) {
+    TString *p = tb->hash[i];
+    int n = 0;
+    for (; p != NULL; p = p->hnext) n++;
+    if (n > 0) (*used)++;
+    if (n > *longest) *longest = n;
+  }
+}
+
+
 /*
 ** resizes the string table
 */
@@ -100,7 +138,8 @@ static TString *createstrobj (lua_State *L, const char *str, size_t l,
   ts->len = l;
   ts->hash = h;
   ts->extra = 0;
-  memcpy(getaddrstr(ts), str, l * sizeof(char));
+  if (str != NULL)  /* else contents are filled in by the caller */
+    memcpy(getaddrstr(ts), str, l * sizeof(char));
   getaddrstr(ts)[l] = '\0';  /* ending 0 */
   return ts;
 }
@@ -133,7 +172,7 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
       return ts;
     }
   }
-  if (g->strt.nuse >= g->strt.size && g->strt.size <= MAX_INT/2) {
+  if (luaS_overloaded(g) && g->strt.size <= MAX_INT/2) {
     luaS_resize(L, g->strt.size * 2);
     list = &g->strt.hash[lmod(h, g->strt.size)];  /* recompute with new size */
   }
@@ -148,6 +187,18 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
 /*
 ** new string (with explicit length)
 */
+/*
+** new long string with undefined contents; long strings are not interned,
+** so they can be filled in after creation, before the string is used
+*/
+TString *luaS_createlngstr (lua_State *L, size_t l) {
+  lua_assert(l > LUAI_MAXSHORTLEN);
+  if (l + 1 > (MAX_SIZE - sizeof(TString))/sizeof(char))
+    luaM_toobig(L);
+  return createstrobj(L, NULL, l, LUA_TLNGSTR, G(L)->seed);
+}
+
+
 TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
   if (l <= LUAI_MAXSHORTLEN)  /* short string? */
     return internshrstr(L, str, l);
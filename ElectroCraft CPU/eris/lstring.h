@@ -34,12 +34,35 @@
 #define eqshrstr(a,b)	check_exp((a)->tt == LUA_TSHRSTR, (a) == (b))
 
 
+/*
+** load of the string table (in percent of its size) at which it grows
+** and below which the collector shrinks it
+*/
+#if !defined(LUAI_STRTGROW)
+#define LUAI_STRTGROW	100  /* 100% */
+#endif
+
+#if !defined(LUAI_STRTSHRINK)
+#define LUAI_STRTSHRINK	25  /* 25% */
+#endif
+
+#define luaS_overloaded(g) \
+	(cast(lu_mem, (g)->strt.nuse) * 100 >= \
+	 cast(lu_mem, (g)->strt.size) * (g)->strtgrow)
+
+#define luaS_underloaded(g) \
+	(cast(lu_mem, (g)->strt.nuse) * 100 < \
+	 cast(lu_mem, (g)->strt.size) * (g)->strtshrink)
+
+
 LUAI_FUNC unsigned int luaS_hash (const char *str, size_t l, unsigned int seed);
+LUAI_FUNC void luaS_chainstats (lua_State *L, int *used, int *longest);
 LUAI_FUNC int luaS_eqlngstr (TString *a, TString *b);
 LUAI_FUNC void luaS_resize (lua_State *L, int newsize);
 LUAI_FUNC void luaS_remove (lua_State *L, TString *ts);
 LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
+LUAI_FUNC TString *luaS_createlngstr (lua_State *L, size_t l);
 LUAI_FUNC TString *luaS_new (lua_State *L, const char *str);
 
 
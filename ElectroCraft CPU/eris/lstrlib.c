@@ -45,6 +45,325 @@
 
 
 
+/*
+** {======================================================
+** BYTE KERNELS
+** =======================================================
+*/
+
+/*
+** Vectorized versions of the inner loops of substring search, class
+** scanning and case conversion. They are compiled for SSE2 and AVX2 with
+** target attributes, and the widest one the processor supports is chosen
+** when the program is loaded, so that the build needs no special flags.
+** Define LUA_NOVECTOR to build only the scalar versions.
+*/
+#if !defined(LUA_NOVECTOR) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || \
+     (defined(__GNUC__) && (__GNUC__ > 4 || \
+                            (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define LUA_VECTOR
+#include <immintrin.h>
+#endif
+
+
+/* character classes of 'match_class' (also in upper case, negated) */
+static const char classes[] = "acdglpsuwxz";
+
+
+/* maximum number of ranges in a 'ByteRanges' */
+#define MAXRANGES	6
+
+/*
+** A set of ASCII characters given as inclusive ranges. Kernels that scan
+** for the members of a character class only decide about ASCII bytes,
+** assuming that their class is the same in every locale; they stop at
+** other bytes, which the caller checks with the ctype functions.
+*/
+typedef struct ByteRanges {
+  unsigned char n;  /* number of ranges */
+  unsigned char lo[MAXRANGES];
+  unsigned char hi[MAXRANGES];
+} ByteRanges;
+
+
+/* ASCII members of each class in 'classes', in the same order */
+static const ByteRanges classranges[] = {
+  {2, {'A', 'a'}, {'Z', 'z'}},  /* a */
+  {2, {0, 127}, {31, 127}},  /* c */
+  {1, {'0'}, {'9'}},  /* d */
+  {1, {33}, {126}},  /* g */
+  {1, {'a'}, {'z'}},  /* l */
+  {4, {33, 58, 91, 123}, {47, 64, 96, 126}},  /* p */
+  {2, {9, ' '}, {13, ' '}},  /* s */
+  {1, {'A'}, {'Z'}},  /* u */
+  {3, {'0', 'A', 'a'}, {'9', 'Z', 'z'}},  /* w */
+  {3, {'0', 'A', 'a'}, {'9', 'F', 'f'}},  /* x */
+  {1, {0}, {0}}  /* z */
+};
+
+
+/*
+** Returns the ranges of the class 'cl' (after a '%') and sets '*in' to
+** whether the class matches the members of those ranges (lower case) or
+** the other ASCII characters (upper case). Returns NULL if 'cl' is not a
+** class.
+*/
+static const ByteRanges *getclassranges (int cl, int *in) {
+  const char *k = (cl != 0) ? strchr(classes, tolower(cl)) : NULL;
+  if (k == NULL) return NULL;
+  *in = (islower(cl) != 0);
+  return &classranges[k - classes];
+}
+
+
+static int inranges (const ByteRanges *rg, int c) {
+  int k;
+  for (k = 0; k < rg->n; k++) {
+    if (rg->lo[k] <= c && c <= rg->hi[k])
+      return 1;
+  }
+  return 0;
+}
+
+
+/*
+** Returns the number of leading bytes in 's' (of length 'l') that are
+** ASCII and are ('in' true) or are not ('in' false) in the ranges 'rg'.
+*/
+static size_t span_scalar (const char *s, size_t l, const ByteRanges *rg,
+                           int in) {
+  size_t i;
+  for (i = 0; i < l && uchar(s[i]) < 0x80; i++) {
+    if (inranges(rg, uchar(s[i])) != in) break;
+  }
+  return i;
+}
+
+
+/* 'lmemfind' for patterns of at least two characters */
+static const char *find_scalar (const char *s1, size_t l1,
+                                const char *s2, size_t l2) {
+  const char *init;  /* to search for a '*s2' inside 's1' */
+  if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+  l2--;  /* 1st char will be checked by 'memchr' */
+  l1 = l1-l2;  /* 's2' cannot be found after that */
+  while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
+    init++;   /* 1st char is already checked */
+    if (memcmp(init, s2+1, l2) == 0)
+      return init-1;
+    else {  /* correct 'l1' and 's1' to try again */
+      l1 -= init-s1;
+      s1 = init;
+    }
+  }
+  return NULL;  /* not found */
+}
+
+
+/*
+** Converts 'l' bytes from 's' to 'd' with 'toupper' (if 'upper') or
+** 'tolower'. The vectorized versions are used only when the locale does
+** not change the case of ASCII letters in unusual ways (see 'asciicase').
+*/
+static void casemap_scalar (char *d, const char *s, size_t l, int upper) {
+  size_t i;
+  if (upper) {
+    for (i = 0; i < l; i++)
+      d[i] = toupper(uchar(s[i]));
+  }
+  else {
+    for (i = 0; i < l; i++)
+      d[i] = tolower(uchar(s[i]));
+  }
+}
+
+
+#if defined(LUA_VECTOR)
+
+#define ctz(x)		__builtin_ctz(x)
+
+
+/* bytes of 'v' in the ranges 'rg', as a mask of 0xFF bytes */
+#define RANGEMASK(vt,pf,v,rg,m)  \
+  { int k_; m = pf##_setzero_si##vt(); \
+    for (k_ = 0; k_ < (rg)->n; k_++) { \
+      __m##vt##i t_ = pf##_sub_epi8(v, pf##_set1_epi8((char)(rg)->lo[k_])); \
+      __m##vt##i w_ = pf##_set1_epi8((char)((rg)->hi[k_] - (rg)->lo[k_])); \
+      m = pf##_or_si##vt(m, pf##_cmpeq_epi8(pf##_max_epu8(t_, w_), w_)); } }
+
+
+__attribute__((target("sse2")))
+static size_t span_sse2 (const char *s, size_t l, const ByteRanges *rg,
+                         int in) {
+  size_t i;
+  for (i = 0; i + 16 <= l; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i m;
+    unsigned int stop;
+    RANGEMASK(128, _mm, v, rg, m);
+    stop = (unsigned int)_mm_movemask_epi8(m);
+    stop = in ? (~stop & 0xFFFF) : (stop | (unsigned int)_mm_movemask_epi8(v));
+    if (stop != 0) return i + ctz(stop);
+  }
+  return i + span_scalar(s + i, l - i, rg, in);
+}
+
+
+__attribute__((target("avx2")))
+static size_t span_avx2 (const char *s, size_t l, const ByteRanges *rg,
+                         int in) {
+  size_t i;
+  for (i = 0; i + 32 <= l; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i m;
+    unsigned int stop;
+    RANGEMASK(256, _mm256, v, rg, m);
+    stop = (unsigned int)_mm256_movemask_epi8(m);
+    stop = in ? ~stop : (stop | (unsigned int)_mm256_movemask_epi8(v));
+    if (stop != 0) return i + ctz(stop);
+  }
+  return i + span_sse2(s + i, l - i, rg, in);
+}
+
+
+/*
+** Substring search comparing the first and the last character of 's2'
+** at 16 (or 32) positions at once; only positions where both match are
+** compared in full.
+*/
+__attribute__((target("sse2")))
+static const char *find_sse2 (const char *s1, size_t l1,
+                              const char *s2, size_t l2) {
+  const __m128i first = _mm_set1_epi8(s2[0]);
+  const __m128i last = _mm_set1_epi8(s2[l2 - 1]);
+  size_t i;
+  for (i = 0; i + l2 - 1 + 16 <= l1; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s1 + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s1 + i + l2 - 1));
+    unsigned int found = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (found != 0) {
+      size_t j = i + ctz(found);
+      if (memcmp(s1 + j + 1, s2 + 1, l2 - 2) == 0)
+        return s1 + j;
+      found &= found - 1;
+    }
+  }
+  return find_scalar(s1 + i, l1 - i, s2, l2);
+}
+
+
+__attribute__((target("avx2")))
+static const char *find_avx2 (const char *s1, size_t l1,
+                              const char *s2, size_t l2) {
+  const __m256i first = _mm256_set1_epi8(s2[0]);
+  const __m256i last = _mm256_set1_epi8(s2[l2 - 1]);
+  size_t i;
+  for (i = 0; i + l2 - 1 + 32 <= l1; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(s1 + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s1 + i + l2 - 1));
+    unsigned int found = (unsigned int)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                         _mm256_cmpeq_epi8(b, last)));
+    while (found != 0) {
+      size_t j = i + ctz(found);
+      if (memcmp(s1 + j + 1, s2 + 1, l2 - 2) == 0)
+        return s1 + j;
+      found &= found - 1;
+    }
+  }
+  return find_sse2(s1 + i, l1 - i, s2, l2);
+}
+
+
+/* ASCII blocks flip the case bit of the letters; others go byte by byte */
+#define CASEMAP(vt,pf,n,d,s,l,upper)  \
+  { const __m##vt##i lo_ = pf##_set1_epi8(upper ? 'a' : 'A'); \
+    const __m##vt##i w_ = pf##_set1_epi8('z' - 'a'); \
+    const __m##vt##i bit_ = pf##_set1_epi8(0x20); \
+    size_t i_; \
+    for (i_ = 0; i_ + n <= l; i_ += n) { \
+      __m##vt##i v_ = pf##_loadu_si##vt((const __m##vt##i *)(s + i_)); \
+      if (pf##_movemask_epi8(v_) != 0) \
+        casemap_scalar(d + i_, s + i_, n, upper); \
+      else { \
+        __m##vt##i t_ = pf##_sub_epi8(v_, lo_); \
+        __m##vt##i m_ = pf##_cmpeq_epi8(pf##_max_epu8(t_, w_), w_); \
+        v_ = pf##_xor_si##vt(v_, pf##_and_si##vt(m_, bit_)); \
+        pf##_storeu_si##vt((__m##vt##i *)(d + i_), v_); } } \
+    casemap_scalar(d + i_, s + i_, l - i_, upper); }
+
+
+__attribute__((target("sse2")))
+static void casemap_sse2 (char *d, const char *s, size_t l, int upper) {
+  CASEMAP(128, _mm, 16, d, s, l, upper);
+}
+
+
+__attribute__((target("avx2")))
+static void casemap_avx2 (char *d, const char *s, size_t l, int upper) {
+  CASEMAP(256, _mm256, 32, d, s, l, upper);
+}
+
+#endif
+
+
+static const char *(*find_kernel) (const char *s1, size_t l1,
+                                   const char *s2, size_t l2) = find_scalar;
+static size_t (*span_kernel) (const char *s, size_t l, const ByteRanges *rg,
+                              int in) = span_scalar;
+static void (*casemap_kernel) (char *d, const char *s, size_t l,
+                               int upper) = casemap_scalar;
+
+
+#if defined(LUA_VECTOR)
+/*
+** Chooses the kernels for this processor. This runs once when the program
+** (or the shared library) is loaded, before any thread can open a state,
+** so the kernel pointers are never written while others read them.
+*/
+__attribute__((constructor))
+static void selectkernels (void) {
+  __builtin_cpu_init();  /* may run before the CPU model is initialized */
+  if (__builtin_cpu_supports("avx2")) {
+    find_kernel = find_avx2;
+    span_kernel = span_avx2;
+    casemap_kernel = casemap_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    find_kernel = find_sse2;
+    span_kernel = span_sse2;
+    casemap_kernel = casemap_sse2;
+  }
+}
+#endif
+
+
+/*
+** Checks whether 'toupper' and 'tolower' only change the case of ASCII
+** letters, as the vectorized 'casemap' assumes (not so in a Turkish
+** locale, for instance). This is cheap next to converting a long string.
+*/
+static int asciicase (void) {
+  int c;
+  for (c = 0; c < 0x80; c++) {
+    int uc = ('a' <= c && c <= 'z') ? c - 'a' + 'A' : c;
+    int lc = ('A' <= c && c <= 'Z') ? c - 'A' + 'a' : c;
+    if (toupper(c) != uc || tolower(c) != lc)
+      return 0;
+  }
+  return 1;
+}
+
+
+/* strings shorter than this are converted without the kernels */
+#define MINCASEMAP	256
+
+/* }====================================================== */
+
+
+
 
 static int str_len (lua_State *L) {
   size_t l;
@@ -94,8 +413,12 @@ static int str_lower (lua_State *L) {
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = tolower(uchar(s[i]));
+  if (l >= MINCASEMAP && asciicase())
+    casemap_kernel(p, s, l, 0);
+  else {
+    for (i=0; i<l; i++)
+      p[i] = tolower(uchar(s[i]));
+  }
   luaL_pushresultsize(&b, l);
   return 1;
 }
@@ -107,8 +430,12 @@ static int str_upper (lua_State *L) {
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = toupper(uchar(s[i]));
+  if (l >= MINCASEMAP && asciicase())
+    casemap_kernel(p, s, l, 1);
+  else {
+    for (i=0; i<l; i++)
+      p[i] = toupper(uchar(s[i]));
+  }
   luaL_pushresultsize(&b, l);
   return 1;
 }
@@ -126,14 +453,19 @@ static int str_rep (lua_State *L) {
     size_t totallen = (size_t)n * l + (size_t)(n - 1) * lsep;
     luaL_Buffer b;
     char *p = luaL_buffinitsize(L, &b, totallen);
-    while (n-- > 1) {  /* first n-1 copies (followed by separator) */
-      memcpy(p, s, l * sizeof(char)); p += l;
-      if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
-        memcpy(p, sep, lsep * sizeof(char));
-        p += lsep;
-      }
+    size_t done = l + lsep;  /* bytes already in place */
+    size_t firstlen = (size_t)(n - 1) * done;  /* first n-1 copies */
+    if (n > 1) {  /* first copy (followed by separator) */
+      memcpy(p, s, l * sizeof(char));
+      memcpy(p + l, sep, lsep * sizeof(char));
+    }
+    while (done < firstlen) {  /* double what is there until done */
+      size_t len = (done <= firstlen - done) ? done : firstlen - done;
+      memcpy(p + done, p, len * sizeof(char));
+      done += len;
     }
-    memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
+    /* last copy (not followed by separator) */
+    memcpy(p + firstlen, s, l * sizeof(char));
     luaL_pushresultsize(&b, totallen);
   }
   return 1;
@@ -356,8 +688,19 @@ static const char *matchbalance (MatchState *ms, const char *s,
 static const char *max_expand (MatchState *ms, const char *s,
                                  const char *p, const char *ep) {
   ptrdiff_t i = 0;  /* counts maximum expand for item */
-  while (singlematch(ms, s + i, p, ep))
-    i++;
+  const ByteRanges *rg;
+  int in;
+  if (*p == L_ESC && (rg = getclassranges(uchar(*(p+1)), &in)) != NULL) {
+    for (;;) {  /* scan ASCII bytes with the kernel, check others here */
+      i += span_kernel(s + i, ms->src_end - (s + i), rg, in);
+      if (!singlematch(ms, s + i, p, ep)) break;
+      i++;
+    }
+  }
+  else {
+    while (singlematch(ms, s + i, p, ep))
+      i++;
+  }
   /* keeps trying to match with the maximum repetitions */
   while (i>=0) {
     const char *res = match(ms, (s+i), ep+1);
@@ -519,29 +862,652 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 }
 
 
+/*
+** Compiled patterns. A pattern is translated once into an array of items,
+** with '[sets]' turned into bitmaps and classes already decoded, and kept in
+** a small cache per state (see 'getpattern'). 'cmatch' follows 'match' step by step,
+** including its recursion and 'matchdepth' accounting, so results and
+** errors are the same. Malformed patterns are not compiled, so that they
+** keep failing (or not) exactly when the interpreter would.
+*/
 
-static const char *lmemfind (const char *s1, size_t l1,
-                               const char *s2, size_t l2) {
-  if (l2 == 0) return s1;  /* empty strings are everywhere */
-  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+
+/* kinds of pattern items */
+#define PI_END		0	/* end of pattern */
+#define PI_CHAR		1	/* single character */
+#define PI_ANY		2	/* '.' */
+#define PI_CLASS	3	/* '%x' */
+#define PI_SET		4	/* '[set]' */
+#define PI_OPEN		5	/* '(' or '()' */
+#define PI_CLOSE	6	/* ')' */
+#define PI_ENDANCHOR	7	/* '$' at the end of the pattern */
+#define PI_BALANCE	8	/* '%bxy' */
+#define PI_FRONTIER	9	/* '%f[set]' */
+#define PI_BACKREF	10	/* '%0' to '%9' */
+
+
+#define MAXSETCLASSES	(2 * (int)(sizeof(classes) - 1))
+
+
+/*
+** A character set: characters given literally or as ranges in a bitmap,
+** plus the classes it includes, which are checked with the ctype functions
+** when matching so that they follow the current locale.
+*/
+typedef struct CharSet {
+  unsigned char bits[(UCHAR_MAX + 1) / CHAR_BIT];
+  unsigned char neg;  /* '[^...]' */
+  unsigned char ncls;  /* number of classes */
+  char cls[MAXSETCLASSES];  /* class letters, in lower case */
+  char clsneg[MAXSETCLASSES];  /* whether each class was in upper case */
+  ByteRanges rg;  /* ASCII members, ignoring 'neg' (n > MAXRANGES if many) */
+} CharSet;
+
+
+typedef struct PatItem {
+  unsigned char kind;
+  unsigned char suffix;  /* '*', '+', '-', '?' or 0 for single items */
+  unsigned char c1, c2;  /* character or class; '%b' delimiters; ... */
+  unsigned char in;  /* whether the item matches the bytes in 'rg' */
+  const CharSet *set;
+  const ByteRanges *rg;  /* for 'span_kernel', or NULL */
+} PatItem;
+
+
+typedef struct Pattern {
+  PatItem *items;
+  CharSet *sets;
+} Pattern;
+
+
+/* 'match_class' for a class letter 'cl' already known to be in lower case */
+static int classmatch (int c, int cl) {
+  switch (cl) {
+    case 'a' : return isalpha(c);
+    case 'c' : return iscntrl(c);
+    case 'd' : return isdigit(c);
+    case 'g' : return isgraph(c);
+    case 'l' : return islower(c);
+    case 'p' : return ispunct(c);
+    case 's' : return isspace(c);
+    case 'u' : return isupper(c);
+    case 'w' : return isalnum(c);
+    case 'x' : return isxdigit(c);
+    default: return (c == 0);  /* 'z' */
+  }
+}
+
+
+/* whether 'cl' after a '%' is one of the classes of 'match_class' */
+static int isclass (int cl) {
+  return (cl != 0 && strchr(classes, tolower(cl)) != NULL);
+}
+
+
+static int setmatch (const CharSet *cs, int c) {
+  int res = (cs->bits[c / CHAR_BIT] >> (c % CHAR_BIT)) & 1;
+  int i;
+  for (i = 0; !res && i < cs->ncls; i++)
+    res = (classmatch(c, cs->cls[i]) != 0) != cs->clsneg[i];
+  return res != cs->neg;
+}
+
+
+static void setchar (CharSet *cs, int c) {
+  cs->bits[c / CHAR_BIT] |= (unsigned char)(1 << (c % CHAR_BIT));
+}
+
+
+/* adds what 'match_class(c, cl)' matches to 'cs' */
+static void setclass (CharSet *cs, int cl) {
+  if (!isclass(cl))
+    setchar(cs, cl);
   else {
-    const char *init;  /* to search for a '*s2' inside 's1' */
-    l2--;  /* 1st char will be checked by 'memchr' */
-    l1 = l1-l2;  /* 's2' cannot be found after that */
-    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-      init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
-        return init-1;
-      else {  /* correct 'l1' and 's1' to try again */
-        l1 -= init-s1;
-        s1 = init;
+    char lcl = (char)tolower(cl);
+    char neg = !islower(cl);
+    int i;
+    for (i = 0; i < cs->ncls; i++) {
+      if (cs->cls[i] == lcl && cs->clsneg[i] == neg)
+        return;  /* already there */
+    }
+    cs->cls[i] = lcl;
+    cs->clsneg[i] = neg;
+    cs->ncls++;
+  }
+}
+
+
+/* 'classend' that returns NULL instead of raising errors */
+static const char *cclassend (const char *p, const char *p_end) {
+  switch (*p++) {
+    case L_ESC: {
+      return (p == p_end) ? NULL : p + 1;
+    }
+    case '[': {
+      if (*p == '^') p++;
+      do {  /* look for a ']' */
+        if (p == p_end) return NULL;
+        if (*(p++) == L_ESC && p < p_end)
+          p++;
+      } while (*p != ']');
+      return p + 1;
+    }
+    default: {
+      return p;
+    }
+  }
+}
+
+
+/* set of '[...]' from 'p' to its ']' at 'ec', as 'matchbracketclass' sees it */
+static void setbracket (CharSet *cs, const char *p, const char *ec) {
+  if (*(p+1) == '^') {
+    cs->neg = 1;
+    p++;
+  }
+  while (++p < ec) {
+    if (*p == L_ESC) {
+      p++;
+      setclass(cs, uchar(*p));
+    }
+    else if ((*(p+1) == '-') && (p+2 < ec)) {
+      int c;
+      p+=2;
+      for (c = uchar(*(p-2)); c <= uchar(*p); c++)
+        setchar(cs, c);
+    }
+    else setchar(cs, uchar(*p));
+  }
+}
+
+
+/* computes 'cs->rg' from the ASCII part of its bitmap and classes */
+static void setranges (CharSet *cs) {
+  int c, inrange = 0;
+  cs->rg.n = 0;
+  for (c = 0; c <= 0x80; c++) {
+    int member = 0;
+    if (c < 0x80) {
+      int i;
+      member = (cs->bits[c / CHAR_BIT] >> (c % CHAR_BIT)) & 1;
+      for (i = 0; !member && i < cs->ncls; i++) {
+        const char *k = strchr(classes, cs->cls[i]);
+        member = inranges(&classranges[k - classes], c) != cs->clsneg[i];
+      }
+    }
+    if (member && !inrange) {  /* a range starts? */
+      if (cs->rg.n == MAXRANGES) {  /* too many ranges? */
+        cs->rg.n++;
+        return;
       }
+      cs->rg.lo[cs->rg.n] = (unsigned char)c;
     }
-    return NULL;  /* not found */
+    else if (!member && inrange)  /* a range ends? */
+      cs->rg.hi[cs->rg.n++] = (unsigned char)(c - 1);
+    inrange = member;
   }
 }
 
 
+/*
+** Translates the pattern 'p' into items, following the cases of 'match'.
+** With 'pt' NULL it only counts items and sets. Returns 0 if the pattern is
+** malformed in a way that makes 'match' raise an error.
+*/
+static int compilepattern (const char *p, const char *p_end, Pattern *pt,
+                           int *nitems, int *nsets) {
+  int ni = 0, ns = 0;
+  while (p != p_end) {
+    PatItem item;
+    const char *ep;
+    item.suffix = item.c1 = item.c2 = item.in = 0;
+    item.set = NULL;
+    item.rg = NULL;
+    switch (*p) {
+      case '(': {
+        item.kind = PI_OPEN;
+        item.c1 = (*(p + 1) == ')');  /* position capture? */
+        p += 1 + item.c1;
+        break;
+      }
+      case ')': {
+        item.kind = PI_CLOSE;
+        p++;
+        break;
+      }
+      case '$': {
+        if ((p + 1) != p_end)
+          goto dflt;
+        item.kind = PI_ENDANCHOR;
+        p++;
+        break;
+      }
+      case L_ESC: {
+        switch (*(p + 1)) {
+          case 'b': {
+            if (p + 2 >= p_end - 1)
+              return 0;  /* missing arguments to '%b' */
+            item.kind = PI_BALANCE;
+            item.c1 = uchar(*(p + 2));
+            item.c2 = uchar(*(p + 3));
+            p += 4;
+            break;
+          }
+          case 'f': {
+            p += 2;
+            if (*p != '[' || (ep = cclassend(p, p_end)) == NULL)
+              return 0;
+            item.kind = PI_FRONTIER;
+            if (pt != NULL) {
+              CharSet *cs = &pt->sets[ns];
+              memset(cs, 0, sizeof(CharSet));
+              setbracket(cs, p, ep - 1);
+              item.set = cs;
+            }
+            ns++;
+            p = ep;
+            break;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {
+            item.kind = PI_BACKREF;
+            item.c1 = uchar(*(p + 1));
+            p += 2;
+            break;
+          }
+          default: goto dflt;
+        }
+        break;
+      }
+      default: dflt: {
+        if ((ep = cclassend(p, p_end)) == NULL)
+          return 0;
+        if (*p == '.')
+          item.kind = PI_ANY;
+        else if (*p == L_ESC && isclass(uchar(*(p + 1)))) {
+          int in;
+          item.kind = PI_CLASS;
+          item.c1 = uchar(tolower(uchar(*(p + 1))));
+          item.c2 = !islower(uchar(*(p + 1)));
+          item.rg = getclassranges(uchar(*(p + 1)), &in);
+          item.in = (unsigned char)in;
+        }
+        else if (*p != '[') {
+          item.kind = PI_CHAR;
+          item.c1 = uchar(*(p + (*p == L_ESC)));  /* '%x' is 'x' otherwise */
+        }
+        else {
+          item.kind = PI_SET;
+          if (pt != NULL) {
+            CharSet *cs = &pt->sets[ns];
+            memset(cs, 0, sizeof(CharSet));
+            setbracket(cs, p, ep - 1);
+            setranges(cs);
+            item.set = cs;
+            if (cs->rg.n <= MAXRANGES) {
+              item.rg = &cs->rg;
+              item.in = !cs->neg;
+            }
+          }
+          ns++;
+        }
+        if (*ep == '*' || *ep == '+' || *ep == '-' || *ep == '?') {
+          item.suffix = uchar(*ep);
+          ep++;
+        }
+        p = ep;
+        break;
+      }
+    }
+    if (pt != NULL) pt->items[ni] = item;
+    ni++;
+  }
+  if (pt != NULL) {
+    pt->items[ni].kind = PI_END;
+    pt->items[ni].set = NULL;
+    pt->items[ni].rg = NULL;
+  }
+  *nitems = ni + 1;
+  *nsets = ns;
+  return 1;
+}
+
+
+static const char *cmatch (MatchState *ms, const char *s, const PatItem *p);
+
+
+static int csinglematch (MatchState *ms, const char *s, const PatItem *p) {
+  if (s >= ms->src_end)
+    return 0;
+  else {
+    int c = uchar(*s);
+    switch (p->kind) {
+      case PI_ANY: return 1;
+      case PI_CHAR: return (p->c1 == c);
+      case PI_CLASS: return (classmatch(c, p->c1) != 0) != p->c2;
+      default: return setmatch(p->set, c);
+    }
+  }
+}
+
+
+static const char *cmatchbalance (MatchState *ms, const char *s,
+                                  const PatItem *p) {
+  if (uchar(*s) != p->c1) return NULL;
+  else {
+    int cont = 1;
+    while (++s < ms->src_end) {
+      if (uchar(*s) == p->c2) {
+        if (--cont == 0) return s+1;
+      }
+      else if (uchar(*s) == p->c1) cont++;
+    }
+  }
+  return NULL;  /* string ends out of balance */
+}
+
+
+static const char *cmax_expand (MatchState *ms, const char *s,
+                                const PatItem *p) {
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  if (p->kind == PI_ANY)
+    i = ms->src_end - s;
+  else if (p->rg != NULL) {
+    for (;;) {  /* scan ASCII bytes with the kernel, check others here */
+      i += span_kernel(s + i, ms->src_end - (s + i), p->rg, p->in);
+      if (!csinglematch(ms, s + i, p)) break;
+      i++;
+    }
+  }
+  else {
+    while (csinglematch(ms, s + i, p))
+      i++;
+  }
+  /* keeps trying to match with the maximum repetitions */
+  while (i>=0) {
+    const char *res = cmatch(ms, (s+i), p + 1);
+    if (res) return res;
+    i--;  /* else didn't match; reduce 1 repetition to try again */
+  }
+  return NULL;
+}
+
+
+static const char *cmin_expand (MatchState *ms, const char *s,
+                                const PatItem *p) {
+  for (;;) {
+    const char *res = cmatch(ms, s, p + 1);
+    if (res != NULL)
+      return res;
+    else if (csinglematch(ms, s, p))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+static const char *cstart_capture (MatchState *ms, const char *s,
+                                   const PatItem *p, int what) {
+  const char *res;
+  int level = ms->level;
+  if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=cmatch(ms, s, p)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+
+static const char *cend_capture (MatchState *ms, const char *s,
+                                 const PatItem *p) {
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = cmatch(ms, s, p)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+
+static const char *cmatch (MatchState *ms, const char *s, const PatItem *p) {
+  if (ms->matchdepth-- == 0)
+    luaL_error(ms->L, "pattern too complex");
+  init: /* using goto's to optimize tail recursion */
+  switch (p->kind) {
+    case PI_END: break;
+    case PI_OPEN: {
+      s = cstart_capture(ms, s, p + 1, p->c1 ? CAP_POSITION : CAP_UNFINISHED);
+      break;
+    }
+    case PI_CLOSE: {
+      s = cend_capture(ms, s, p + 1);
+      break;
+    }
+    case PI_ENDANCHOR: {
+      s = (s == ms->src_end) ? s : NULL;  /* check end of string */
+      break;
+    }
+    case PI_BALANCE: {
+      s = cmatchbalance(ms, s, p);
+      if (s != NULL) {
+        p++; goto init;
+      }
+      break;
+    }
+    case PI_FRONTIER: {
+      char previous = (s == ms->src_init) ? '\0' : *(s - 1);
+      if (!setmatch(p->set, uchar(previous)) && setmatch(p->set, uchar(*s))) {
+        p++; goto init;
+      }
+      s = NULL;  /* match failed */
+      break;
+    }
+    case PI_BACKREF: {
+      s = match_capture(ms, s, p->c1);
+      if (s != NULL) {
+        p++; goto init;
+      }
+      break;
+    }
+    default: {  /* single item plus optional suffix */
+      if (!csinglematch(ms, s, p)) {
+        if (p->suffix == '*' || p->suffix == '?' || p->suffix == '-') {
+          p++; goto init;  /* accept empty */
+        }
+        else  /* '+' or no suffix */
+          s = NULL;  /* fail */
+      }
+      else {  /* matched once */
+        switch (p->suffix) {
+          case '?': {  /* optional */
+            const char *res;
+            if ((res = cmatch(ms, s + 1, p + 1)) != NULL)
+              s = res;
+            else {
+              p++; goto init;
+            }
+            break;
+          }
+          case '+':  /* 1 or more repetitions */
+            s++;  /* 1 match already done */
+            /* go through */
+          case '*':  /* 0 or more repetitions */
+            s = cmax_expand(ms, s, p);
+            break;
+          case '-':  /* 0 or more repetitions (minimum) */
+            s = cmin_expand(ms, s, p);
+            break;
+          default:  /* no suffix */
+            s++; p++; goto init;
+        }
+      }
+      break;
+    }
+  }
+  ms->matchdepth++;
+  return s;
+}
+
+
+/* number of compiled patterns kept per state */
+#define PATTCACHESIZE	32
+
+/*
+** Cache of compiled patterns, replacing the least recently used entry when
+** full. Entries are keyed by the address of the pattern string (plus whether
+** a leading '^' is an anchor), which is safe because the cache keeps the
+** strings alive: entry 'i' has the string at index '2*i+1' of the cache's
+** user value and the compiled pattern (a full userdata, or false if the
+** pattern cannot be compiled) at index '2*i+2'.
+*/
+typedef struct PatternCache {
+  unsigned int clock;  /* counts uses, for the 'used' stamps */
+  int n;  /* number of entries in use */
+  int last;  /* entry found by the previous lookup */
+  struct {
+    const char *p;
+    int anchor;
+    unsigned int used;
+    const Pattern *pt;
+  } e[PATTCACHESIZE];
+} PatternCache;
+
+
+/* key of the pattern cache in the registry */
+static const char pattcachekey = 0;
+
+
+/*
+** Returns the compiled form of the pattern at stack index 'arg' (the string
+** 'p' of length 'lp', without the '^' if 'anchor'), or NULL if it cannot be
+** compiled. The compiled pattern stays valid until the next call, as only a
+** new entry can evict it; if 'keep' is true, it is also left on the stack (a
+** userdata, or false), to keep it alive across calls back into Lua.
+*/
+static const Pattern *getpattern (lua_State *L, int arg, const char *p,
+                                  size_t lp, int anchor, int keep) {
+  const char *key = lua_tostring(L, arg);
+  PatternCache *pc;
+  Pattern *pt;
+  int i, victim = 0, nitems, nsets;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &pattcachekey);
+  pc = (PatternCache *)lua_touserdata(L, -1);
+  if (pc == NULL) {  /* no cache yet? */
+    lua_pop(L, 1);
+    pc = (PatternCache *)lua_newuserdata(L, sizeof(PatternCache));
+    pc->clock = 0;
+    pc->n = pc->last = 0;
+    lua_createtable(L, 2 * PATTCACHESIZE, 0);
+    lua_setuservalue(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &pattcachekey);
+  }
+  pc->clock++;
+  i = pc->last;
+  if (pc->e[i].p != key || pc->e[i].anchor != anchor) {  /* not repeated? */
+    for (i = 0; i < pc->n; i++) {
+      if (pc->e[i].p == key && pc->e[i].anchor == anchor) break;
+      if (pc->e[i].used < pc->e[victim].used) victim = i;
+    }
+  }
+  if (i < pc->n) {  /* found? */
+    pc->e[i].used = pc->clock;
+    pc->last = i;
+    if (keep) {
+      lua_getuservalue(L, -1);
+      lua_rawgeti(L, -1, 2 * i + 2);
+      lua_replace(L, -3);
+      lua_pop(L, 1);  /* ... value */
+    }
+    else
+      lua_pop(L, 1);
+    return pc->e[i].pt;
+  }
+  if (pc->n < PATTCACHESIZE)  /* cache not full? */
+    victim = pc->n++;
+  lua_getuservalue(L, -1);
+  lua_remove(L, -2);  /* ... entries */
+  if (compilepattern(p, p + lp, NULL, &nitems, &nsets)) {
+    pt = (Pattern *)lua_newuserdata(L, sizeof(Pattern) +
+                                       nitems * sizeof(PatItem) +
+                                       nsets * sizeof(CharSet));
+    /* items first: a 'CharSet' may have an odd size, a 'PatItem' has
+       pointers in it */
+    pt->items = (PatItem *)(pt + 1);
+    pt->sets = (CharSet *)(pt->items + nitems);
+    compilepattern(p, p + lp, pt, &nitems, &nsets);
+  }
+  else {  /* malformed; leave it to 'match' */
+    pt = NULL;
+    lua_pushboolean(L, 0);
+  }  /* ... entries value */
+  pc->e[victim].p = key;
+  pc->e[victim].anchor = anchor;
+  pc->e[victim].used = pc->clock;
+  pc->e[victim].pt = pt;
+  pc->last = victim;
+  lua_pushvalue(L, arg);
+  lua_rawseti(L, -3, 2 * victim + 1);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, 2 * victim + 2);
+  lua_remove(L, -2);  /* ... value */
+  if (!keep) lua_pop(L, 1);
+  return pt;
+}
+
+
+/* match with the compiled pattern if there is one */
+#define domatch(ms,s,pt,p)  \
+	((pt) ? cmatch(ms, s, (pt)->items) : match(ms, s, p))
+
+
+/*
+** Skips the positions from 's' on where an unanchored match cannot start,
+** because the first item of the pattern must match a single character and
+** does not. 'match' would fail there without side effects.
+*/
+static const char *skipstart (MatchState *ms, const char *s,
+                              const Pattern *pt) {
+  const PatItem *p;
+  if (pt == NULL) return s;
+  p = pt->items;
+  if (p->suffix != 0 && p->suffix != '+') return s;  /* item is optional */
+  switch (p->kind) {
+    case PI_CHAR: {
+      const char *init = (const char *)memchr(s, p->c1, ms->src_end - s);
+      return (init != NULL) ? init : ms->src_end;
+    }
+    case PI_CLASS: case PI_SET: {
+      if (p->rg != NULL) {  /* skip ASCII non-members with the kernel */
+        for (;;) {
+          s += span_kernel(s, ms->src_end - s, p->rg, !p->in);
+          if (s >= ms->src_end || csinglematch(ms, s, p)) break;
+          s++;
+        }
+      }
+      else {
+        while (s < ms->src_end && !csinglematch(ms, s, p)) s++;
+      }
+      return s;
+    }
+    default: return s;
+  }
+}
+
+
+
+static const char *lmemfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2) {
+  if (l2 == 0) return s1;  /* empty strings are everywhere */
+  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+  else if (l2 == 1) return (const char *)memchr(s1, *s2, l1);
+  else return find_kernel(s1, l1, s2, l2);
+}
+
+
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
@@ -607,9 +1573,11 @@ static int str_find_aux (lua_State *L, int find) {
     MatchState ms;
     const char *s1 = s + init - 1;
     int anchor = (*p == '^');
+    const Pattern *pt;
     if (anchor) {
       p++; lp--;  /* skip anchor character */
     }
+    pt = getpattern(L, 2, p, lp, anchor, 0);
     ms.L = L;
     ms.matchdepth = MAXCCALLS;
     ms.src_init = s;
@@ -619,7 +1587,8 @@ static int str_find_aux (lua_State *L, int find) {
       const char *res;
       ms.level = 0;
       lua_assert(ms.matchdepth == MAXCCALLS);
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if (!anchor) s1 = skipstart(&ms, s1, pt);
+      if ((res=domatch(&ms, s1, pt, p)) != NULL) {
         if (find) {
           lua_pushinteger(L, s1 - s + 1);  /* start */
           lua_pushinteger(L, res - s);   /* end */
@@ -650,6 +1619,7 @@ static int gmatch_aux (lua_State *L) {
   size_t ls, lp;
   const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
   const char *p = lua_tolstring(L, lua_upvalueindex(2), &lp);
+  const Pattern *pt = getpattern(L, lua_upvalueindex(2), p, lp, 0, 0);
   const char *src;
   ms.L = L;
   ms.matchdepth = MAXCCALLS;
@@ -662,7 +1632,8 @@ static int gmatch_aux (lua_State *L) {
     const char *e;
     ms.level = 0;
     lua_assert(ms.matchdepth == MAXCCALLS);
-    if ((e = match(&ms, src, p)) != NULL) {
+    src = skipstart(&ms, src, pt);
+    if ((e = domatch(&ms, src, pt, p)) != NULL) {
       lua_Integer newstart = e-s;
       if (e == src) newstart++;  /* empty match? go at least one position */
       lua_pushinteger(L, newstart);
@@ -753,13 +1724,16 @@ static int str_gsub (lua_State *L) {
   lua_Integer n = 0;
   MatchState ms;
   luaL_Buffer b;
+  const Pattern *pt;
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
-  luaL_buffinit(L, &b);
   if (anchor) {
     p++; lp--;  /* skip anchor character */
   }
+  pt = getpattern(L, 2, p, lp, anchor,  /* before 'b' uses the stack */
+                  tr == LUA_TFUNCTION || tr == LUA_TTABLE);
+  luaL_buffinit(L, &b);
   ms.L = L;
   ms.matchdepth = MAXCCALLS;
   ms.src_init = src;
@@ -769,7 +1743,12 @@ static int str_gsub (lua_State *L) {
     const char *e;
     ms.level = 0;
     lua_assert(ms.matchdepth == MAXCCALLS);
-    e = match(&ms, src, p);
+    if (!anchor) {  /* copy what cannot start a match */
+      const char *init = skipstart(&ms, src, pt);
+      luaL_addlstring(&b, src, init - src);
+      src = init;
+    }
+    e = domatch(&ms, src, pt, p);
     if (e) {
       n++;
       add_value(&ms, &b, src, e, tr);
@@ -1136,14 +2115,13 @@ static KOption getdetails (Header *h, size_t totalsize,
 
 
 /*
-** Pack integer 'n' with 'size' bytes and 'islittle' endianness.
+** Pack integer 'n' into 'buff' with 'size' bytes and 'islittle' endianness.
 ** The final 'if' handles the case when 'size' is larger than
 ** the size of a Lua integer, correcting the extra sign-extension
 ** bytes if necessary (by default they would be zeros).
 */
-static void packint (luaL_Buffer *b, lua_Unsigned n,
-                     int islittle, int size, int neg) {
-  char *buff = luaL_prepbuffsize(b, size);
+static void putint (char *buff, lua_Unsigned n,
+                    int islittle, int size, int neg) {
   int i;
   buff[islittle ? 0 : size - 1] = (char)(n & MC);  /* first byte */
   for (i = 1; i < size; i++) {
@@ -1154,6 +2132,13 @@ static void packint (luaL_Buffer *b, lua_Unsigned n,
     for (i = SZINT; i < size; i++)  /* correct extra bytes */
       buff[islittle ? i : size - 1 - i] = (char)MC;
   }
+}
+
+
+static void packint (luaL_Buffer *b, lua_Unsigned n,
+                     int islittle, int size, int neg) {
+  char *buff = luaL_prepbuffsize(b, size);
+  putint(buff, n, islittle, size, neg);
   luaL_addsize(b, size);  /* add result to buffer */
 }
 
@@ -1319,11 +2304,20 @@ static lua_Integer unpackint (lua_State *L, const char *str,
 }
 
 
+/* data to unpack: a string or a byte array of the 'bytes' library */
+static const char *checkdata (lua_State *L, int arg, size_t *len) {
+  const char *data = (const char *)luaL_testbytes(L, arg, len);
+  if (data == NULL)
+    data = luaL_checklstring(L, arg, len);
+  return data;
+}
+
+
 static int str_unpack (lua_State *L) {
   Header h;
   const char *fmt = luaL_checkstring(L, 1);
   size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
+  const char *data = checkdata(L, 2, &ld);
   size_t pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
   int n = 0;  /* number of results */
   luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
@@ -1382,6 +2376,299 @@ static int str_unpack (lua_State *L) {
   return n + 1;
 }
 
+
+/*
+** Bulk packing of arrays. A format describes one record; its value
+** options (integers, floats and fixed-size strings) are translated once
+** into items with precomputed offsets, as every record is packed as if by
+** a separate call to 'string.pack', starting from the default settings.
+** Formats can be compiled beforehand into handles with 'packformat', or
+** given as strings, which are translated once per call.
+*/
+
+/* metatable of format handles */
+#define PACKFORMAT	"PACKFORMAT"
+
+/* items of formats given as strings that fit on the C stack */
+#define LOCALITEMS	16
+
+
+typedef struct PackItem {
+  KOption opt;  /* Kint, Kuint, Kfloat or Kchar */
+  int islittle;
+  int size;
+  size_t offset;  /* offset of the value in the record */
+} PackItem;
+
+
+typedef struct PackFormat {
+  size_t recsize;  /* size of a record */
+  int padded;  /* whether records have padding bytes */
+  int nitems;  /* number of values in a record */
+  PackItem items[1];  /* actually 'nitems' */
+} PackFormat;
+
+
+/* local space for formats given as strings */
+typedef union LocalFormat {
+  PackFormat f;
+  char b[sizeof(PackFormat) + (LOCALITEMS - 1) * sizeof(PackItem)];
+} LocalFormat;
+
+
+/*
+** Translates 'fmt' into 'pf', storing at most 'maxitems' items. Returns
+** the number of items in the format.
+*/
+static int readformat (lua_State *L, const char *fmt, PackFormat *pf,
+                       int maxitems) {
+  Header h;
+  size_t totalsize = 0;
+  int n = 0;
+  initheader(L, &h);
+  pf->padded = 0;
+  while (*fmt != '\0') {
+    int size, ntoalign;
+    KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
+    luaL_argcheck(L, totalsize <= MAXSIZE - ntoalign - size, 1,
+                     "format result too large");
+    totalsize += ntoalign;
+    if (ntoalign > 0) pf->padded = 1;
+    switch (opt) {
+      case Kint: case Kuint: case Kfloat: case Kchar: {
+        if (n < maxitems) {
+          pf->items[n].opt = opt;
+          pf->items[n].islittle = h.islittle;
+          pf->items[n].size = size;
+          pf->items[n].offset = totalsize;
+        }
+        n++;
+        break;
+      }
+      case Kstring: case Kzstr:
+        luaL_argerror(L, 1, "variable-length format");
+        break;
+      case Kpadding: pf->padded = 1; break;
+      default: break;
+    }
+    totalsize += size;
+  }
+  luaL_argcheck(L, n > 0, 1, "format has no values");
+  luaL_argcheck(L, totalsize > 0, 1, "format has empty records");
+  pf->recsize = totalsize;
+  pf->nitems = n;
+  return n;
+}
+
+
+/*
+** Returns the format at index 'arg', a handle or a string. A string is
+** translated into 'local', or into a new userdata left on the top of the
+** stack if it has too many values.
+*/
+static const PackFormat *getformat (lua_State *L, int arg,
+                                    LocalFormat *local) {
+  PackFormat *pf = (PackFormat *)luaL_testudata(L, arg, PACKFORMAT);
+  if (pf == NULL) {
+    const char *fmt = luaL_checkstring(L, arg);
+    int n = readformat(L, fmt, &local->f, LOCALITEMS);
+    pf = &local->f;
+    if (n > LOCALITEMS) {
+      pf = (PackFormat *)lua_newuserdata(L, sizeof(PackFormat) +
+                                            (n - 1) * sizeof(PackItem));
+      readformat(L, fmt, pf, n);
+    }
+  }
+  return pf;
+}
+
+
+/*
+** Creates a format handle. Handles are persisted as a closure of this
+** function with the format string as upvalue (see 'pf_persist').
+*/
+static int str_packformat (lua_State *L) {
+  int arg = lua_upvalueindex(1);
+  const char *fmt;
+  PackFormat *pf;
+  LocalFormat local;
+  int n;
+  if (lua_type(L, arg) == LUA_TNONE)  /* not restoring a persisted one? */
+    arg = 1;
+  fmt = luaL_checkstring(L, arg);
+  n = readformat(L, fmt, &local.f, 0);  /* count items */
+  pf = (PackFormat *)lua_newuserdata(L, sizeof(PackFormat) +
+                                        (n - 1) * sizeof(PackItem));
+  readformat(L, fmt, pf, n);
+  luaL_setmetatable(L, PACKFORMAT);
+  lua_pushvalue(L, arg);
+  lua_setuservalue(L, -2);  /* keep format string */
+  return 1;
+}
+
+
+static int pf_tostring (lua_State *L) {
+  luaL_checkudata(L, 1, PACKFORMAT);
+  lua_getuservalue(L, 1);
+  lua_pushfstring(L, "packformat (%s)", lua_tostring(L, -1));
+  return 1;
+}
+
+
+/* Eris: persist as a closure that translates the format again */
+static int pf_persist (lua_State *L) {
+  luaL_checkudata(L, 1, PACKFORMAT);
+  lua_getuservalue(L, 1);
+  lua_pushcclosure(L, str_packformat, 1);
+  return 1;
+}
+
+
+/*
+** string.packarray(fmt, t [, i [, j]]) packs 't[i]' to 't[j]' (raw
+** accesses), one record of 'fmt' after the other, straight into a buffer
+** of the final size.
+*/
+static int str_packarray (lua_State *L) {
+  LocalFormat local;
+  const PackFormat *pf;
+  lua_Integer i, j;
+  lua_Unsigned nvals, nrecs, r;
+  luaL_Buffer b;
+  char *buff;
+  lua_settop(L, 4);  /* arguments stay below a format userdata */
+  pf = getformat(L, 1, &local);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  i = luaL_optinteger(L, 3, 1);
+  j = luaL_opt(L, luaL_checkinteger, 4, luaL_len(L, 2));
+  if (i > j) {  /* empty range? */
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  nvals = (lua_Unsigned)j - (lua_Unsigned)i + 1;
+  luaL_argcheck(L, nvals != 0 && nvals % pf->nitems == 0, 4,
+                   "number of values not a multiple of the format's");
+  nrecs = nvals / pf->nitems;
+  luaL_argcheck(L, nrecs <= MAXSIZE / pf->recsize, 4,
+                   "resulting string too large");
+  buff = luaL_buffinitsize(L, &b, (size_t)nrecs * pf->recsize);
+  for (r = 0; r < nrecs; r++, buff += pf->recsize) {
+    int item;
+    if (pf->padded)
+      memset(buff, LUA_PACKPADBYTE, pf->recsize);
+    for (item = 0; item < pf->nitems; item++) {
+      const PackItem *it = &pf->items[item];
+      char *p = buff + it->offset;
+      lua_Integer k = (lua_Integer)((lua_Unsigned)i + r * pf->nitems + item);
+      int ok;
+      lua_rawgeti(L, 2, k);
+      switch (it->opt) {
+        case Kint: case Kuint: {
+          lua_Integer n = lua_tointegerx(L, -1, &ok);
+          if (ok && it->size < SZINT) {  /* need overflow check? */
+            if (it->opt == Kint) {
+              lua_Integer lim = (lua_Integer)1 << ((it->size * NB) - 1);
+              ok = (-lim <= n && n < lim);
+            }
+            else
+              ok = ((lua_Unsigned)n < ((lua_Unsigned)1 << (it->size * NB)));
+          }
+          if (!ok) goto badvalue;
+          putint(p, (lua_Unsigned)n, it->islittle, it->size,
+                    (it->opt == Kint && n < 0));
+          break;
+        }
+        case Kfloat: {
+          volatile Ftypes u;
+          lua_Number n = lua_tonumberx(L, -1, &ok);
+          if (!ok) goto badvalue;
+          if (it->size == sizeof(u.f)) u.f = (float)n;
+          else if (it->size == sizeof(u.d)) u.d = (double)n;
+          else u.n = n;
+          copywithendian(p, u.buff, it->size, it->islittle);
+          break;
+        }
+        default: {  /* Kchar */
+          size_t len;
+          const char *s;
+          if (lua_type(L, -1) != LUA_TSTRING && lua_type(L, -1) != LUA_TNUMBER)
+            goto badvalue;
+          s = lua_tolstring(L, -1, &len);
+          if (len != (size_t)it->size) goto badvalue;
+          memcpy(p, s, len);
+          break;
+        }
+      }
+      lua_pop(L, 1);
+      continue;
+     badvalue:
+      return luaL_error(L, "invalid value (%s) at index %I in table for "
+                           "'packarray'", luaL_typename(L, -1), (LUAI_UACINT)k);
+    }
+  }
+  luaL_pushresultsize(&b, (size_t)nrecs * pf->recsize);
+  return 1;
+}
+
+
+/*
+** string.unpackarray(fmt, s [, pos [, n]]) unpacks 'n' records of 'fmt'
+** (by default, as many as there are) into a new table, presized for all
+** their values. Returns the table and the position after the last record.
+*/
+static int str_unpackarray (lua_State *L) {
+  LocalFormat local;
+  const PackFormat *pf;
+  size_t ld, pos;
+  const char *data;
+  lua_Integer n;
+  int nvals, k;
+  lua_settop(L, 4);  /* arguments stay below a format userdata */
+  pf = getformat(L, 1, &local);
+  data = checkdata(L, 2, &ld);
+  pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
+  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
+  n = luaL_optinteger(L, 4, (lua_Integer)((ld - pos) / pf->recsize));
+  luaL_argcheck(L, n >= 0, 4, "invalid number of records");
+  if ((lua_Unsigned)n > (ld - pos) / pf->recsize)
+    luaL_argerror(L, 2, "data string too short");
+  if ((lua_Unsigned)n > (lua_Unsigned)(INT_MAX / pf->nitems))
+    return luaL_error(L, "too many values to unpack");
+  nvals = (int)n * pf->nitems;
+  lua_createtable(L, nvals, 0);
+  for (k = 1; k <= nvals; data += pf->recsize) {
+    int item;
+    for (item = 0; item < pf->nitems; item++, k++) {
+      const PackItem *it = &pf->items[item];
+      const char *p = data + pos + it->offset;
+      switch (it->opt) {
+        case Kint: case Kuint: {
+          lua_pushinteger(L, unpackint(L, p, it->islittle, it->size,
+                                          (it->opt == Kint)));
+          break;
+        }
+        case Kfloat: {
+          volatile Ftypes u;
+          lua_Number num;
+          copywithendian(u.buff, p, it->size, it->islittle);
+          if (it->size == sizeof(u.f)) num = (lua_Number)u.f;
+          else if (it->size == sizeof(u.d)) num = (lua_Number)u.d;
+          else num = u.n;
+          lua_pushnumber(L, num);
+          break;
+        }
+        default: {  /* Kchar */
+          lua_pushlstring(L, p, it->size);
+          break;
+        }
+      }
+      lua_rawseti(L, -2, k);
+    }
+  }
+  lua_pushinteger(L, (lua_Integer)(pos + (size_t)n * pf->recsize) + 1);
+  return 2;
+}
+
 /* }====================================================== */
 
 
@@ -1403,6 +2690,9 @@ static const luaL_Reg strlib[] = {
   {"pack", str_pack},
   {"packsize", str_packsize},
   {"unpack", str_unpack},
+  {"packformat", str_packformat},
+  {"packarray", str_packarray},
+  {"unpackarray", str_unpackarray},
   {NULL, NULL}
 };
 
@@ -1422,9 +2712,19 @@ static void createmetatable (lua_State *L) {
 /*
 ** Open string library
 */
+static const luaL_Reg pfmeta[] = {
+  {"__tostring", pf_tostring},
+  {"__persist", pf_persist},
+  {NULL, NULL}
+};
+
+
 LUAMOD_API int luaopen_string (lua_State *L) {
   luaL_newlib(L, strlib);
   createmetatable(L);
+  luaL_newmetatable(L, PACKFORMAT);  /* metatable for format handles */
+  luaL_setfuncs(L, pfmeta, 0);
+  lua_pop(L, 1);  /* pop metatable */
   return 1;
 }
 
@@ -1442,5 +2742,15 @@ void eris_permstrlib(lua_State *L, int forUnpersist) {
     lua_pushstring(L, "__eris.strlib_gmatch_aux");
   }
   lua_rawset(L, -3);
+
+  if (forUnpersist) {
+    lua_pushstring(L, "__eris.strlib_packformat");
+    lua_pushcfunction(L, str_packformat);
+  }
+  else {
+    lua_pushcfunction(L, str_packformat);
+    lua_pushstring(L, "__eris.strlib_packformat");
+  }
+  lua_rawset(L, -3);
 }
 
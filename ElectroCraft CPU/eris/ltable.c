@@ -639,6 +639,151 @@ int luaH_getn (Table *t) {
 
 
 
+
+/*
+** {======================================================
+** Native sort of homogeneous arrays
+** (introsort: quicksort with a median of three, switching to heapsort
+**  when the recursion gets too deep and to insertion sort for small
+**  ranges)
+** =======================================================
+*/
+
+/* kinds of arrays sorted natively */
+#define SORTINT		0
+#define SORTFLT		1
+#define SORTSTR		2
+
+/* ranges up to this size are sorted with an insertion sort */
+#define SORTSMALL	16
+
+
+/* a < b, for two values of the kind of array being sorted */
+static int sortlt (lua_State *L, int kind, const TValue *a, const TValue *b) {
+  switch (kind) {
+    case SORTINT: return ivalue(a) < ivalue(b);
+    case SORTFLT: return luai_numlt(fltvalue(a), fltvalue(b));
+    default: return luaV_lessthan(L, a, b);  /* string comparison */
+  }
+}
+
+
+static void sortswap (lua_State *L, TValue *a, TValue *b) {
+  TValue temp;
+  setobj(L, &temp, a);
+  setobj(L, a, b);
+  setobj(L, b, &temp);
+}
+
+
+static void insertionsort (lua_State *L, int kind, TValue *a,
+                           unsigned int n) {
+  unsigned int i, j;
+  for (i = 1; i < n; i++) {
+    TValue v;
+    setobj(L, &v, &a[i]);
+    for (j = i; j > 0 && sortlt(L, kind, &v, &a[j - 1]); j--)
+      setobj(L, &a[j], &a[j - 1]);
+    setobj(L, &a[j], &v);
+  }
+}
+
+
+static void siftdown (lua_State *L, int kind, TValue *a, unsigned int i,
+                      unsigned int n) {
+  for (;;) {
+    unsigned int child = 2 * i + 1;
+    if (child >= n) break;
+    if (child + 1 < n && sortlt(L, kind, &a[child], &a[child + 1]))
+      child++;
+    if (!sortlt(L, kind, &a[i], &a[child])) break;
+    sortswap(L, &a[i], &a[child]);
+    i = child;
+  }
+}
+
+
+static void heapsort (lua_State *L, int kind, TValue *a, unsigned int n) {
+  unsigned int i;
+  for (i = n / 2; i > 0; i--)
+    siftdown(L, kind, a, i - 1, n);
+  for (i = n - 1; i > 0; i--) {
+    sortswap(L, &a[0], &a[i]);
+    siftdown(L, kind, a, 0, i);
+  }
+}
+
+
+static void introsort (lua_State *L, int kind, TValue *a, unsigned int n,
+                       int depth) {
+  while (n > SORTSMALL) {
+    unsigned int i, j, m = n / 2;
+    TValue p;
+    if (depth-- == 0) {  /* too many bad pivots? */
+      heapsort(L, kind, a, n);
+      return;
+    }
+    /* sort a[0], a[m] and a[n - 1]; they bound the scans below */
+    if (sortlt(L, kind, &a[m], &a[0])) sortswap(L, &a[m], &a[0]);
+    if (sortlt(L, kind, &a[n - 1], &a[m])) {
+      sortswap(L, &a[n - 1], &a[m]);
+      if (sortlt(L, kind, &a[m], &a[0])) sortswap(L, &a[m], &a[0]);
+    }
+    setobj(L, &p, &a[m]);  /* pivot */
+    i = 0; j = n - 1;
+    for (;;) {  /* invariant: a[0..i] <= p <= a[j..n-1] */
+      while (sortlt(L, kind, &a[++i], &p)) ;
+      while (sortlt(L, kind, &p, &a[--j])) ;
+      if (i >= j) break;
+      sortswap(L, &a[i], &a[j]);
+    }
+    /* a[0..j] <= p <= a[j+1..n-1]; recurse into the smaller part */
+    if (j + 1 < n - j - 1) {
+      introsort(L, kind, a, j + 1, depth);
+      a += j + 1; n -= j + 1;
+    }
+    else {
+      introsort(L, kind, a + j + 1, n - j - 1, depth);
+      n = j + 1;
+    }
+  }
+  insertionsort(L, kind, a, n);
+}
+
+
+/*
+** Sorts t[1..n] with the primitive '<' if all those elements are in the
+** array part and are all integers, all floats (without NaNs) or all
+** strings. Returns 0 without touching the table otherwise. Moving values
+** inside the same table needs no barrier.
+*/
+int luaH_sortarray (lua_State *L, Table *t, unsigned int n) {
+  TValue *a = t->array;
+  unsigned int i;
+  int kind, depth = 0;
+  if (n > t->sizearray) return 0;  /* not all in the array part */
+  else if (n < 2) return 1;  /* nothing to sort */
+  if (ttisinteger(&a[0])) kind = SORTINT;
+  else if (ttisfloat(&a[0])) kind = SORTFLT;
+  else if (ttisstring(&a[0])) kind = SORTSTR;
+  else return 0;
+  for (i = 0; i < n; i++) {
+    switch (kind) {
+      case SORTINT: if (!ttisinteger(&a[i])) return 0; break;
+      case SORTFLT:
+        if (!ttisfloat(&a[i]) || luai_numisnan(fltvalue(&a[i]))) return 0;
+        break;
+      default: if (!ttisstring(&a[i])) return 0; break;
+    }
+  }
+  for (i = n; i > 1; i >>= 1)
+    depth += 2;  /* 2 * log2(n) */
+  introsort(L, kind, a, n, depth);
+  return 1;
+}
+
+/* }====================================================== */
+
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
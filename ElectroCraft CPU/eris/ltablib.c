@@ -323,6 +323,9 @@ static int sort (lua_State *L) {
   if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
     luaL_checktype(L, 2, LUA_TFUNCTION);
   lua_settop(L, 2);  /* make sure there are two arguments */
+  if (lua_isnil(L, 2) && lua_type(L, 1) == LUA_TTABLE &&
+      lua_sortarray(L, 1, n))
+    return 0;  /* plain array of numbers or strings, sorted natively */
   auxsort(L, &ta, 1, n);
   return 0;
 }
@@ -246,6 +246,7 @@ LUA_API int (lua_rawgetp) (lua_State *L, int idx, const void *p);
 
 LUA_API void  (lua_createtable) (lua_State *L, int narr, int nrec);
 LUA_API void *(lua_newuserdata) (lua_State *L, size_t sz);
+LUA_API char *(lua_newstring) (lua_State *L, size_t len);
 LUA_API int   (lua_getmetatable) (lua_State *L, int objindex);
 LUA_API int  (lua_getuservalue) (lua_State *L, int idx);
 
@@ -306,10 +307,41 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCHEADROOM		10
+#define LUA_GCFINCOUNT		11
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
 
+/*
+** string table function and options
+*/
+
+#define LUA_STRTSIZE		0
+#define LUA_STRTCOUNT		1
+#define LUA_STRTUSED		2
+#define LUA_STRTMAXCHAIN	3
+#define LUA_STRTSETGROW		4
+#define LUA_STRTSETSHRINK	5
+#define LUA_STRTRESIZE		6
+
+LUA_API int (lua_strtab) (lua_State *L, int what, int data);
+
+
+/*
+** CPU usage function and options
+*/
+
+#define LUA_CPUCOUNT		0
+#define LUA_CPUTIME		1
+#define LUA_CPUBUDGET		2
+#define LUA_CPUSETBUDGET	3
+#define LUA_CPUSETTIMING	4
+#define LUA_CPUYIELDED		5
+
+LUA_API lua_Integer (lua_cpuusage) (lua_State *L, int what, lua_Integer data);
+
+
 /*
 ** miscellaneous functions
 */
@@ -320,6 +352,7 @@ LUA_API int   (lua_next) (lua_State *L, int idx);
 
 LUA_API void  (lua_concat) (lua_State *L, int n);
 LUA_API void  (lua_len)    (lua_State *L, int idx);
+LUA_API int   (lua_sortarray) (lua_State *L, int idx, lua_Integer n);
 
 LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 
@@ -422,6 +455,9 @@ typedef void (*lua_Hook) (lua_State *L, lua_Debug *ar);
 
 LUA_API int (lua_getstack) (lua_State *L, int level, lua_Debug *ar);
 LUA_API int (lua_getinfo) (lua_State *L, const char *what, lua_Debug *ar);
+LUA_API int (lua_getpc) (lua_State *L, lua_Debug *ar);
+LUA_API int (lua_getinfoat) (lua_State *L, int pc, const char *what,
+                             lua_Debug *ar);
 LUA_API const char *(lua_getlocal) (lua_State *L, const lua_Debug *ar, int n);
 LUA_API const char *(lua_setlocal) (lua_State *L, const lua_Debug *ar, int n);
 LUA_API const char *(lua_getupvalue) (lua_State *L, int funcindex, int n);
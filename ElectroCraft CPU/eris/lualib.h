@@ -47,6 +47,13 @@ LUAMOD_API int (luaopen_package) (lua_State *L);
 #define LUA_ERISLIBNAME	"eris"
 LUAMOD_API int (luaopen_eris) (lua_State *L);
 
+#define LUA_STRBUFLIBNAME	"strbuf"
+LUAMOD_API int (luaopen_strbuf) (lua_State *L);
+
+#define LUA_BYTESLIBNAME	"bytes"
+LUAMOD_API int (luaopen_bytes) (lua_State *L);
+LUALIB_API unsigned char *(luaL_testbytes) (lua_State *L, int arg, size_t *len);
+
 /* open all previous libraries */
 LUALIB_API void (luaL_openlibs) (lua_State *L);
 
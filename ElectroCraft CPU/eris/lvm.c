@@ -187,6 +187,111 @@ void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
 }
 
 
+/*
+** Inline caches for table accesses with constant short string keys (global
+** variables, fields and method names). Each instruction remembers the index
+** of the node where it last found its key, so a hit skips the hashing and
+** the collision chain. The index is only a hint: it is used if it is inside
+** the node array of the table being indexed and that node holds the key,
+** in which case it holds the key's value whatever happened since (rehashes,
+** nodes moved by collisions, a different table). So nothing has to be
+** invalidated.
+*/
+static const TValue *cachedslot (Table *h, unsigned int i, TString *key) {
+  if (i < cast(unsigned int, sizenode(h))) {
+    Node *n = gnode(h, i);
+    if (ttisshrstring(gkey(n)) && eqshrstr(tsvalue(gkey(n)), key) &&
+        !ttisnil(gval(n)))
+      return gval(n);
+  }
+  return NULL;
+}
+
+
+/*
+** Fast path of the inline cache: returns the value of 'key' in table 't' or,
+** when the key is not in 't', in a table set as its '__index' (as for method
+** calls on instances), remembering where it was found. Returns NULL when the
+** access needs the slow path.
+*/
+static const TValue *cachedget (lua_State *L, const Proto *p,
+                                const Instruction *pc, const TValue *t,
+                                const TValue *key) {
+  if (p->icache != NULL && ttistable(t) && ttisshrstring(key)) {
+    unsigned int *ic = &p->icache[pcRel(pc, p)];
+    Table *h = hvalue(t);
+    const TValue *res = cachedslot(h, *ic, tsvalue(key));
+    if (res == NULL) {
+      res = luaH_getstr(h, tsvalue(key));
+      if (ttisnil(res)) {  /* try a '__index' table */
+        const TValue *tm = fasttm(L, h->metatable, TM_INDEX);
+        if (tm == NULL || !ttistable(tm))
+          return NULL;
+        h = hvalue(tm);
+        res = cachedslot(h, *ic, tsvalue(key));
+        if (res == NULL) {
+          res = luaH_getstr(h, tsvalue(key));
+          if (ttisnil(res))
+            return NULL;
+        }
+      }
+      *ic = cast(unsigned int, cast(const Node *, res) - h->node);
+    }
+    return res;
+  }
+  return NULL;
+}
+
+
+/*
+** Slow path of the inline cache, same as 'luaV_gettable' otherwise. Follows
+** '__index' tables itself, so that for method calls the cache ends up with
+** the node of the method in the class table; the instance is checked with a
+** regular lookup first. The caches of a function are created the first time
+** it misses.
+*/
+static void cachedmiss (lua_State *L, CallInfo *ci, const TValue *t,
+                        TValue *key, StkId val) {
+  Proto *p = clLvalue(ci->func)->p;
+  int pc = pcRel(ci->u.l.savedpc, p);
+  int loop;
+  if (!ttisshrstring(key)) {
+    luaV_gettable(L, t, key, val);
+    return;
+  }
+  if (p->icache == NULL)
+    luaF_newicache(L, p);
+  for (loop = 0; loop < MAXTAGLOOP; loop++) {
+    Table *h;
+    const TValue *res, *tm;
+    if (!ttistable(t)) {  /* no fast path for other types */
+      luaV_gettable(L, t, key, val);
+      return;
+    }
+    h = hvalue(t);
+    res = cachedslot(h, p->icache[pc], tsvalue(key));
+    if (res == NULL)
+      res = luaH_getstr(h, tsvalue(key));
+    if (!ttisnil(res)) {  /* 'res' is the value field of a node */
+      p->icache[pc] = cast(unsigned int, cast(const Node *, res) - h->node);
+      setobj2s(L, val, res);
+      return;
+    }
+    tm = fasttm(L, h->metatable, TM_INDEX);
+    if (tm == NULL) {  /* no metamethod? */
+      setnilvalue(val);
+      return;
+    }
+    if (ttisfunction(tm)) {  /* metamethod is a function */
+      luaT_callTM(L, tm, t, key, val, 1);
+      return;
+    }
+    t = tm;  /* else repeat access over 'tm' */
+  }
+  luaG_runerror(L, "gettable chain too long; possible loop");
+}
+
+
 /*
 ** Main function for table assignment (invoking metamethods if needed).
 ** Compute 't[key] = val'
@@ -634,7 +739,17 @@ void luaV_finishOp (lua_State *L) {
 #define donextjump(ci)	{ i = *ci->u.l.savedpc; dojump(ci, i, 1); }
 
 
-#define Protect(x)	{ {x;}; base = ci->u.l.base; }
+/*
+** Other code may run inside 'x', so the stack may have moved and the
+** thread may have spent or changed its instruction budget.
+*/
+#define Protect(x)	{ {x;}; base = ci->u.l.base; instrleft = L->instrleft; }
+
+/* 'ra = t[k]' through the inline cache of the current instruction */
+#define gettablecached(t,k,ra) { \
+  const TValue *slot = cachedget(L, cl->p, ci->u.l.savedpc, t, k); \
+  if (slot != NULL) { setobj2s(L, ra, slot); } \
+  else Protect(cachedmiss(L, ci, t, k, ra)); }
 
 #define checkGC(L,c)  \
   Protect( luaC_condGC(L,{L->top = (c);  /* limit of live values */ \
@@ -652,15 +767,19 @@ void luaV_execute (lua_State *L) {
   LClosure *cl;
   TValue *k;
   StkId base;
+  lua_Integer instrleft;  /* copy of 'L->instrleft' */
  newframe:  /* reentry point when frame changes (call/return) */
   lua_assert(ci == L->ci);
   cl = clLvalue(ci->func);
   k = cl->p->k;
   base = ci->u.l.base;
+  instrleft = L->instrleft;
   /* main loop of interpreter */
   for (;;) {
     Instruction i = *(ci->u.l.savedpc++);
     StkId ra;
+    if ((L->instrleft = --instrleft) < 0)  /* out of instruction budget? */
+      luaG_outofbudget(L);
     if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
         (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
       Protect(luaG_traceexec(L));
@@ -705,11 +824,11 @@ void luaV_execute (lua_State *L) {
       }
       vmcase(OP_GETTABUP) {
         int b = GETARG_B(i);
-        Protect(luaV_gettable(L, cl->upvals[b]->v, RKC(i), ra));
+        gettablecached(cl->upvals[b]->v, RKC(i), ra);
         vmbreak;
       }
       vmcase(OP_GETTABLE) {
-        Protect(luaV_gettable(L, RB(i), RKC(i), ra));
+        gettablecached(RB(i), RKC(i), ra);
         vmbreak;
       }
       vmcase(OP_SETTABUP) {
@@ -740,7 +859,7 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_SELF) {
         StkId rb = RB(i);
         setobjs2s(L, ra+1, rb);
-        Protect(luaV_gettable(L, rb, RKC(i), ra));
+        gettablecached(rb, RKC(i), ra);
         vmbreak;
       }
       vmcase(OP_ADD) { 
@@ -991,6 +1110,7 @@ void luaV_execute (lua_State *L) {
         if (luaD_precall(L, ra, nresults)) {  /* C function? */
           if (nresults >= 0) L->top = ci->top;  /* adjust results */
           base = ci->u.l.base;
+          instrleft = L->instrleft;
         }
         else {  /* Lua function */
           ci = L->ci;
@@ -1003,8 +1123,10 @@ void luaV_execute (lua_State *L) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);
-        if (luaD_precall(L, ra, LUA_MULTRET))  /* C function? */
+        if (luaD_precall(L, ra, LUA_MULTRET)) {  /* C function? */
           base = ci->u.l.base;
+          instrleft = L->instrleft;
+        }
         else {
           /* tail call: put called frame (n) in place of caller one (o) */
           CallInfo *nci = L->ci;  /* called frame */
@@ -1096,6 +1218,29 @@ void luaV_execute (lua_State *L) {
         ci->u.l.savedpc += GETARG_sBx(i);
         vmbreak;
       }
+      vmcase(OP_FORILOOP) {  /* OP_FORLOOP knowing it counts integers */
+        lua_Integer step = ivalue(ra + 2);
+        lua_Integer idx = intop(+, ivalue(ra), step); /* increment index */
+        lua_Integer limit = ivalue(ra + 1);
+        if ((0 < step) ? (idx <= limit) : (limit <= idx)) {
+          ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
+          setivalue(ra, idx);  /* update internal index... */
+          setivalue(ra + 3, idx);  /* ...and external index */
+        }
+        vmbreak;
+      }
+      vmcase(OP_FORIPREP) {  /* initial value and step are integers */
+        lua_Integer ilimit;
+        int stopnow;
+        if (!ttisinteger(ra) || !ttisinteger(ra + 2))  /* changed by debug? */
+          luaG_runerror(L, "'for' initial value and step must be integers");
+        if (!forlimit(ra + 1, &ilimit, ivalue(ra + 2), &stopnow))
+          luaG_runerror(L, "'for' limit must be a number");
+        setivalue(ra + 1, ilimit);
+        setivalue(ra, intop(-, (stopnow ? 0 : ivalue(ra)), ivalue(ra + 2)));
+        ci->u.l.savedpc += GETARG_sBx(i);
+        vmbreak;
+      }
       vmcase(OP_TFORCALL) {
         StkId cb = ra + 3;  /* call base */
         setobjs2s(L, cb+2, ra+2);
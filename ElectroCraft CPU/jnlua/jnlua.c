@@ -3,6 +3,7 @@
  * See LICENSE.txt for license terms.
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <setjmp.h>
@@ -10,6 +11,7 @@
 #include "../eris/lua.h"
 #include "../eris/lauxlib.h"
 #include "../eris/lualib.h"
+#include "../eris/eris.h"
 
 /* Include uintptr_t */
 #ifdef LUA_WIN
@@ -24,7 +26,37 @@
 #define JNLUA_JNIVERSION JNI_VERSION_1_6
 #define JNLUA_JAVASTATE "jnlua.JavaState"
 #define JNLUA_OBJECT "jnlua.Object"
+#define JNLUA_LOADBUFFER "jnlua.LoadBuffer"
+#define JNLUA_LOADBUFFERSIZE 16384
+#define JNLUA_RESUMEHANDLE "jnlua.ResumeHandle"
+#define JNLUA_PERMS "jnlua.Perms"
+#define JNLUA_UNPERMS "jnlua.Unperms"
+#define JNLUA_LIBS 13
 #define JNLUA_MINSTACK LUA_MINSTACK
+#define JNLUA_HEADROOM 1024
+#define JNLUA_MAXTRACES 32
+#define JNLUA_MAXTRACEFRAMES 32
+#define JNLUA_STRINGBUFFER 256
+#define JNLUA_RESETBUDGET 1000000
+#define JNLUA_OP_PUSHNIL 1
+#define JNLUA_OP_PUSHBOOLEAN 2
+#define JNLUA_OP_PUSHINTEGER 3
+#define JNLUA_OP_PUSHNUMBER 4
+#define JNLUA_OP_PUSHSTRING 5
+#define JNLUA_OP_PUSHSTRINGID 6
+#define JNLUA_OP_PUSHVALUE 7
+#define JNLUA_OP_POP 8
+#define JNLUA_OP_NEWTABLE 9
+#define JNLUA_OP_GETFIELD 10
+#define JNLUA_OP_SETFIELD 11
+#define JNLUA_OP_GETTABLE 12
+#define JNLUA_OP_SETTABLE 13
+#define JNLUA_OP_RAWGETI 14
+#define JNLUA_OP_RAWSETI 15
+#define JNLUA_OP_GETGLOBAL 16
+#define JNLUA_OP_SETGLOBAL 17
+#define JNLUA_OP_CALL 18
+#define JNLUA_OP_REF 19
 #define JNLUA_PCALL(L, nargs, nresults) {\
 	int status = lua_pcall(L, (nargs), (nresults), 0);\
 	if (status != LUA_OK) {\
@@ -39,8 +71,54 @@ typedef struct StreamStruct  {
 	jbyteArray byte_array;
 	jbyte* bytes;
 	jboolean is_copy;
+	jint chunk; /* length of a single chunk to read, -1 once read, 0 for none */
 } Stream;
 
+/* Structure for the cached Java array used for loading. */
+typedef struct LoadBufferStruct {
+	jbyteArray byte_array; /* global reference */
+	jsize capacity;
+	jsize limit;
+	int busy;
+} LoadBuffer;
+
+/* Structure for running a batch of operations, see lua_execbatch(). */
+typedef struct BatchStruct {
+	unsigned char *ops;
+	size_t length;
+	size_t position;
+} Batch;
+
+/* Structure for resuming a pinned coroutine, see lua_newresumehandle(). */
+typedef struct ResumeHandleStruct {
+	lua_State *T;
+	jobject buffer; /* global reference to the direct buffer */
+	unsigned char *values;
+	size_t capacity;
+	int ref; /* registry reference pinning the handle and the coroutine */
+} ResumeHandle;
+
+/* Structure for a pool of prepared Lua states, see lua_newstatepool(). */
+typedef struct StatePoolStruct {
+	lua_State **states;
+	int count;
+	int capacity;
+	jint libs; /* libraries opened in the states, by lua_openlib() number */
+} StatePool;
+
+/* Structure for a stack trace captured by the message handler. */
+typedef struct StackTraceStruct {
+	int id;
+	int count;
+	int codes[JNLUA_MAXTRACEFRAMES]; /* current instruction and tail call flag per frame */
+} StackTrace;
+
+/* Structure for the last JNLUA_MAXTRACES captured stack traces. */
+typedef struct StackTraceRingStruct {
+	int id; /* id of the last captured stack trace */
+	StackTrace traces[JNLUA_MAXTRACES];
+} StackTraceRing;
+
 /* ---- JNI helpers ---- */
 static jclass referenceclass(JNIEnv *env, const char *className);
 static jbyteArray newbytearray(JNIEnv *env, jsize length);
@@ -81,12 +159,69 @@ static jstring tostring(lua_State *L, int index);
 static int gcjavaobject(lua_State *L);
 static int calljavafunction(lua_State *L);
 
+/* ---- String ids ---- */
+static int pushstringid(lua_State *L, jint id);
+
+/* ---- String transfer ---- */
+static const char *tobytes(lua_State *L, int index, size_t *length);
+static void pushbyteregion(JNIEnv *env, jobject obj, lua_State *L, jbyteArray ba, jsize offset, jsize length);
+static void pushconverted(JNIEnv *env, jobject obj, lua_State *L, jstring s, int utf8);
+static jstring newconverted(JNIEnv *env, const char *s, size_t length, int utf8);
+static size_t encodelatin1(const jchar *chars, jsize count, char *buffer);
+static size_t encodeutf8(const jchar *chars, jsize count, char *buffer);
+static jsize decodelatin1(const char *s, size_t length, jchar *buffer);
+static jsize decodeutf8(const char *s, size_t length, jchar *buffer);
+
+/* ---- Batches ---- */
+static void runbatchop(lua_State *L, Batch *batch);
+static void readbatch(lua_State *L, Batch *batch, void *value, size_t size);
+static int readbatchint(lua_State *L, Batch *batch);
+static int readbatchindex(lua_State *L, Batch *batch);
+static int readbatchtable(lua_State *L, Batch *batch);
+static const char *readbatchstring(lua_State *L, Batch *batch, size_t *length);
+static void checkbatchnelems(lua_State *L, Batch *batch, int n);
+static int writebatchresults(lua_State *L, int index, unsigned char *buffer, size_t capacity);
+static int readbatchvalues(lua_State *L, const unsigned char *buffer, size_t length);
+
+/* ---- Resume handles ---- */
+static int pushresumeargs(JNIEnv *env, jobject obj, lua_State *L, ResumeHandle *rh, size_t length);
+static int gcresumehandle(lua_State *L);
+
+/* ---- State pools ---- */
+static lua_State *preparestate(jint libs);
+static void buildperms(lua_State *L);
+static void addperm(lua_State *L, int perms, int unperms);
+static void snapshotstate(lua_State *L);
+static void snapshotvalue(lua_State *L, int tables, int index);
+static void pushtypesample(lua_State *L, int type);
+static int resetstate_protected(lua_State *L);
+static void restorebaseline(lua_State *L, int baseline);
+static int samecontents(lua_State *L, int t, int copy, lua_Integer count);
+static void restoretable(lua_State *L, int tables, int t, int copy);
+static int clonesource_protected(lua_State *L);
+static int clonestate_protected(lua_State *L);
+
+/* ---- Fast paths ---- */
+static int israwtable(lua_State *L, int index);
+static int hasrawkey(lua_State *L, int index, int keyindex);
+static int hasheadroom(JNIEnv *env, jobject obj, lua_State *L, size_t size);
+
 /* ---- Error handling ---- */
 static int messagehandler(lua_State *L);
 static int isrelevant(lua_Debug *ar);
+static StackTraceRing *pushstacktraces(lua_State *L, int create);
+static int capturestacktrace(lua_State *L);
+static StackTrace *pushstacktrace(lua_State *L, jint id);
+static int getstacktraceinfo(lua_State *L, int index, const StackTrace *trace, int level, lua_Debug *ar);
+static jobjectArray tostacktrace(JNIEnv *env, lua_State *L, int index, const StackTrace *trace);
 static void throw(lua_State *L, int status);
 
 /* ---- Stream adapters ---- */
+static void load(JNIEnv *env, lua_State *L, jobject inputStream, jint length, jstring chunkname, jstring mode);
+static LoadBuffer *getloadbuffer(lua_State *L);
+static jbyteArray acquireloadbuffer(JNIEnv *env, LoadBuffer *lb, jsize size);
+static void releaseloadbuffer(JNIEnv *env, LoadBuffer *lb, jbyteArray array);
+static int gcloadbuffer(lua_State *L);
 static const char *readhandler(lua_State *L, void *ud, size_t *size);
 static int writehandler(lua_State *L, const void *data, size_t size, void *ud);
 
@@ -118,6 +253,7 @@ static jmethodID luastacktraceelement_id = 0;
 static jclass luaerror_class = NULL;
 static jmethodID luaerror_id = 0;
 static jmethodID setluastacktrace_id = 0;
+static jmethodID setluastacktraceid_id = 0;
 static jclass nullpointerexception_class = NULL;
 static jclass illegalargumentexception_class = NULL;
 static jclass illegalstateexception_class = NULL;
@@ -128,10 +264,15 @@ static jclass double_class = NULL;
 static jmethodID valueof_double_id = 0;
 static jclass inputstream_class = NULL;
 static jmethodID read_id = 0;
+static jmethodID readrange_id = 0;
 static jclass outputstream_class = NULL;
 static jmethodID write_id = 0;
 static jclass ioexception_class = NULL;
 static int initialized = 0;
+static char stringids_key; /* registry key of the string id table, by address */
+static char stacktraces_key; /* registry key of the stack trace ring, by address */
+static char loadbuffer_key; /* registry key of the load buffer, by address */
+static char baseline_key; /* registry key of the baseline of a pooled state, by address */
 static JavaVM *java_vm = NULL;
 
 /* ---- Fields ---- */
@@ -341,6 +482,197 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1close (JNIEnv
 	}
 }
 
+/*
+ * State pools keep Lua states prepared ahead of time, with the libraries
+ * opened and the Eris perms tables built, so that creating a state takes one
+ * from the pool. Released states are reset to how they were prepared and go
+ * back into the pool. Pools are not synchronized, the Java side has to
+ * serialize access to each pool.
+ */
+
+/* lua_newstatepool() */
+JNIEXPORT jlong JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1newstatepool (JNIEnv *env, jobject obj, jint capacity, jint libs) {
+	StatePool *newstatepool_result = NULL;
+	(void) env;
+	(void) obj;
+	if (checkarg(capacity >= 0, "illegal capacity")
+			&& checkarg((libs & ~((1 << JNLUA_LIBS) - 1)) == 0, "illegal library")
+			&& check((newstatepool_result = (StatePool *) malloc(sizeof(StatePool))) != NULL, luamemoryallocationexception_class, "JNI error: malloc() failed creating state pool")) {
+		newstatepool_result->states = (lua_State **) malloc(capacity > 0 ? capacity * sizeof(lua_State *) : 1);
+		if (!check(newstatepool_result->states != NULL, luamemoryallocationexception_class, "JNI error: malloc() failed creating state pool")) {
+			free(newstatepool_result);
+			return 0;
+		}
+		newstatepool_result->count = 0;
+		newstatepool_result->capacity = capacity;
+		newstatepool_result->libs = libs;
+	}
+	return (jlong) (uintptr_t) newstatepool_result;
+}
+
+/* lua_fillstatepool() */
+JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1fillstatepool (JNIEnv *env, jobject obj, jlong pool, jint count) {
+	StatePool *sp = (StatePool *) (uintptr_t) pool;
+	lua_State *L;
+	jint fillstatepool_result = 0;
+	(void) env;
+	(void) obj;
+	if (checknotnull(sp)
+			&& checkarg(count >= 0, "illegal count")) {
+		while (sp->count < count && sp->count < sp->capacity) {
+			L = preparestate(sp->libs);
+			if (!check(L != NULL, luamemoryallocationexception_class, "error preparing Lua state")) {
+				break;
+			}
+			sp->states[sp->count++] = L;
+		}
+		fillstatepool_result = (jint) sp->count;
+	}
+	return fillstatepool_result;
+}
+
+/* lua_freestatepool() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1freestatepool (JNIEnv *env, jobject obj, jlong pool) {
+	StatePool *sp = (StatePool *) (uintptr_t) pool;
+	(void) env;
+	(void) obj;
+	if (checknotnull(sp)) {
+		while (sp->count > 0) {
+			lua_close(sp->states[--sp->count]);
+		}
+		free(sp->states);
+		free(sp);
+	}
+}
+
+/*
+ * lua_newpooledstate() is lua_newstate() with a state taken from a pool. If
+ * the pool is empty, a new state is prepared the same way.
+ */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1newpooledstate (JNIEnv *env, jobject obj, jint apiversion, jlong pool) {
+	StatePool *sp = (StatePool *) (uintptr_t) pool;
+	lua_State *L;
+	jint total = 0, used = 0;
+	
+	/* Initialized? */
+	if (!initialized) {
+		return;
+	}
+	
+	/* API version? */
+	if (apiversion != JNLUA_APIVERSION) {
+		return;
+	}
+	
+	/* Take or prepare Lua state. */
+	if (!checknotnull(sp)) {
+		return;
+	}
+	L = sp->count > 0 ? sp->states[--sp->count] : preparestate(sp->libs);
+	if (!check(L != NULL, luamemoryallocationexception_class, "error preparing Lua state")) {
+		return;
+	}
+	
+	/* Setup Lua state. */
+	lua_pushcfunction(L, newstate_protected);
+	lua_pushlightuserdata(L, (void*)obj);
+	JNLUA_PCALL(L, 1, 1);
+	if ((*env)->ExceptionCheck(env)) {
+		lua_close(L);
+		return;
+	}
+	
+	/* Control the memory use, counting what the state already uses. */
+	getluamemory(env, obj, &total, &used);
+	if (total > 0) {
+		setluamemory(env, obj, (jint) (lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0)));
+		lua_setallocf(L, l_alloc_checked, L);
+	}
+	
+	/* Set the Lua state in the Java state. */
+	setluathread(env, obj, L);
+	setluastate(env, obj, L);
+}
+
+/*
+ * lua_releasestate() is lua_close() for a state taken from a pool. The state is
+ * reset and put back into the pool, or closed if the pool is full or the reset
+ * fails.
+ */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1releasestate (JNIEnv *env, jobject obj, jlong pool) {
+	StatePool *sp = (StatePool *) (uintptr_t) pool;
+	lua_State *L = getluastate(env, obj), *T;
+	lua_Debug ar;
+	int status = LUA_ERRRUN;
+	
+	/* Can release? */
+	T = getluathread(env, obj);
+	if (!checknotnull(sp) || L != T || lua_getstack(L, 0, &ar)) {
+		return;
+	}
+	
+	/* Unset the Lua state in the Java state. */
+	setluastate(env, obj, NULL);
+	setluathread(env, obj, NULL);
+	lua_setallocf(L, l_alloc_unchecked, NULL);
+	setluamemory(env, obj, 0);
+	
+	/* Reset and pool Lua state. */
+	lua_settop(L, 0);
+	if (sp->count < sp->capacity) {
+		lua_pushcfunction(L, resetstate_protected);
+		status = lua_pcall(L, 0, 0, 0);
+	}
+	if (status == LUA_OK) {
+		sp->states[sp->count++] = L;
+	} else {
+		lua_close(L);
+	}
+}
+
+/*
+ * lua_clonestate() copies a booted template state into this state, which
+ * saves booting every state the same way. What a script can reach is copied:
+ * the contents and metatables of the library tables, the loaded table and the
+ * globals, everything reachable from them, and the metatables of the basic
+ * types. Library functions and tables stay the ones of this state, so both
+ * states must have opened the same libraries, and the template needs the perms
+ * tables of a pooled state, built before it was booted. Java objects cannot be
+ * copied unless they are in the perms tables of both states. If index is not
+ * 0, the value at that index of the template is copied and pushed as well.
+ */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1clonestate (JNIEnv *env, jobject obj, jobject templatestate, jint index) {
+	lua_State *L = getluathread(env, obj), *F;
+	lua_Debug ar;
+	
+	if (!checknotnull(templatestate)) {
+		return;
+	}
+	F = getluastate(env, templatestate);
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checkstate(F != NULL, "template closed")
+			&& checkstate(F != getluastate(env, obj), "same state")
+			&& checkstate(F == getluathread(env, templatestate) && !lua_getstack(F, 0, &ar), "template busy")
+			&& checkstack(F, JNLUA_MINSTACK)
+			&& (index == 0 || checkindex(F, index))) {
+		if (index == 0) {
+			lua_pushnil(F);
+		} else {
+			lua_pushvalue(F, index);
+		}
+		lua_pushcfunction(F, clonesource_protected);
+		lua_insert(F, -2);
+		JNLUA_PCALL(F, 1, 2);
+		if ((*env)->ExceptionCheck(env)) {
+			return;
+		}
+		lua_pushcfunction(L, clonestate_protected);
+		lua_pushlightuserdata(L, F);
+		JNLUA_PCALL(L, 1, index != 0 ? 1 : 0);
+		lua_pop(F, 2);
+	}
+}
+
 /* lua_gc() */
 static int gc_protected (lua_State *L) {
 	lua_pushinteger(L, lua_gc(L, lua_tointeger(L, 1), lua_tointeger(L, 2)));
@@ -360,6 +692,25 @@ JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1gc (JNIEnv *e
 	return result;
 }
 
+/* lua_strtab() */
+static int strtab_protected (lua_State *L) {
+	lua_pushinteger(L, lua_strtab(L, lua_tointeger(L, 1), lua_tointeger(L, 2)));
+	return 1;
+}
+JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1strtab (JNIEnv *env, jobject obj, jint what, jint data) {
+	lua_State *L = getluathread(env, obj);
+	jint result = 0;
+	if(checkstack(L, JNLUA_MINSTACK)) {
+		lua_pushcfunction(L, strtab_protected);
+		lua_pushinteger(L, what);
+		lua_pushinteger(L, data);
+		JNLUA_PCALL(L, 2, 1);
+		result = (jint)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	return result;
+}
+
 /* ---- Registration ---- */
 /* lua_openlib() */
 static int openlib_protected (lua_State *L) {
@@ -411,6 +762,14 @@ static int openlib_protected (lua_State *L) {
 		libname = LUA_ERISLIBNAME;
 		openfunc = luaopen_eris;
 		break;
+	case 11:
+		libname = LUA_STRBUFLIBNAME;
+		openfunc = luaopen_strbuf;
+		break;
+	case 12:
+		libname = LUA_BYTESLIBNAME;
+		openfunc = luaopen_bytes;
+		break;
 	default:
 		return 0;
 	}
@@ -420,7 +779,7 @@ static int openlib_protected (lua_State *L) {
 JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1openlib (JNIEnv *env, jobject obj, jint lib) {
 	lua_State *L = getluathread(env, obj);
 	if (checkstack(L, JNLUA_MINSTACK)
-			&& checkarg(lib >= 0 && lib <= 10, "illegal library")) {
+			&& checkarg(lib >= 0 && lib < JNLUA_LIBS, "illegal library")) {
 		lua_pushcfunction(L, openlib_protected);
 		lua_pushinteger(L, lib);
 		JNLUA_PCALL(L, 1, 1);
@@ -431,36 +790,70 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1openlib (JNIE
 /* lua_load() */
 JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1load (JNIEnv *env, jobject obj, jobject inputStream, jstring chunkname, jstring mode) {
 	lua_State *L = getluathread(env, obj);
-	const char *chunkname_utf = NULL, *mode_utf = NULL;
-	Stream stream = { inputStream, NULL, NULL, 0 };
+	if (checkstack(L, JNLUA_MINSTACK)) {
+		load(env, L, inputStream, 0, chunkname, mode);
+	}
+}
+
+/* lua_loadfully() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1loadfully (JNIEnv *env, jobject obj, jobject inputStream, jint length, jstring chunkname, jstring mode) {
+	lua_State *L = getluathread(env, obj);
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checkarg(length >= 0, "illegal length")) {
+		load(env, L, inputStream, length > 0 ? length : -1, chunkname, mode);
+	}
+}
+
+/* lua_setloadbuffer() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1setloadbuffer (JNIEnv *env, jobject obj, jint size) {
+	lua_State *L = getluathread(env, obj);
+	LoadBuffer *lb;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checkarg(size >= 0, "illegal size")
+			&& (lb = getloadbuffer(L))) {
+		lb->limit = size;
+		if (!lb->busy && lb->capacity > lb->limit) {
+			(*env)->DeleteGlobalRef(env, lb->byte_array);
+			lb->byte_array = NULL;
+			lb->capacity = 0;
+		}
+	}
+}
+
+/* lua_loadcached() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1loadcached (JNIEnv *env, jobject obj, jbyteArray source, jstring chunkname, jstring cachedir, jlong limit) {
+	lua_State *L = getluathread(env, obj);
+	const char *loadcached_chunkname = NULL, *loadcached_cachedir = NULL;
+	jbyte *loadcached_source = NULL;
 	int status;
+
 	if (checkstack(L, JNLUA_MINSTACK)
-			&& (chunkname_utf = getstringchars(env, chunkname))
-			&& (mode_utf = getstringchars(env, mode)) 
-			&& (stream.byte_array = newbytearray(env, 1024))) {
-		status = lua_load(L, readhandler, &stream, chunkname_utf, mode_utf);
+			&& checknotnull(source)
+			&& checkarg(limit >= 0, "illegal limit")
+			&& (loadcached_chunkname = getstringchars(env, chunkname))
+			&& (loadcached_cachedir = getstringchars(env, cachedir))
+			&& (loadcached_source = (*env)->GetByteArrayElements(env, source, NULL),
+				check(loadcached_source != NULL, luamemoryallocationexception_class, "JNI error: GetByteArrayElements() failed"))) {
+		status = eris_loadcached(L, (const char *) loadcached_source, (size_t) (*env)->GetArrayLength(env, source), loadcached_chunkname, loadcached_cachedir, (size_t) limit);
 		if (status != LUA_OK) {
 			throw(L, status);
 		}
 	}
-	if (stream.bytes) {
-		(*env)->ReleaseByteArrayElements(env, stream.byte_array, stream.bytes, JNI_ABORT);
-	}
-	if (stream.byte_array) {
-		(*env)->DeleteLocalRef(env, stream.byte_array);
+	if (loadcached_source) {
+		(*env)->ReleaseByteArrayElements(env, source, loadcached_source, JNI_ABORT);
 	}
-	if (chunkname_utf) {
-		releasestringchars(env, chunkname, chunkname_utf);
+	if (loadcached_chunkname) {
+		releasestringchars(env, chunkname, loadcached_chunkname);
 	}
-	if (mode_utf) {
-		releasestringchars(env, mode, mode_utf);
+	if (loadcached_cachedir) {
+		releasestringchars(env, cachedir, loadcached_cachedir);
 	}
 }
 
 /* lua_dump() */
 JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1dump (JNIEnv *env, jobject obj, jobject outputStream) {
 	lua_State *L = getluathread(env, obj);
-	Stream stream = { outputStream, NULL, NULL, 0 };
+	Stream stream = { outputStream, NULL, NULL, 0, 0 };
 	if (checkstack(L, JNLUA_MINSTACK)
 			&& checknelems(L, 1)
 			&& (stream.byte_array = newbytearray(env, 1024))) {
@@ -474,6 +867,30 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1dump (JNIEnv
 	}
 }
 
+/* lua_undumpfile() */
+static int undumpfile_protected (lua_State *L) {
+	const char *filename = (const char*)lua_touserdata(L, 1);
+	lua_remove(L, 1);
+	eris_undumpfile(L, filename);
+	return 1;
+}
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1undumpfile (JNIEnv *env, jobject obj, jint index, jstring filename) {
+	lua_State *L = getluathread(env, obj);
+	const char *undumpfile_filename = NULL;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checktype(L, index, LUA_TTABLE)
+			&& (undumpfile_filename = getstringchars(env, filename))) {
+		index = lua_absindex(L, index);
+		lua_pushcfunction(L, undumpfile_protected);
+		lua_pushlightuserdata(L, (void*)undumpfile_filename);
+		lua_pushvalue(L, index);
+		JNLUA_PCALL(L, 2, 1);
+	}
+	if (undumpfile_filename) {
+		releasestringchars(env, filename, undumpfile_filename);
+	}
+}
+
 /* ---- Call ---- */
 /* lua_pcall() */
 JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pcall (JNIEnv *env, jobject obj, jint nargs, jint nresults) {
@@ -494,6 +911,51 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pcall (JNIEnv
 	}
 }
 
+/* lua_execbatch() */
+static int execbatch_protected (lua_State *L) {
+	Batch *batch = (Batch*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	while (batch->position < batch->length) {
+		runbatchop(L, batch);
+	}
+	return lua_gettop(L);
+}
+JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1execbatch (JNIEnv *env, jobject obj, jobject ops, jint length, jint nargs) {
+	lua_State *L = getluathread(env, obj);
+	Batch execbatch_batch;
+	jlong execbatch_capacity = 0;
+	int index, status, nresults, execbatch_count = 0;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checknotnull(ops)
+			&& checkarg((execbatch_batch.ops = (*env)->GetDirectBufferAddress(env, ops)) != NULL, "illegal buffer")
+			&& checkarg(length >= 0 && length <= (execbatch_capacity = (*env)->GetDirectBufferCapacity(env, ops)), "illegal length")
+			&& checkarg(nargs >= 0, "illegal argument count")
+			&& checknelems(L, nargs)) {
+		execbatch_batch.length = (size_t) length;
+		execbatch_batch.position = 0;
+		index = lua_gettop(L) - nargs + 1;
+		lua_pushcfunction(L, execbatch_protected);
+		lua_insert(L, index);
+		lua_pushcfunction(L, messagehandler);
+		lua_insert(L, index);
+		lua_pushlightuserdata(L, (void*)&execbatch_batch);
+		status = lua_pcall(L, nargs + 1, LUA_MULTRET, index);
+		lua_remove(L, index);
+		if (status != LUA_OK) {
+			throw(L, status);
+		} else {
+			/* The operations have all been read, so the buffer takes the results */
+			nresults = lua_gettop(L) - index + 1;
+			execbatch_count = writebatchresults(L, index, execbatch_batch.ops, (size_t) execbatch_capacity);
+			lua_settop(L, index - 1);
+			if (!checkstate(execbatch_count == nresults, "results exceed buffer")) {
+				execbatch_count = 0;
+			}
+		}
+	}
+	return execbatch_count;
+}
+
 /* ---- Global ---- */
 /* lua_getglobal() */
 static int getglobal_protected (lua_State *L) {
@@ -546,24 +1008,21 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pushboolean (
 }
 
 /* lua_pushbytearray() */
-static int pushbytearray_protected (lua_State *L) {
-	lua_pushlstring(L, (jbyte*)lua_touserdata(L, 1), (jsize)lua_tointeger(L, 2));
-	return 1;
-}
 JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pushbytearray (JNIEnv *env, jobject obj, jbyteArray ba) {
 	lua_State *L = getluathread(env, obj);
-	jbyte *pushbytearray_b = NULL;
-	jsize pushbytearray_length;
 	if (checkstack(L, JNLUA_MINSTACK)
-			&& (pushbytearray_b = (*env)->GetByteArrayElements(env, ba, NULL))) {
-		pushbytearray_length = (*env)->GetArrayLength(env, ba);
-		lua_pushcfunction(L, pushbytearray_protected);
-		lua_pushlightuserdata(L, (void*)pushbytearray_b);
-		lua_pushinteger(L, pushbytearray_length);
-		JNLUA_PCALL(L, 2, 1);
+			&& checknotnull(ba)) {
+		pushbyteregion(env, obj, L, ba, 0, (*env)->GetArrayLength(env, ba));
 	}
-	if (pushbytearray_b) {
-		(*env)->ReleaseByteArrayElements(env, ba, pushbytearray_b, JNI_ABORT);
+}
+
+/* lua_pushbyteregion() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pushbyteregion (JNIEnv *env, jobject obj, jbyteArray ba, jint offset, jint length) {
+	lua_State *L = getluathread(env, obj);
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checknotnull(ba)
+			&& checkarg(offset >= 0 && length >= 0 && offset <= (*env)->GetArrayLength(env, ba) - length, "illegal region")) {
+		pushbyteregion(env, obj, L, ba, offset, length);
 	}
 }
 
@@ -606,6 +1065,15 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pushjavaobjec
 	}
 }
 
+/* lua_pushlatin1() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pushlatin1 (JNIEnv *env, jobject obj, jstring s) {
+	lua_State *L = getluathread(env, obj);
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checknotnull(s)) {
+		pushconverted(env, obj, L, s, 0);
+	}
+}
+
 /* lua_pushnil() */
 JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pushnil (JNIEnv *env, jobject obj) {
 	lua_State *L = getluathread(env, obj);
@@ -633,16 +1101,29 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pushstring (J
 	if (checkstack(L, JNLUA_MINSTACK)
 			&& (pushstring_s = getstringchars(env, s))) {
 		jsize pushstring_length = (*env)->GetStringUTFLength(env, s);
-		lua_pushcfunction(L, pushstring_protected);
-		lua_pushlightuserdata(L, (void*)pushstring_s);
-		lua_pushinteger(L, pushstring_length);
-		JNLUA_PCALL(L, 2, 1);
+		if (hasheadroom(env, obj, L, pushstring_length)) {
+			lua_pushlstring(L, pushstring_s, pushstring_length);
+		} else {
+			lua_pushcfunction(L, pushstring_protected);
+			lua_pushlightuserdata(L, (void*)pushstring_s);
+			lua_pushinteger(L, pushstring_length);
+			JNLUA_PCALL(L, 2, 1);
+		}
 	}
 	if (pushstring_s) {
 		releasestringchars(env, s, pushstring_s);
 	}
 }
 
+/* lua_pushutf8() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pushutf8 (JNIEnv *env, jobject obj, jstring s) {
+	lua_State *L = getluathread(env, obj);
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checknotnull(s)) {
+		pushconverted(env, obj, L, s, 1);
+	}
+}
+
 /* ---- Stack type test ---- */
 /* lua_isboolean() */
 JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1isboolean (JNIEnv *env, jobject obj, jint index) {
@@ -819,43 +1300,90 @@ JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1toboolean (JN
 }
 
 /* lua_tobytearray() */
-static int tobytearray_protected (lua_State *L) {
-	size_t tobytearray_length;
-	const char *tobytearray_result = lua_tolstring(L, 1, &tobytearray_length);
-	lua_pushlightuserdata(L, (void*)tobytearray_result);
-	lua_pushinteger(L, tobytearray_length);
-	return 2;
-}
 JNIEXPORT jbyteArray JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1tobytearray (JNIEnv *env, jobject obj, jint index) {
 	lua_State *L = getluathread(env, obj);
-	jbyteArray ba;
-	jbyte *b;
+	const char *tobytearray_result;
 	size_t tobytearray_length;
-	const char *tobytearray_result = NULL;
+	jbyteArray tobytearray_ba = NULL;
 	if (checkstack(L, JNLUA_MINSTACK)
 			&& checkindex(L, index)) {
-		index = lua_absindex(L, index);
-		lua_pushcfunction(L, tobytearray_protected);
-		lua_pushvalue(L, index);
-		JNLUA_PCALL(L, 1, 2);
-		tobytearray_result = (const char*)lua_touserdata(L, -2);
-		tobytearray_length = (lua_Unsigned)lua_tointeger(L, -1);
-		lua_pop(L, 2);
+		tobytearray_result = tobytes(L, index, &tobytearray_length);
+		if (tobytearray_result
+				&& check(tobytearray_length <= INT_MAX, illegalargumentexception_class, "string too long")
+				&& (tobytearray_ba = newbytearray(env, (jsize) tobytearray_length))) {
+			(*env)->SetByteArrayRegion(env, tobytearray_ba, 0, (jsize) tobytearray_length, (const jbyte*)tobytearray_result);
+		}
+		lua_pop(L, 1);
 	}
-	if (!tobytearray_result) {
-		return NULL;
+	return tobytearray_ba;
+}
+
+/* lua_tobytebuffer() */
+JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1tobytebuffer (JNIEnv *env, jobject obj, jint index, jobject buffer) {
+	lua_State *L = getluathread(env, obj);
+	char *tobytebuffer_address = NULL;
+	jlong tobytebuffer_capacity = 0;
+	size_t tobytebuffer_length;
+	const char *tobytebuffer_result;
+	jint tobytebuffer_count = -1;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checkindex(L, index)
+			&& checknotnull(buffer)
+			&& checkarg((tobytebuffer_address = (*env)->GetDirectBufferAddress(env, buffer)) != NULL, "illegal buffer")) {
+		tobytebuffer_capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+		tobytebuffer_result = tobytes(L, index, &tobytebuffer_length);
+		if (tobytebuffer_result) {
+			/* Only copy if everything fits, the caller retries with a larger buffer */
+			if (tobytebuffer_length <= (size_t) tobytebuffer_capacity) {
+				memcpy(tobytebuffer_address, tobytebuffer_result, tobytebuffer_length);
+			}
+			tobytebuffer_count = tobytebuffer_length <= INT_MAX ? (jint) tobytebuffer_length : INT_MAX;
+		}
+		lua_pop(L, 1);
 	}
-	ba = (*env)->NewByteArray(env, (jsize) tobytearray_length);
-	if (!ba) {
-		return NULL;
+	return tobytebuffer_count;
+}
+
+/*
+ * lua_todirectbuffer() maps a byte array of the bytes library to a direct
+ * ByteBuffer without copying it. Returns null for other values. The buffer
+ * refers to the memory of the byte array and must not be used after the
+ * array has been collected, so the caller has to keep it referenced.
+ */
+JNIEXPORT jobject JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1todirectbuffer (JNIEnv *env, jobject obj, jint index) {
+	lua_State *L = getluathread(env, obj);
+	unsigned char *todirectbuffer_address;
+	size_t todirectbuffer_length;
+	jobject todirectbuffer_buffer = NULL;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checkindex(L, index)
+			&& (todirectbuffer_address = luaL_testbytes(L, index, &todirectbuffer_length)) != NULL) {
+		todirectbuffer_buffer = (*env)->NewDirectByteBuffer(env, todirectbuffer_address, (jlong) todirectbuffer_length);
 	}
-	b = (*env)->GetByteArrayElements(env, ba, NULL);
-	if (!b) {
-		return NULL;
+	return todirectbuffer_buffer;
+}
+
+/* lua_tobyteregion() */
+JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1tobyteregion (JNIEnv *env, jobject obj, jint index, jbyteArray ba, jint offset, jint length) {
+	lua_State *L = getluathread(env, obj);
+	size_t tobyteregion_length;
+	const char *tobyteregion_result;
+	jint tobyteregion_count = -1;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checkindex(L, index)
+			&& checknotnull(ba)
+			&& checkarg(offset >= 0 && length >= 0 && offset <= (*env)->GetArrayLength(env, ba) - length, "illegal region")) {
+		tobyteregion_result = tobytes(L, index, &tobyteregion_length);
+		if (tobyteregion_result) {
+			/* Only copy if everything fits, the caller retries with a larger region */
+			if (tobyteregion_length <= (size_t) length) {
+				(*env)->SetByteArrayRegion(env, ba, offset, (jsize) tobyteregion_length, (const jbyte*)tobyteregion_result);
+			}
+			tobyteregion_count = tobyteregion_length <= INT_MAX ? (jint) tobyteregion_length : INT_MAX;
+		}
+		lua_pop(L, 1);
 	}
-	memcpy(b, tobytearray_result, tobytearray_length);
-	(*env)->ReleaseByteArrayElements(env, ba, b, 0);
-	return ba;
+	return tobyteregion_count;
 }
 
 /* lua_tointeger() */
@@ -924,6 +1452,23 @@ JNIEXPORT jobject JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1tojavaobje
 	return tojavaobject_result;
 }
 
+/* lua_tolatin1() */
+JNIEXPORT jstring JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1tolatin1 (JNIEnv *env, jobject obj, jint index) {
+	lua_State *L = getluathread(env, obj);
+	const char *tolatin1_result;
+	size_t tolatin1_length;
+	jstring tolatin1_string = NULL;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checkindex(L, index)) {
+		tolatin1_result = tobytes(L, index, &tolatin1_length);
+		if (tolatin1_result) {
+			tolatin1_string = newconverted(env, tolatin1_result, tolatin1_length, 0);
+		}
+		lua_pop(L, 1);
+	}
+	return tolatin1_string;
+}
+
 /* lua_tonumber() */
 JNIEXPORT jdouble JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1tonumber (JNIEnv *env, jobject obj, jint index) {
 	lua_State *L = getluathread(env, obj);
@@ -966,15 +1511,37 @@ JNIEXPORT jstring JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1tostring (
 	if (checkstack(L, JNLUA_MINSTACK)
 			&& checkindex(L, index)) {
 		index = lua_absindex(L, index);
-		lua_pushcfunction(L, tostring_protected);
-		lua_pushvalue(L, index);
-		JNLUA_PCALL(L, 1, 1);
-		tostring_result = (const char*)lua_touserdata(L, -1);
-		lua_pop(L, 1);
+		if (lua_type(L, index) == LUA_TSTRING) {
+			/* No conversion, so nothing to allocate. */
+			tostring_result = lua_tostring(L, index);
+		} else {
+			lua_pushcfunction(L, tostring_protected);
+			lua_pushvalue(L, index);
+			JNLUA_PCALL(L, 1, 1);
+			tostring_result = (const char*)lua_touserdata(L, -1);
+			lua_pop(L, 1);
+		}
 	}
 	return tostring_result ? (*env)->NewStringUTF(env, tostring_result) : NULL;
 }
 
+/* lua_toutf8() */
+JNIEXPORT jstring JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1toutf8 (JNIEnv *env, jobject obj, jint index) {
+	lua_State *L = getluathread(env, obj);
+	const char *toutf8_result;
+	size_t toutf8_length;
+	jstring toutf8_string = NULL;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checkindex(L, index)) {
+		toutf8_result = tobytes(L, index, &toutf8_length);
+		if (toutf8_result) {
+			toutf8_string = newconverted(env, toutf8_result, toutf8_length, 1);
+		}
+		lua_pop(L, 1);
+	}
+	return toutf8_string;
+}
+
 /* lua_type() */
 JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1type (JNIEnv *env, jobject obj, jint index) {
 	lua_State *L = getluathread(env, obj);
@@ -1170,10 +1737,15 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1getfield (JNI
 			&& checktype(L, index, LUA_TTABLE)
 			&& (getfield_k = getstringchars(env, k))) {
 		index = lua_absindex(L, index);
-		lua_pushcfunction(L, getfield_protected);
-		lua_pushlightuserdata(L, (void*)getfield_k);
-		lua_pushvalue(L, index);
-		JNLUA_PCALL(L, 2, 1);
+		if (israwtable(L, index)
+				&& hasheadroom(env, obj, L, strlen(getfield_k))) {
+			lua_getfield(L, index, getfield_k);
+		} else {
+			lua_pushcfunction(L, getfield_protected);
+			lua_pushlightuserdata(L, (void*)getfield_k);
+			lua_pushvalue(L, index);
+			JNLUA_PCALL(L, 2, 1);
+		}
 	}
 	if (getfield_k) {
 		releasestringchars(env, k, getfield_k);
@@ -1190,6 +1762,10 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1gettable (JNI
 	if (checkstack(L, JNLUA_MINSTACK)
 			&& checktype(L, index, LUA_TTABLE)) {
 		index = lua_absindex(L, index);
+		if (israwtable(L, index)) {
+			lua_rawget(L, index);
+			return;
+		}
 		lua_pushcfunction(L, gettable_protected);
 		lua_insert(L, -2);
 		lua_pushvalue(L, index);
@@ -1206,6 +1782,10 @@ static int newtable_protected (lua_State *L) {
 JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1newtable (JNIEnv *env, jobject obj) {
 	lua_State *L = getluathread(env, obj);
 	if (checkstack(L, JNLUA_MINSTACK)) {
+		if (hasheadroom(env, obj, L, 0)) {
+			lua_newtable(L);
+			return;
+		}
 		lua_pushcfunction(L, newtable_protected);
 		JNLUA_PCALL(L, 0, 1);
 	}
@@ -1301,6 +1881,10 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1settable (JNI
 			&& checktype(L, index, LUA_TTABLE)
 			&& checknelems(L, 2)) {
 		index = lua_absindex(L, index);
+		if (israwtable(L, index) && hasrawkey(L, index, -2)) {
+			lua_rawset(L, index);
+			return;
+		}
 		lua_pushcfunction(L, settable_protected);
 		lua_insert(L, -3);
 		lua_pushvalue(L, index);
@@ -1321,6 +1905,17 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1setfield (JNI
 			&& checktype(L, index, LUA_TTABLE)
 			&& (setfield_k = getstringchars(env, k))) {
 		index = lua_absindex(L, index);
+		if (israwtable(L, index)
+				&& hasheadroom(env, obj, L, strlen(setfield_k))) {
+			lua_pushstring(L, setfield_k);
+			lua_insert(L, -2);
+			if (hasrawkey(L, index, -2)) {
+				lua_rawset(L, index);
+				releasestringchars(env, k, setfield_k);
+				return;
+			}
+			lua_remove(L, -2);
+		}
 		lua_pushcfunction(L, setfield_protected);
 		lua_insert(L, -2);
 		lua_pushlightuserdata(L, (void*)setfield_k);
@@ -1441,15 +2036,140 @@ JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1status (JNIEn
 	return (jint) result;	
 }
 
-/* ---- Reference ---- */
-/* lua_ref() */
-static int ref_protected (lua_State *L) {
-	lua_pushinteger(L, luaL_ref(L, 1));
-	return 1;
-}
-JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1ref (JNIEnv *env, jobject obj, jint index) {
+/* lua_cpuusage() */
+JNIEXPORT jlong JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1cpuusage (JNIEnv *env, jobject obj, jint index, jint what, jlong data) {
 	lua_State *L = getluathread(env, obj);
-	jint ref_result = 0;
+	lua_Integer result = 0;
+	if (checktype(L, index, LUA_TTHREAD)
+			&& checkarg(what >= LUA_CPUCOUNT && what <= LUA_CPUSETTIMING, "illegal option")) {
+		result = lua_cpuusage(lua_tothread(L, index), what, (lua_Integer) data);
+	}
+	return (jlong) result;
+}
+
+/*
+ * Resume handles pin a coroutine for resuming it over and over, such as once
+ * per tick, with less overhead than lua_resume(). The coroutine need not be
+ * on the stack and is not checked again, and the arguments and results are
+ * passed through a direct buffer in the format of lua_execbatch() results, so
+ * a resume is a single native call. While the coroutine runs, it is the
+ * current thread of the Java state, which saves Java functions it calls from
+ * switching threads. A handle must be freed before the state is closed.
+ */
+
+/* lua_newresumehandle() */
+static int newresumehandle_protected (lua_State *L) {
+	ResumeHandle *rh;
+	
+	rh = (ResumeHandle *) lua_newuserdata(L, sizeof(ResumeHandle));
+	rh->T = lua_tothread(L, 1);
+	rh->buffer = NULL;
+	rh->values = NULL;
+	rh->capacity = 0;
+	if (luaL_newmetatable(L, JNLUA_RESUMEHANDLE)) {
+		lua_pushcfunction(L, gcresumehandle);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	rh->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushlightuserdata(L, (void*)rh);
+	return 1;
+}
+JNIEXPORT jlong JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1newresumehandle (JNIEnv *env, jobject obj, jint index, jobject buffer) {
+	lua_State *L = getluathread(env, obj);
+	ResumeHandle *newresumehandle_result = NULL;
+	unsigned char *newresumehandle_values = NULL;
+	int status;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checktype(L, index, LUA_TTHREAD)
+			&& checkarg(lua_tothread(L, index) != getluastate(env, obj), "main thread")
+			&& checknotnull(buffer)
+			&& checkarg((newresumehandle_values = (*env)->GetDirectBufferAddress(env, buffer)) != NULL, "illegal buffer")) {
+		index = lua_absindex(L, index);
+		lua_pushcfunction(L, newresumehandle_protected);
+		lua_pushvalue(L, index);
+		status = lua_pcall(L, 1, 1, 0);
+		if (status != LUA_OK) {
+			throw(L, status);
+			return 0;
+		}
+		newresumehandle_result = (ResumeHandle *) lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		newresumehandle_result->buffer = (*env)->NewGlobalRef(env, buffer);
+		if (!checkstate(newresumehandle_result->buffer != NULL, "JNI error: NewGlobalRef() failed")) {
+			luaL_unref(L, LUA_REGISTRYINDEX, newresumehandle_result->ref);
+			return 0;
+		}
+		newresumehandle_result->values = newresumehandle_values;
+		newresumehandle_result->capacity = (size_t) (*env)->GetDirectBufferCapacity(env, buffer);
+	}
+	return (jlong) (uintptr_t) newresumehandle_result;
+}
+
+/*
+ * lua_resumehandle() resumes the coroutine of a handle with the arguments in
+ * the first length bytes of its buffer, and writes the results to the buffer.
+ * Returns the number of results if the coroutine has yielded, or -1 minus the
+ * number of results if it has finished. Values other than nil, booleans,
+ * numbers and strings are written as their type only.
+ */
+JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1resumehandle (JNIEnv *env, jobject obj, jlong handle, jint length) {
+	lua_State *L = getluathread(env, obj), *T;
+	ResumeHandle *rh = (ResumeHandle *) (uintptr_t) handle;
+	int nargs, nresults, count, status;
+	jint resumehandle_result = 0;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checknotnull(rh)
+			&& checkarg(length >= 0 && (size_t) length <= rh->capacity, "illegal length")
+			&& checkstate(lua_status(rh->T) == LUA_YIELD || (lua_status(rh->T) == LUA_OK && lua_gettop(rh->T) > 0), "dead coroutine")
+			&& (nargs = pushresumeargs(env, obj, L, rh, (size_t) length)) >= 0) {
+		T = rh->T;
+		setluathread(env, obj, T);
+		status = lua_resume(T, L, nargs);
+		setluathread(env, obj, L);
+		switch (status) {
+		case LUA_OK:
+		case LUA_YIELD:
+			nresults = lua_gettop(T);
+			count = writebatchresults(T, 1, rh->values, rh->capacity);
+			lua_settop(T, 0);
+			if (checkstate(count == nresults, "results exceed buffer")) {
+				resumehandle_result = status == LUA_YIELD ? count : -1 - count;
+			}
+			break;
+		default:
+			lua_xmove(T, L, 1);
+			throw(L, status);
+		}
+	}
+	return resumehandle_result;
+}
+
+/* lua_freeresumehandle() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1freeresumehandle (JNIEnv *env, jobject obj, jlong handle) {
+	lua_State *L = getluathread(env, obj);
+	ResumeHandle *rh = (ResumeHandle *) (uintptr_t) handle;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checknotnull(rh)) {
+		(*env)->DeleteGlobalRef(env, rh->buffer);
+		rh->buffer = NULL;
+		rh->values = NULL;
+		rh->capacity = 0;
+		luaL_unref(L, LUA_REGISTRYINDEX, rh->ref);
+	}
+}
+
+/* ---- Reference ---- */
+/* lua_ref() */
+static int ref_protected (lua_State *L) {
+	lua_pushinteger(L, luaL_ref(L, 1));
+	return 1;
+}
+JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1ref (JNIEnv *env, jobject obj, jint index) {
+	lua_State *L = getluathread(env, obj);
+	jint ref_result = 0;
 	if (checkstack(L, JNLUA_MINSTACK)
 			&& checktype(L, index, LUA_TTABLE)) {
 		index = lua_absindex(L, index);
@@ -1527,6 +2247,21 @@ JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1getinfo (JNIE
 	return getinfo_result;
 }
 
+/* lua_stacktrace() */
+JNIEXPORT jobjectArray JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1stacktrace (JNIEnv *env, jobject obj, jint id) {
+	lua_State *L = getluathread(env, obj);
+	StackTrace *trace;
+	jobjectArray stacktrace_result = NULL;
+	if (checkstack(L, JNLUA_MINSTACK)) {
+		/* Only raw accesses and debug information, cannot raise */
+		if ((trace = pushstacktrace(L, id))) {
+			stacktrace_result = tostacktrace(env, L, -1, trace);
+			lua_pop(L, 1);
+		}
+	}
+	return stacktrace_result;
+}
+
 /* ---- Optimization ---- */
 /* lua_tablesize() */
 static int tablesize_protected (lua_State *L) {
@@ -1588,6 +2323,104 @@ JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1tablemove (JN
 	}
 }
 
+/* lua_newstringid() */
+static int newstringid_protected (lua_State *L) {
+	jint id;
+	
+	lua_pushlstring(L, (const char*)lua_touserdata(L, 1), (size_t)lua_tointeger(L, 2));
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &stringids_key) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &stringids_key);
+	}
+	lua_pushvalue(L, -2);
+	if (lua_rawget(L, -2) == LUA_TNUMBER) {
+		return 1; /* already registered */
+	}
+	lua_pop(L, 1);
+	id = (jint)lua_rawlen(L, -1) + 1;
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, id);
+	lua_pushvalue(L, -2);
+	lua_pushinteger(L, id);
+	lua_rawset(L, -3);
+	lua_pushinteger(L, id);
+	return 1;
+}
+JNIEXPORT jint JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1newstringid (JNIEnv *env, jobject obj, jstring s) {
+	lua_State *L = getluathread(env, obj);
+	const char *newstringid_s = NULL;
+	jint newstringid_result = 0;
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& (newstringid_s = getstringchars(env, s))) {
+		jsize newstringid_length = (*env)->GetStringUTFLength(env, s);
+		lua_pushcfunction(L, newstringid_protected);
+		lua_pushlightuserdata(L, (void*)newstringid_s);
+		lua_pushinteger(L, newstringid_length);
+		JNLUA_PCALL(L, 2, 1);
+		newstringid_result = (jint)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	if (newstringid_s) {
+		releasestringchars(env, s, newstringid_s);
+	}
+	return newstringid_result;
+}
+
+/* lua_pushstringid() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1pushstringid (JNIEnv *env, jobject obj, jint id) {
+	lua_State *L = getluathread(env, obj);
+	if (checkstack(L, JNLUA_MINSTACK)) {
+		pushstringid(L, id);
+	}
+}
+
+/* lua_getfieldid() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1getfieldid (JNIEnv *env, jobject obj, jint index, jint id) {
+	lua_State *L = getluathread(env, obj);
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checktype(L, index, LUA_TTABLE)) {
+		index = lua_absindex(L, index);
+		if (israwtable(L, index)) {
+			if (pushstringid(L, id)) {
+				lua_rawget(L, index);
+			}
+			return;
+		}
+		lua_pushcfunction(L, gettable_protected);
+		lua_pushvalue(L, index);
+		if (!pushstringid(L, id)) {
+			lua_pop(L, 2);
+			return;
+		}
+		JNLUA_PCALL(L, 2, 1);
+	}
+}
+
+/* lua_setfieldid() */
+JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_lua_1setfieldid (JNIEnv *env, jobject obj, jint index, jint id) {
+	lua_State *L = getluathread(env, obj);
+	if (checkstack(L, JNLUA_MINSTACK)
+			&& checktype(L, index, LUA_TTABLE)
+			&& checknelems(L, 1)) {
+		index = lua_absindex(L, index);
+		if (!pushstringid(L, id)) {
+			return;
+		}
+		lua_insert(L, -2);
+		if (israwtable(L, index) && hasrawkey(L, index, -2)) {
+			lua_rawset(L, index);
+			return;
+		}
+		lua_pushcfunction(L, settable_protected);
+		lua_insert(L, -3);
+		lua_pushvalue(L, index);
+		lua_insert(L, -3);
+		JNLUA_PCALL(L, 3, 0);
+	}
+}
+
 /* ---- Debug structure ---- */
 /* lua_debugfree() */
 JNIEXPORT void JNICALL Java_me_querol_com_naef_jnlua_LuaState_00024LuaDebug_lua_1debugfree (JNIEnv *env, jobject obj) {
@@ -1666,6 +2499,10 @@ JNIEXPORT jint JNICALL JNI_OnLoad (JavaVM *vm, void *reserved) {
 			|| !(setluastacktrace_id = (*env)->GetMethodID(env, luaerror_class, "setLuaStackTrace", "([Lme/querol/com/naef/jnlua/LuaStackTraceElement;)V"))) {
 		return JNLUA_JNIVERSION;
 	}
+	/* Optional, older Java sides only take materialized stack traces */
+	if (!(setluastacktraceid_id = (*env)->GetMethodID(env, luaerror_class, "setLuaStackTraceId", "(Lme/querol/com/naef/jnlua/LuaState;I)V"))) {
+		(*env)->ExceptionClear(env);
+	}
 	if (!(nullpointerexception_class = referenceclass(env, "java/lang/NullPointerException"))) {
 		return JNLUA_JNIVERSION;
 	}
@@ -1687,7 +2524,8 @@ JNIEXPORT jint JNICALL JNI_OnLoad (JavaVM *vm, void *reserved) {
 		return JNLUA_JNIVERSION;
 	}
 	if (!(inputstream_class = referenceclass(env, "java/io/InputStream"))
-			|| !(read_id = (*env)->GetMethodID(env, inputstream_class, "read", "([B)I"))) {
+			|| !(read_id = (*env)->GetMethodID(env, inputstream_class, "read", "([B)I"))
+			|| !(readrange_id = (*env)->GetMethodID(env, inputstream_class, "read", "([BII)I"))) {
 		return JNLUA_JNIVERSION;
 	}
 	if (!(outputstream_class = referenceclass(env, "java/io/OutputStream"))
@@ -2101,99 +2939,948 @@ static int calljavafunction (lua_State *L) {
 	return nresults;
 }
 
-/* Handles Lua errors. */
-static int messagehandler (lua_State *L) {
-	JNIEnv *thread_env = getthreadenv();
-	int level, count;
-	lua_Debug ar;
-	jobjectArray luastacktrace;
-	jstring name, source;
-	jobject luastacktraceelement;
-	jobject luaerror;
-	jstring message;
+/* ---- String ids ---- */
+/*
+ * Pushes the string registered under an id. The strings are kept alive by the
+ * id table, so pushing one neither converts nor rehashes anything. The table
+ * is looked up by address rather than by name for the same reason.
+ */
+static int pushstringid (lua_State *L, jint id) {
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &stringids_key);
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return checkarg(0, "illegal string id");
+	}
+	lua_rawgeti(L, -1, id);
+	lua_remove(L, -2);
+	if (lua_type(L, -1) != LUA_TSTRING) {
+		lua_pop(L, 1);
+		return checkarg(0, "illegal string id");
+	}
+	return 1;
+}
 
-	/* Count relevant stack frames */
-	level = 1;
-	count = 0;
-	while (lua_getstack(L, level, &ar)) {
-		lua_getinfo(L, "nSl", &ar);
-		if (isrelevant(&ar)) {
-			count++;
+/* ---- String transfer ---- */
+/*
+ * The following move strings between Java and Lua with a single conversion,
+ * straight from or into the UTF-16 chars of the Java string. Unlike the
+ * modified UTF-8 of GetStringUTFChars() and NewStringUTF(), both Latin-1 and
+ * standard UTF-8 keep embedded zeros intact.
+ */
+
+/* Converts a value like lua_tolstring() does. */
+static int tobytes_protected (lua_State *L) {
+	lua_tolstring(L, 1, NULL);
+	return 1;
+}
+
+/*
+ * Returns the bytes of a string or number, or NULL for other values. Numbers
+ * are converted on a copy. Either way, one value is left on the stack, which
+ * keeps the bytes alive until the caller pops it.
+ */
+static const char *tobytes (lua_State *L, int index, size_t *length) {
+	int status;
+	
+	lua_pushvalue(L, index);
+	if (lua_type(L, -1) == LUA_TNUMBER) {
+		lua_pushcfunction(L, tobytes_protected);
+		lua_insert(L, -2);
+		status = lua_pcall(L, 1, 1, 0);
+		if (status != LUA_OK) {
+			throw(L, status);
+			lua_pushnil(L);
 		}
-		level++;
 	}
+	return lua_tolstring(L, -1, length);
+}
+
+/* Creates a string to be filled in, see lua_newstring(). */
+static int newstring_protected (lua_State *L) {
+	lua_pushlightuserdata(L, (void*)lua_newstring(L, (size_t) lua_tointeger(L, 1)));
+	return 2;
+}
+
+/*
+ * Pushes a region of a Java byte array, copying it once. Longer strings are
+ * created empty and filled in straight from the array. Shorter ones may be
+ * interned by Lua and so are copied through a buffer.
+ */
+static void pushbyteregion (JNIEnv *env, jobject obj, lua_State *L, jbyteArray ba, jsize offset, jsize length) {
+	jbyte stack_buffer[JNLUA_STRINGBUFFER];
+	char *s;
+	int status;
 	
-	/* Create Lua stack trace as a Java LuaStackTraceElement[] */
-	luastacktrace = (*thread_env)->NewObjectArray(thread_env, count, luastacktraceelement_class, NULL);
-	if (!luastacktrace) {
-		return 1;
+	if (length <= JNLUA_STRINGBUFFER) {
+		(*env)->GetByteArrayRegion(env, ba, offset, length, stack_buffer);
+		if (hasheadroom(env, obj, L, length)) {
+			lua_pushlstring(L, (const char*)stack_buffer, length);
+		} else {
+			lua_pushcfunction(L, pushstring_protected);
+			lua_pushlightuserdata(L, (void*)stack_buffer);
+			lua_pushinteger(L, length);
+			JNLUA_PCALL(L, 2, 1);
+		}
+		return;
 	}
-	level = 1;
-	count = 0;
-	while (lua_getstack(L, level, &ar)) {
-		lua_getinfo(L, "nSl", &ar);
-		if (isrelevant(&ar)) {
-			name = ar.name ? (*thread_env)->NewStringUTF(thread_env, ar.name) : NULL;
-			source = ar.source ? (*thread_env)->NewStringUTF(thread_env, ar.source) : NULL;
-			luastacktraceelement = (*thread_env)->NewObject(thread_env, luastacktraceelement_class,	luastacktraceelement_id, name, source, ar.currentline);
-			if (!luastacktraceelement) {
-				return 1;
-			}
-			(*thread_env)->SetObjectArrayElement(thread_env, luastacktrace, count, luastacktraceelement);
-			if ((*thread_env)->ExceptionCheck(thread_env)) {
-				return 1;
-			}
-			count++;
+	if (hasheadroom(env, obj, L, length)) {
+		s = lua_newstring(L, length);
+	} else {
+		lua_pushcfunction(L, newstring_protected);
+		lua_pushinteger(L, length);
+		status = lua_pcall(L, 1, 2, 0);
+		if (status != LUA_OK) {
+			throw(L, status);
+			return;
 		}
-		level++;
+		s = (char*)lua_touserdata(L, -1);
+		lua_pop(L, 1);
 	}
+	(*env)->GetByteArrayRegion(env, ba, offset, length, (jbyte*)s);
+}
+
+/* Pushes a Java string as Latin-1 or UTF-8. */
+static void pushconverted (JNIEnv *env, jobject obj, lua_State *L, jstring s, int utf8) {
+	char stack_buffer[JNLUA_STRINGBUFFER];
+	char *buffer = stack_buffer;
+	const jchar *chars;
+	jsize count;
+	size_t size, length;
 	
-	/* Get or create the error object  */
-	luaerror = tojavaobject(L, -1, luaerror_class);
-	if (!luaerror) {
-		message = tostring(L, -1);
-		if (!(luaerror = (*thread_env)->NewObject(thread_env, luaerror_class, luaerror_id, message, NULL))) {
-			return 1;
+	count = (*env)->GetStringLength(env, s);
+	size = utf8 ? (size_t) count * 3 : (size_t) count;
+	if (size > sizeof(stack_buffer)) {
+		buffer = malloc(size);
+		if (!check(buffer != NULL, luamemoryallocationexception_class, "JNI error: malloc() failed")) {
+			return;
+		}
+	}
+	chars = (*env)->GetStringCritical(env, s, NULL);
+	if (check(chars != NULL, luamemoryallocationexception_class, "JNI error: GetStringCritical() failed")) {
+		length = utf8 ? encodeutf8(chars, count, buffer) : encodelatin1(chars, count, buffer);
+		(*env)->ReleaseStringCritical(env, s, chars);
+		if (hasheadroom(env, obj, L, length)) {
+			lua_pushlstring(L, buffer, length);
+		} else {
+			lua_pushcfunction(L, pushstring_protected);
+			lua_pushlightuserdata(L, (void*)buffer);
+			lua_pushinteger(L, (lua_Integer) length);
+			JNLUA_PCALL(L, 2, 1);
+		}
+	}
+	if (buffer != stack_buffer) {
+		free(buffer);
+	}
+}
+
+/* Returns a Java string for Latin-1 or UTF-8 bytes. */
+static jstring newconverted (JNIEnv *env, const char *s, size_t length, int utf8) {
+	jchar stack_buffer[JNLUA_STRINGBUFFER];
+	jchar *buffer = stack_buffer;
+	jstring string;
+	jsize count;
+	
+	/* Neither decoding yields more chars than there are bytes */
+	if (!check(length <= INT_MAX, illegalargumentexception_class, "string too long")) {
+		return NULL;
+	}
+	if (length > JNLUA_STRINGBUFFER) {
+		buffer = malloc(length * sizeof(jchar));
+		if (!check(buffer != NULL, luamemoryallocationexception_class, "JNI error: malloc() failed")) {
+			return NULL;
 		}
 	}
-	(*thread_env)->CallVoidMethod(thread_env, luaerror, setluastacktrace_id, luastacktrace);
+	count = utf8 ? decodeutf8(s, length, buffer) : decodelatin1(s, length, buffer);
+	string = (*env)->NewString(env, buffer, count);
+	if (buffer != stack_buffer) {
+		free(buffer);
+	}
+	return string;
+}
+
+/* Encodes chars as Latin-1. Chars outside of it become '?'. */
+static size_t encodelatin1 (const jchar *chars, jsize count, char *buffer) {
+	jsize i;
 	
-	/* Replace error */
-	pushjavaobject(L, luaerror);
-	return 1;
+	for (i = 0; i < count; i++) {
+		buffer[i] = chars[i] <= 0xff ? (char) chars[i] : '?';
+	}
+	return (size_t) count;
 }
 
-/* Processes a Lua activation record and returns whether it is relevant. */
-static int isrelevant (lua_Debug *ar) {
-	if (ar->name && strlen(ar->name) == 0) {
-		ar->name = NULL;
+/*
+ * Encodes chars as UTF-8, at most three bytes per char. Unpaired surrogates
+ * become U+FFFD.
+ */
+static size_t encodeutf8 (const jchar *chars, jsize count, char *buffer) {
+	unsigned char *b = (unsigned char *) buffer;
+	unsigned long c;
+	jsize i;
+	
+	for (i = 0; i < count; i++) {
+		c = chars[i];
+		if (c < 0x80) {
+			*b++ = (unsigned char) c;
+		} else if (c < 0x800) {
+			*b++ = (unsigned char) (0xc0 | c >> 6);
+			*b++ = (unsigned char) (0x80 | (c & 0x3f));
+		} else if (c >= 0xd800 && c < 0xdc00 && i + 1 < count && chars[i + 1] >= 0xdc00 && chars[i + 1] < 0xe000) {
+			c = 0x10000 + ((c - 0xd800) << 10) + (chars[++i] - 0xdc00);
+			*b++ = (unsigned char) (0xf0 | c >> 18);
+			*b++ = (unsigned char) (0x80 | (c >> 12 & 0x3f));
+			*b++ = (unsigned char) (0x80 | (c >> 6 & 0x3f));
+			*b++ = (unsigned char) (0x80 | (c & 0x3f));
+		} else {
+			if (c >= 0xd800 && c < 0xe000) {
+				c = 0xfffd;
+			}
+			*b++ = (unsigned char) (0xe0 | c >> 12);
+			*b++ = (unsigned char) (0x80 | (c >> 6 & 0x3f));
+			*b++ = (unsigned char) (0x80 | (c & 0x3f));
+		}
 	}
-	if (ar->what && strcmp(ar->what, "C") == 0) {
-		ar->source = NULL;
+	return (size_t) (b - (unsigned char *) buffer);
+}
+
+/* Decodes Latin-1 bytes. */
+static jsize decodelatin1 (const char *s, size_t length, jchar *buffer) {
+	size_t i;
+	
+	for (i = 0; i < length; i++) {
+		buffer[i] = (unsigned char) s[i];
 	}
-	if (ar->source) {
-		if (*ar->source == '=' || *ar->source == '@') {
-			ar->source++;
+	return (jsize) length;
+}
+
+/*
+ * Decodes UTF-8 bytes. Every byte that does not start a well-formed sequence
+ * becomes U+FFFD. Code points beyond U+FFFF become surrogate pairs.
+ */
+static jsize decodeutf8 (const char *s, size_t length, jchar *buffer) {
+	static const unsigned long limits[] = { 0, 0x80, 0x800, 0x10000 };
+	const unsigned char *p = (const unsigned char *) s, *end = p + length;
+	jchar *b = buffer;
+	unsigned long c;
+	int n, i;
+	
+	while (p < end) {
+		c = *p++;
+		if (c < 0x80) {
+			*b++ = (jchar) c;
+			continue;
+		}
+		if (c >= 0xc2 && c < 0xe0) {
+			n = 1;
+			c &= 0x1f;
+		} else if (c >= 0xe0 && c < 0xf0) {
+			n = 2;
+			c &= 0x0f;
+		} else if (c >= 0xf0 && c < 0xf5) {
+			n = 3;
+			c &= 0x07;
+		} else {
+			*b++ = 0xfffd;
+			continue;
+		}
+		for (i = 0; i < n && p + i < end && (p[i] & 0xc0) == 0x80; i++) {
+			c = c << 6 | (p[i] & 0x3f);
+		}
+		if (i < n || c < limits[n] || (c >= 0xd800 && c < 0xe000) || c > 0x10ffff) {
+			*b++ = 0xfffd;
+			continue;
+		}
+		p += n;
+		if (c >= 0x10000) {
+			c -= 0x10000;
+			*b++ = (jchar) (0xd800 | c >> 10);
+			*b++ = (jchar) (0xdc00 | (c & 0x3ff));
+		} else {
+			*b++ = (jchar) c;
 		}
 	}
-	return ar->name || ar->source;
+	return (jsize) (b - buffer);
 }
 
-/* Handles Lua errors by throwing a Java exception. */
-static int throw_protected (lua_State *L) {
-	JNIEnv *thread_env = getthreadenv();
-	jclass class;
-	jmethodID id;
-	jthrowable throwable;
-	jobject luaerror;
-	int throw_status = lua_tointeger(L, 2);
-	lua_pop(L, 1);
+/* ---- Batches ---- */
+/*
+ * A batch is a sequence of operations read from a direct buffer, each being
+ * an opcode byte followed by its operands in native byte order: ints are 4
+ * bytes, integers and numbers 8 bytes, and strings an int length followed by
+ * the bytes. A batch runs like a function on its own stack, with the values
+ * it is passed at indexes 1 to nargs. The values left on that stack are its
+ * results; they are written back to the buffer as records of a type byte
+ * followed by the value of booleans (1 byte), numbers (an integer flag byte,
+ * then an integer or number) and strings. Other values are not kept, REF can
+ * be used to get a reference to them instead.
+ */
+
+/* Runs the next operation of a batch. */
+static void runbatchop (lua_State *L, Batch *batch) {
+	unsigned char op;
+	int index, n, nresults;
+	lua_Integer i;
+	lua_Number d;
+	const char *s;
+	size_t length;
 	
-	/* Determine the type of exception to throw. */
-	switch (throw_status) {
-	case LUA_ERRRUN:
-		class = luaruntimeexception_class;
-		id = luaruntimeexception_id;
+	luaL_checkstack(L, 4, "batch");
+	readbatch(L, batch, &op, 1);
+	switch (op) {
+	case JNLUA_OP_PUSHNIL:
+		lua_pushnil(L);
+		break;
+	case JNLUA_OP_PUSHBOOLEAN:
+		readbatch(L, batch, &op, 1);
+		lua_pushboolean(L, op);
+		break;
+	case JNLUA_OP_PUSHINTEGER:
+		readbatch(L, batch, &i, sizeof(i));
+		lua_pushinteger(L, i);
+		break;
+	case JNLUA_OP_PUSHNUMBER:
+		readbatch(L, batch, &d, sizeof(d));
+		lua_pushnumber(L, d);
+		break;
+	case JNLUA_OP_PUSHSTRING:
+		s = readbatchstring(L, batch, &length);
+		lua_pushlstring(L, s, length);
+		break;
+	case JNLUA_OP_PUSHSTRINGID:
+		n = readbatchint(L, batch);
+		lua_rawgetp(L, LUA_REGISTRYINDEX, &stringids_key);
+		if (lua_type(L, -1) != LUA_TTABLE || lua_rawgeti(L, -1, n) != LUA_TSTRING) {
+			luaL_error(L, "illegal string id");
+		}
+		lua_remove(L, -2);
+		break;
+	case JNLUA_OP_PUSHVALUE:
+		index = readbatchindex(L, batch);
+		lua_pushvalue(L, index);
+		break;
+	case JNLUA_OP_POP:
+		n = readbatchint(L, batch);
+		if (n < 0) {
+			luaL_error(L, "illegal count");
+		}
+		checkbatchnelems(L, batch, n);
+		lua_pop(L, n);
+		break;
+	case JNLUA_OP_NEWTABLE:
+		n = readbatchint(L, batch);
+		index = readbatchint(L, batch);
+		if (n < 0 || index < 0) {
+			luaL_error(L, "illegal table size");
+		}
+		lua_createtable(L, n, index);
+		break;
+	case JNLUA_OP_GETFIELD:
+		index = readbatchindex(L, batch);
+		s = readbatchstring(L, batch, &length);
+		lua_pushlstring(L, s, length);
+		lua_gettable(L, index);
+		break;
+	case JNLUA_OP_SETFIELD:
+		index = readbatchindex(L, batch);
+		s = readbatchstring(L, batch, &length);
+		checkbatchnelems(L, batch, 1);
+		lua_pushlstring(L, s, length);
+		lua_insert(L, -2);
+		lua_settable(L, index);
+		break;
+	case JNLUA_OP_GETTABLE:
+		index = readbatchindex(L, batch);
+		checkbatchnelems(L, batch, 1);
+		lua_gettable(L, index);
+		break;
+	case JNLUA_OP_SETTABLE:
+		index = readbatchindex(L, batch);
+		checkbatchnelems(L, batch, 2);
+		lua_settable(L, index);
+		break;
+	case JNLUA_OP_RAWGETI:
+		index = readbatchtable(L, batch);
+		readbatch(L, batch, &i, sizeof(i));
+		lua_rawgeti(L, index, i);
+		break;
+	case JNLUA_OP_RAWSETI:
+		index = readbatchtable(L, batch);
+		readbatch(L, batch, &i, sizeof(i));
+		checkbatchnelems(L, batch, 1);
+		lua_rawseti(L, index, i);
+		break;
+	case JNLUA_OP_GETGLOBAL:
+		s = readbatchstring(L, batch, &length);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+		lua_pushlstring(L, s, length);
+		lua_gettable(L, -2);
+		lua_remove(L, -2);
+		break;
+	case JNLUA_OP_SETGLOBAL:
+		s = readbatchstring(L, batch, &length);
+		checkbatchnelems(L, batch, 1);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+		lua_insert(L, -2);
+		lua_pushlstring(L, s, length);
+		lua_insert(L, -2);
+		lua_settable(L, -3);
+		lua_pop(L, 1);
+		break;
+	case JNLUA_OP_CALL:
+		n = readbatchint(L, batch);
+		nresults = readbatchint(L, batch);
+		if (n < 0 || (nresults < 0 && nresults != LUA_MULTRET)) {
+			luaL_error(L, "illegal call");
+		}
+		if (n >= lua_gettop(L)) { /* the function and n arguments, n + 1 may overflow */
+			luaL_error(L, "stack underflow at %d", (int) batch->position);
+		}
+		if (nresults > 0) {
+			luaL_checkstack(L, nresults, "batch");
+		}
+		lua_call(L, n, nresults);
+		break;
+	case JNLUA_OP_REF:
+		index = readbatchtable(L, batch);
+		checkbatchnelems(L, batch, 1);
+		lua_pushinteger(L, luaL_ref(L, index));
+		break;
+	default:
+		luaL_error(L, "illegal batch operation %d at %d", (int) op, (int) batch->position - 1);
+	}
+}
+
+/* Reads operands of a batch operation. */
+static void readbatch (lua_State *L, Batch *batch, void *value, size_t size) {
+	if (size > batch->length - batch->position) {
+		luaL_error(L, "batch truncated at %d", (int) batch->position);
+	}
+	memcpy(value, batch->ops + batch->position, size);
+	batch->position += size;
+}
+
+/* Reads an int operand. */
+static int readbatchint (lua_State *L, Batch *batch) {
+	jint value;
+	
+	readbatch(L, batch, &value, sizeof(value));
+	return (int) value;
+}
+
+/* Reads a stack index, which may be the registry index. */
+static int readbatchindex (lua_State *L, Batch *batch) {
+	int index = readbatchint(L, batch);
+	
+	if (index == LUA_REGISTRYINDEX) {
+		return index;
+	}
+	if (index < 0) {
+		index = lua_gettop(L) + index + 1;
+	}
+	if (index < 1 || index > lua_gettop(L)) {
+		luaL_error(L, "illegal index at %d", (int) batch->position - 4);
+	}
+	return index;
+}
+
+/* Reads the stack index of a table, for raw accesses. */
+static int readbatchtable (lua_State *L, Batch *batch) {
+	int index = readbatchindex(L, batch);
+	
+	if (lua_type(L, index) != LUA_TTABLE) {
+		luaL_error(L, "table expected at %d", (int) batch->position - 4);
+	}
+	return index;
+}
+
+/* Reads a string, which stays in the batch. */
+static const char *readbatchstring (lua_State *L, Batch *batch, size_t *length) {
+	const char *s;
+	int n = readbatchint(L, batch);
+	
+	if (n < 0 || (size_t) n > batch->length - batch->position) {
+		luaL_error(L, "batch truncated at %d", (int) batch->position);
+	}
+	s = (const char*)batch->ops + batch->position;
+	batch->position += (size_t) n;
+	*length = (size_t) n;
+	return s;
+}
+
+/* Checks that the stack of a batch has at least n values. */
+static void checkbatchnelems (lua_State *L, Batch *batch, int n) {
+	if (lua_gettop(L) < n) {
+		luaL_error(L, "stack underflow at %d", (int) batch->position);
+	}
+}
+
+/*
+ * Writes the values from an index to the top as batch results. Returns how
+ * many were written; writing stops at the first one that does not fit.
+ */
+static int writebatchresults (lua_State *L, int index, unsigned char *buffer, size_t capacity) {
+	unsigned char *b = buffer, *end = buffer + capacity;
+	const char *s;
+	size_t length;
+	lua_Integer i;
+	lua_Number d;
+	jint n;
+	int count = 0, type;
+	
+	for (; index <= lua_gettop(L); index++, count++) {
+		type = lua_type(L, index);
+		if (b == end) {
+			break;
+		}
+		*b++ = (unsigned char) type;
+		switch (type) {
+		case LUA_TBOOLEAN:
+			if (b == end) {
+				return count;
+			}
+			*b++ = (unsigned char) lua_toboolean(L, index);
+			break;
+		case LUA_TNUMBER:
+			if ((size_t) (end - b) < 1 + sizeof(i)) {
+				return count;
+			}
+			*b = (unsigned char) lua_isinteger(L, index);
+			if (*b++) {
+				i = lua_tointeger(L, index);
+				memcpy(b, &i, sizeof(i));
+			} else {
+				d = lua_tonumber(L, index);
+				memcpy(b, &d, sizeof(d));
+			}
+			b += sizeof(i);
+			break;
+		case LUA_TSTRING:
+			s = lua_tolstring(L, index, &length);
+			if (length > INT_MAX || (size_t) (end - b) < sizeof(n) + length) {
+				return count;
+			}
+			n = (jint) length;
+			memcpy(b, &n, sizeof(n));
+			memcpy(b + sizeof(n), s, length);
+			b += sizeof(n) + length;
+			break;
+		}
+	}
+	return count;
+}
+
+/*
+ * Pushes values written in the format of writebatchresults(), which must be
+ * nil, booleans, numbers or strings. Returns how many were pushed, or -1 if
+ * they are malformed or do not fit on the stack, in which case none are left.
+ * The caller has to make sure that pushing the strings cannot fail.
+ */
+static int readbatchvalues (lua_State *L, const unsigned char *buffer, size_t length) {
+	const unsigned char *b = buffer, *end = buffer + length;
+	lua_Integer i;
+	lua_Number d;
+	jint n;
+	int count = 0;
+	
+	while (b != NULL && b < end) {
+		if (!lua_checkstack(L, 1)) {
+			b = NULL;
+			break;
+		}
+		switch (*b++) {
+		case LUA_TNIL:
+			lua_pushnil(L);
+			break;
+		case LUA_TBOOLEAN:
+			if (b == end) {
+				b = NULL;
+				break;
+			}
+			lua_pushboolean(L, *b++);
+			break;
+		case LUA_TNUMBER:
+			if ((size_t) (end - b) < 1 + sizeof(i)) {
+				b = NULL;
+				break;
+			}
+			if (*b++) {
+				memcpy(&i, b, sizeof(i));
+				lua_pushinteger(L, i);
+			} else {
+				memcpy(&d, b, sizeof(d));
+				lua_pushnumber(L, d);
+			}
+			b += sizeof(i);
+			break;
+		case LUA_TSTRING:
+			if ((size_t) (end - b) < sizeof(n)) {
+				b = NULL;
+				break;
+			}
+			memcpy(&n, b, sizeof(n));
+			b += sizeof(n);
+			if (n < 0 || (size_t) n > (size_t) (end - b)) {
+				b = NULL;
+				break;
+			}
+			lua_pushlstring(L, (const char*)b, (size_t) n);
+			b += n;
+			break;
+		default:
+			b = NULL;
+		}
+		if (b != NULL) {
+			count++;
+		}
+	}
+	if (b == NULL) {
+		lua_pop(L, count);
+		return -1;
+	}
+	return count;
+}
+
+/* ---- Resume handles ---- */
+static int pushresumeargs_protected (lua_State *L) {
+	ResumeHandle *rh = (ResumeHandle *) lua_touserdata(L, 1);
+	size_t length = (size_t) lua_tointeger(L, 2);
+	int nargs;
+	
+	lua_settop(L, 0);
+	nargs = readbatchvalues(L, rh->values, length);
+	if (nargs < 0) {
+		return luaL_error(L, "illegal arguments");
+	}
+	return nargs;
+}
+
+/*
+ * Pushes the arguments in the buffer of a resume handle onto its coroutine.
+ * Returns their number, or -1 if an exception has been thrown. Without enough
+ * headroom, the strings are pushed onto the stack of L in a protected call,
+ * as the coroutine has no error handler to catch a failed allocation.
+ */
+static int pushresumeargs (JNIEnv *env, jobject obj, lua_State *L, ResumeHandle *rh, size_t length) {
+	int top, nargs, status;
+	
+	if (hasheadroom(env, obj, L, length)) {
+		nargs = readbatchvalues(rh->T, rh->values, length);
+		return checkarg(nargs >= 0, "illegal arguments") ? nargs : -1;
+	}
+	top = lua_gettop(L);
+	lua_pushcfunction(L, pushresumeargs_protected);
+	lua_pushlightuserdata(L, (void*)rh);
+	lua_pushinteger(L, (lua_Integer) length);
+	status = lua_pcall(L, 2, LUA_MULTRET, 0);
+	if (status != LUA_OK) {
+		throw(L, status);
+		return -1;
+	}
+	nargs = lua_gettop(L) - top;
+	if (!checkstack(rh->T, nargs)) {
+		lua_settop(L, top);
+		return -1;
+	}
+	lua_xmove(L, rh->T, nargs);
+	return nargs;
+}
+
+/* Releases the buffer of a resume handle that has not been freed. */
+static int gcresumehandle (lua_State *L) {
+	JNIEnv *thread_env = getthreadenv();
+	ResumeHandle *rh;
+	
+	if (!thread_env) {
+		/* Environment has been cleared as the Java VM was destroyed. Nothing to do. */
+		return 0;
+	}
+	rh = (ResumeHandle *) lua_touserdata(L, 1);
+	if (rh->buffer) {
+		(*thread_env)->DeleteGlobalRef(thread_env, rh->buffer);
+		rh->buffer = NULL;
+	}
+	return 0;
+}
+
+/* ---- Fast paths ---- */
+/*
+ * The following decide whether an API operation can run without a protected
+ * call, saving the setjmp and the extra C function call. That is only done if
+ * the operation provably cannot raise an error: it must not call metamethods,
+ * and any memory it allocates must fit into the headroom checked below.
+ */
+
+/*
+ * Returns whether the value at an index is a table without a metatable. Raw
+ * access to such a table is the same as regular access.
+ */
+static int israwtable (lua_State *L, int index) {
+	if (lua_type(L, index) != LUA_TTABLE) {
+		return 0;
+	}
+	if (lua_getmetatable(L, index)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Returns whether the key at an index already has a value in the table at
+ * another index. Setting an existing key never resizes the table, and it
+ * cannot fail because of a nil or NaN key either.
+ */
+static int hasrawkey (lua_State *L, int index, int keyindex) {
+	int present;
+	
+	lua_pushvalue(L, keyindex);
+	present = lua_rawget(L, index) != LUA_TNIL;
+	lua_pop(L, 1);
+	return present;
+}
+
+/*
+ * Returns whether size bytes plus some fixed overhead can be allocated without
+ * a collector step, which may run __gc metamethods, and without exceeding the
+ * memory limit of the state. Only the system allocator failing outright is not
+ * covered, which is fatal to the Java VM as well.
+ */
+static int hasheadroom (JNIEnv *env, jobject obj, lua_State *L, size_t size) {
+	jint total = 0, used = 0;
+	
+	if (size > INT_MAX - JNLUA_HEADROOM) {
+		return 0;
+	}
+	size += JNLUA_HEADROOM;
+	getluamemory(env, obj, &total, &used);
+	if (total > 0 && (size_t)(total - used) < size) {
+		return 0;
+	}
+	return lua_gc(L, LUA_GCHEADROOM, (int)size);
+}
+
+/*
+ * Handles Lua errors. Only the functions and current instructions of the stack
+ * frames are captured here, into preallocated buffers, so errors do not
+ * allocate in either heap. Unless the Java side is too old to take a stack
+ * trace id, the Java stack trace is built when it is asked for.
+ */
+static int messagehandler (lua_State *L) {
+	JNIEnv *thread_env = getthreadenv();
+	jobjectArray luastacktrace = NULL;
+	jobject luaerror, javastate = NULL;
+	jstring message;
+	int id;
+
+	/* Capture Lua stack trace */
+	id = capturestacktrace(L);
+	if (!setluastacktraceid_id || !(javastate = getjavastate(L))) {
+		luastacktrace = tostacktrace(thread_env, L, -1, pushstacktrace(L, id));
+		lua_pop(L, 1);
+		if (!luastacktrace) {
+			return 1;
+		}
+	}
+	
+	/* Get or create the error object  */
+	luaerror = tojavaobject(L, -1, luaerror_class);
+	if (!luaerror) {
+		message = tostring(L, -1);
+		if (!(luaerror = (*thread_env)->NewObject(thread_env, luaerror_class, luaerror_id, message, NULL))) {
+			return 1;
+		}
+	}
+	if (luastacktrace) {
+		(*thread_env)->CallVoidMethod(thread_env, luaerror, setluastacktrace_id, luastacktrace);
+	} else {
+		(*thread_env)->CallVoidMethod(thread_env, luaerror, setluastacktraceid_id, javastate, (jint) id);
+	}
+	
+	/* Replace error */
+	pushjavaobject(L, luaerror);
+	return 1;
+}
+
+/* Processes a Lua activation record and returns whether it is relevant. */
+static int isrelevant (lua_Debug *ar) {
+	if (ar->name && strlen(ar->name) == 0) {
+		ar->name = NULL;
+	}
+	if (ar->what && strcmp(ar->what, "C") == 0) {
+		ar->source = NULL;
+	}
+	if (ar->source) {
+		if (*ar->source == '=' || *ar->source == '@') {
+			ar->source++;
+		}
+	}
+	return ar->name || ar->source;
+}
+
+/*
+ * Pushes the table anchoring the functions of the captured stack traces and
+ * returns the ring holding the rest. Both are created on first use, with room
+ * for all traces, so that capturing a stack trace does not allocate. Returns
+ * NULL and pushes nothing if they do not exist and create is 0.
+ */
+static StackTraceRing *pushstacktraces (lua_State *L, int create) {
+	StackTraceRing *ring;
+	
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &stacktraces_key) != LUA_TUSERDATA) {
+		lua_pop(L, 1);
+		if (!create) {
+			return NULL;
+		}
+		ring = (StackTraceRing *) lua_newuserdata(L, sizeof(StackTraceRing));
+		memset(ring, 0, sizeof(StackTraceRing));
+		lua_createtable(L, JNLUA_MAXTRACES * JNLUA_MAXTRACEFRAMES, 0);
+		lua_setuservalue(L, -2);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &stacktraces_key);
+	}
+	ring = (StackTraceRing *) lua_touserdata(L, -1);
+	lua_getuservalue(L, -1);
+	lua_remove(L, -2);
+	return ring;
+}
+
+/*
+ * Captures the Lua stack trace as function and code pairs and returns its id,
+ * where the code holds the current instruction and whether the frame is a tail
+ * call. That is enough to get the debug information later on. The message
+ * handler itself is not part of the trace, and only the innermost
+ * JNLUA_MAXTRACEFRAMES frames are kept. The trace replaces the oldest of the
+ * last JNLUA_MAXTRACES traces, so traces nobody asks for cannot pile up.
+ */
+static int capturestacktrace (lua_State *L) {
+	StackTraceRing *ring;
+	StackTrace *trace;
+	lua_Debug ar;
+	int level, count, base;
+	
+	ring = pushstacktraces(L, 1);
+	ring->id = ring->id < INT_MAX ? ring->id + 1 : 1;
+	trace = &ring->traces[ring->id % JNLUA_MAXTRACES];
+	base = ring->id % JNLUA_MAXTRACES * JNLUA_MAXTRACEFRAMES;
+	count = trace->count;
+	trace->id = ring->id;
+	for (level = 1; level <= JNLUA_MAXTRACEFRAMES && lua_getstack(L, level, &ar); level++) {
+		lua_getinfo(L, "tf", &ar);
+		lua_rawseti(L, -2, base + level);
+		trace->codes[level - 1] = (lua_getpc(L, &ar) + 1) * 2 + (ar.istailcall != 0);
+	}
+	trace->count = level - 1;
+	
+	/* Release the functions of the replaced trace */
+	for (; level <= count; level++) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, base + level);
+	}
+	lua_pop(L, 1);
+	return trace->id;
+}
+
+/*
+ * Pushes the table anchoring the functions of a captured stack trace and
+ * returns the trace. Returns NULL and pushes nothing if it is gone.
+ */
+static StackTrace *pushstacktrace (lua_State *L, jint id) {
+	StackTraceRing *ring;
+	
+	if (id <= 0 || !(ring = pushstacktraces(L, 0))) {
+		return NULL;
+	}
+	if (ring->traces[id % JNLUA_MAXTRACES].id != id) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	return &ring->traces[id % JNLUA_MAXTRACES];
+}
+
+/*
+ * Gets the debug information of a frame of a captured stack trace like
+ * lua_getinfo() with "nSl". The functions of the trace are in the table at the
+ * index. Returns 0 past the last frame. The name of a frame comes from the
+ * instruction its caller is at, as in Lua, except that frames called from
+ * hooks are not known as such anymore.
+ */
+static int getstacktraceinfo (lua_State *L, int index, const StackTrace *trace, int level, lua_Debug *ar) {
+	int base;
+	
+	if (level > trace->count) {
+		return 0;
+	}
+	base = trace->id % JNLUA_MAXTRACES * JNLUA_MAXTRACEFRAMES;
+	lua_rawgeti(L, index, base + level);
+	lua_getinfoat(L, trace->codes[level - 1] / 2 - 1, "Sl", ar);
+	ar->name = NULL;
+	ar->namewhat = "";
+	if (trace->codes[level - 1] % 2 == 0 && level < trace->count) {
+		lua_rawgeti(L, index, base + level + 1);
+		lua_getinfoat(L, trace->codes[level] / 2 - 1, "n", ar);
+	}
+	return 1;
+}
+
+/* Converts a captured stack trace to a Java LuaStackTraceElement[]. */
+static jobjectArray tostacktrace (JNIEnv *env, lua_State *L, int index, const StackTrace *trace) {
+	int level, count;
+	lua_Debug ar;
+	jobjectArray luastacktrace;
+	jstring name, source;
+	jobject luastacktraceelement;
+	
+	/* Count relevant stack frames */
+	index = lua_absindex(L, index);
+	level = 1;
+	count = 0;
+	while (getstacktraceinfo(L, index, trace, level, &ar)) {
+		if (isrelevant(&ar)) {
+			count++;
+		}
+		level++;
+	}
+	
+	/* Create Lua stack trace as a Java LuaStackTraceElement[] */
+	luastacktrace = (*env)->NewObjectArray(env, count, luastacktraceelement_class, NULL);
+	if (!luastacktrace) {
+		return NULL;
+	}
+	level = 1;
+	count = 0;
+	while (getstacktraceinfo(L, index, trace, level, &ar)) {
+		if (isrelevant(&ar)) {
+			name = ar.name ? (*env)->NewStringUTF(env, ar.name) : NULL;
+			source = ar.source ? (*env)->NewStringUTF(env, ar.source) : NULL;
+			luastacktraceelement = (*env)->NewObject(env, luastacktraceelement_class, luastacktraceelement_id, name, source, ar.currentline);
+			if (!luastacktraceelement) {
+				return NULL;
+			}
+			(*env)->SetObjectArrayElement(env, luastacktrace, count, luastacktraceelement);
+			if ((*env)->ExceptionCheck(env)) {
+				return NULL;
+			}
+			count++;
+		}
+		level++;
+	}
+	return luastacktrace;
+}
+
+/* Handles Lua errors by throwing a Java exception. */
+static int throw_protected (lua_State *L) {
+	JNIEnv *thread_env = getthreadenv();
+	jclass class;
+	jmethodID id;
+	jthrowable throwable;
+	jobject luaerror;
+	int throw_status = lua_tointeger(L, 2);
+	lua_pop(L, 1);
+	
+	/* Determine the type of exception to throw. */
+	switch (throw_status) {
+	case LUA_ERRRUN:
+		class = luaruntimeexception_class;
+		id = luaruntimeexception_id;
 		break;
 	case LUA_ERRSYNTAX:
 		class = luasyntaxexception_class;
@@ -2252,19 +3939,654 @@ static void throw (lua_State *L, int status) {
 	}
 }
 
+/* ---- State pools ---- */
+/* Opens the libraries of a pooled state, builds its perms and records its baseline. */
+static int preparestate_protected (lua_State *L) {
+	int libs = (int) lua_tointeger(L, 1), lib;
+	
+	lua_pop(L, 1);
+	for (lib = 0; lib < JNLUA_LIBS; lib++) {
+		if (libs & (1 << lib)) {
+			lua_pushcfunction(L, openlib_protected);
+			lua_pushinteger(L, lib);
+			lua_call(L, 1, 0);
+		}
+	}
+	buildperms(L);
+	snapshotstate(L);
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	return 0;
+}
+
+/* Creates a Lua state for a pool. Returns NULL on failure. */
+static lua_State *preparestate (jint libs) {
+	lua_State *L = luaL_newstate();
+	
+	if (!L) {
+		return NULL;
+	}
+	lua_pushcfunction(L, preparestate_protected);
+	lua_pushinteger(L, libs);
+	if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+		lua_close(L);
+		return NULL;
+	}
+	return L;
+}
+
+/*
+ * Builds the Eris perms tables of a pooled state, which are kept in the
+ * registry. The libraries are named by their name in the loaded table, their
+ * functions and userdata by "library.name", and the loaded table by
+ * "_LOADED".
+ */
+static void buildperms (lua_State *L) {
+	int perms, unperms, loaded;
+	
+	luaL_checkstack(L, 8, NULL);
+	lua_newtable(L);
+	perms = lua_gettop(L);
+	lua_newtable(L);
+	unperms = lua_gettop(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+	loaded = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, loaded)) {
+		if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TTABLE) {
+			lua_pushnil(L);
+			while (lua_next(L, -2)) {
+				if (lua_type(L, -2) == LUA_TSTRING && (lua_type(L, -1) == LUA_TFUNCTION || lua_type(L, -1) == LUA_TUSERDATA)) {
+					lua_pushfstring(L, "%s.%s", lua_tostring(L, -4), lua_tostring(L, -2));
+					addperm(L, perms, unperms);
+				}
+				lua_pop(L, 1);
+			}
+			lua_pushvalue(L, -2);
+			addperm(L, perms, unperms);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pushliteral(L, "_LOADED");
+	addperm(L, perms, unperms);
+	lua_pop(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, JNLUA_UNPERMS);
+	lua_setfield(L, LUA_REGISTRYINDEX, JNLUA_PERMS);
+}
+
+/*
+ * Adds the value below the top to the perms tables, named by the string on
+ * top, which is popped. A value with several names keeps the first.
+ */
+static void addperm (lua_State *L, int perms, int unperms) {
+	lua_pushvalue(L, -1);
+	lua_pushvalue(L, -3);
+	lua_rawset(L, unperms);
+	lua_pushvalue(L, -2);
+	if (lua_rawget(L, perms) == LUA_TNIL) {
+		lua_pushvalue(L, -3);
+		lua_pushvalue(L, -3);
+		lua_rawset(L, perms);
+	}
+	lua_pop(L, 2);
+}
+
+/*
+ * Records the baseline of a pooled state, which resets return the state to: a
+ * copy of every table reachable from the registry, through tables, metatables,
+ * upvalues and user values, along with their metatables and entry counts; the
+ * metatables of the basic types; the collector settings; and the number of
+ * objects with finalizers, counted after a collection. The perms tables are
+ * left out, as they make up most of the entries and can only be reached
+ * through the registry.
+ */
+static void snapshotstate (lua_State *L) {
+	int baseline, type;
+	
+	luaL_checkstack(L, 8, NULL);
+	lua_createtable(L, 0, 7);
+	baseline = lua_gettop(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, JNLUA_PERMS);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, baseline + 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, JNLUA_UNPERMS);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, baseline + 1);
+	lua_pushvalue(L, LUA_REGISTRYINDEX);
+	snapshotvalue(L, baseline + 1, -1);
+	lua_pop(L, 1);
+	lua_newtable(L);
+	for (type = LUA_TNIL; type <= LUA_TTHREAD; type++) {
+		if (type == LUA_TTABLE || type == LUA_TUSERDATA) {
+			continue;
+		}
+		pushtypesample(L, type);
+		if (lua_getmetatable(L, -1)) {
+			snapshotvalue(L, baseline + 1, -1);
+			lua_rawseti(L, baseline + 4, type);
+		}
+		lua_pop(L, 1);
+	}
+	lua_setfield(L, baseline, "types");
+	lua_setfield(L, baseline, "counts");
+	lua_setfield(L, baseline, "metatables");
+	lua_setfield(L, baseline, "tables");
+	lua_pushinteger(L, lua_gc(L, LUA_GCSETPAUSE, 0));
+	lua_gc(L, LUA_GCSETPAUSE, (int) lua_tointeger(L, -1));
+	lua_setfield(L, baseline, "pause");
+	lua_pushinteger(L, lua_gc(L, LUA_GCSETSTEPMUL, 0));
+	lua_gc(L, LUA_GCSETSTEPMUL, (int) lua_tointeger(L, -1));
+	lua_setfield(L, baseline, "stepmul");
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	lua_pushinteger(L, lua_gc(L, LUA_GCFINCOUNT, 0));
+	lua_setfield(L, baseline, "finalizers");
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &baseline_key);
+}
+
+/*
+ * Records a value of the baseline and what is reachable from it. Tables map
+ * to their copy in 'tables', and other values to true once visited.
+ * The metatables and the entry counts of the tables are kept in the two tables
+ * following 'tables' on the stack.
+ */
+static void snapshotvalue (lua_State *L, int tables, int index) {
+	lua_Integer count = 0;
+	int n;
+	
+	index = lua_absindex(L, index);
+	switch (lua_type(L, index)) {
+	case LUA_TTABLE:
+	case LUA_TFUNCTION:
+	case LUA_TUSERDATA:
+		break;
+	default:
+		return;
+	}
+	lua_pushvalue(L, index);
+	if (lua_rawget(L, tables) != LUA_TNIL) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	luaL_checkstack(L, 8, "baseline too deep");
+	lua_pushvalue(L, index);
+	switch (lua_type(L, index)) {
+	case LUA_TTABLE:
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_insert(L, -3);
+		lua_rawset(L, tables);
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, -5);
+			snapshotvalue(L, tables, -2);
+			snapshotvalue(L, tables, -1);
+			lua_pop(L, 1);
+			count++;
+		}
+		lua_pop(L, 1);
+		lua_pushvalue(L, index);
+		lua_pushinteger(L, count);
+		lua_rawset(L, tables + 2);
+		if (lua_getmetatable(L, index)) {
+			lua_pushvalue(L, index);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, tables + 1);
+			snapshotvalue(L, tables, -1);
+			lua_pop(L, 1);
+		}
+		break;
+	case LUA_TFUNCTION:
+		lua_pushboolean(L, 1);
+		lua_rawset(L, tables);
+		for (n = 1; lua_getupvalue(L, index, n) != NULL; n++) {
+			snapshotvalue(L, tables, -1);
+			lua_pop(L, 1);
+		}
+		break;
+	case LUA_TUSERDATA:
+		lua_pushboolean(L, 1);
+		lua_rawset(L, tables);
+		if (lua_getmetatable(L, index)) {
+			snapshotvalue(L, tables, -1);
+			lua_pop(L, 1);
+		}
+		lua_getuservalue(L, index);
+		snapshotvalue(L, tables, -1);
+		lua_pop(L, 1);
+		break;
+	}
+}
+
+/* Pushes a value of a basic type, for getting and setting its metatable. */
+static void pushtypesample (lua_State *L, int type) {
+	switch (type) {
+	case LUA_TBOOLEAN:
+		lua_pushboolean(L, 0);
+		break;
+	case LUA_TLIGHTUSERDATA:
+		lua_pushlightuserdata(L, NULL);
+		break;
+	case LUA_TNUMBER:
+		lua_pushinteger(L, 0);
+		break;
+	case LUA_TSTRING:
+		lua_pushliteral(L, "");
+		break;
+	case LUA_TFUNCTION:
+		lua_pushcfunction(L, resetstate_protected);
+		break;
+	case LUA_TTHREAD:
+		lua_pushthread(L);
+		break;
+	default:
+		lua_pushnil(L);
+	}
+}
+
+/*
+ * Resets a pooled state to its baseline. Everything created since becomes
+ * garbage, which is collected right away. The baseline is restored again
+ * after that to undo any changes made by finalizers. Finalizers run under the
+ * hook of the last user and share a budget of JNLUA_RESETBUDGET instructions,
+ * or what is left of the last user's budget if that is less. The hook and the
+ * budget are only cleared once the reset succeeded. A finalizer that fails or
+ * runs out of the budget, or that leaves objects to finalize behind (by
+ * setting a metatable with __gc again, for instance), fails the reset, so that
+ * the state gets closed rather than pooled. States that were not prepared for
+ * a pool have no baseline and cannot be reset.
+ */
+static int resetstate_protected (lua_State *L) {
+	lua_Integer budget;
+	
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &baseline_key) != LUA_TTABLE) {
+		return luaL_error(L, "no baseline");
+	}
+	lua_gc(L, LUA_GCSTOP, 0);
+	restorebaseline(L, 1);
+	budget = lua_cpuusage(L, LUA_CPUBUDGET, 0);
+	if (budget < 0 || budget > JNLUA_RESETBUDGET) {
+		lua_cpuusage(L, LUA_CPUSETBUDGET, JNLUA_RESETBUDGET);
+	}
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	restorebaseline(L, 1);
+	lua_getfield(L, 1, "finalizers");
+	if (lua_gc(L, LUA_GCFINCOUNT, 0) > lua_tointeger(L, -1)) {
+		return luaL_error(L, "objects left to finalize");
+	}
+	lua_pop(L, 1);
+	lua_sethook(L, NULL, 0, 0);
+	lua_cpuusage(L, LUA_CPUSETBUDGET, -1);
+	lua_cpuusage(L, LUA_CPUSETTIMING, 0);
+	lua_gc(L, LUA_GCRESTART, 0);
+	return 0;
+}
+
+/* Restores the baseline at an index. */
+static void restorebaseline (lua_State *L, int baseline) {
+	int tables, types, type;
+	
+	luaL_checkstack(L, 8, NULL);
+	lua_getfield(L, baseline, "tables");
+	tables = lua_gettop(L);
+	lua_getfield(L, baseline, "metatables");
+	lua_getfield(L, baseline, "counts");
+	lua_getfield(L, baseline, "types");
+	types = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, tables)) {
+		if (lua_type(L, -1) == LUA_TTABLE) {
+			restoretable(L, tables, lua_gettop(L) - 1, lua_gettop(L));
+		}
+		lua_pop(L, 1);
+	}
+	for (type = LUA_TNIL; type <= LUA_TTHREAD; type++) {
+		if (type == LUA_TTABLE || type == LUA_TUSERDATA) {
+			continue;
+		}
+		pushtypesample(L, type);
+		lua_rawgeti(L, types, type);
+		lua_setmetatable(L, -2);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 4);
+	lua_pushvalue(L, baseline);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &baseline_key);
+	lua_getfield(L, baseline, "pause");
+	lua_gc(L, LUA_GCSETPAUSE, (int) lua_tointeger(L, -1));
+	lua_getfield(L, baseline, "stepmul");
+	lua_gc(L, LUA_GCSETSTEPMUL, (int) lua_tointeger(L, -1));
+	lua_pop(L, 2);
+}
+
+/*
+ * Returns whether a table has the same contents as its copy, which has count
+ * entries. Most tables are left alone, and comparing them is cheaper than
+ * rewriting them.
+ */
+static int samecontents (lua_State *L, int t, int copy, lua_Integer count) {
+	lua_pushnil(L);
+	while (lua_next(L, t)) {
+		lua_pushvalue(L, -2);
+		lua_rawget(L, copy);
+		if (count-- == 0 || !lua_rawequal(L, -1, -2)) {
+			lua_pop(L, 3);
+			return 0;
+		}
+		lua_pop(L, 2);
+	}
+	return count == 0;
+}
+
+/*
+ * Restores the contents and the metatable of a table from its copy. The
+ * metatables and the entry counts of the baseline follow 'tables' on the
+ * stack.
+ */
+static void restoretable (lua_State *L, int tables, int t, int copy) {
+	lua_pushvalue(L, t);
+	lua_rawget(L, tables + 2);
+	if (!samecontents(L, t, copy, lua_tointeger(L, -1))) {
+		lua_pushnil(L);
+		while (lua_next(L, t)) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, t);
+		}
+		lua_pushnil(L);
+		while (lua_next(L, copy)) {
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, t);
+		}
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, t);
+	lua_rawget(L, tables + 1);
+	lua_setmetatable(L, t);
+}
+
+/*
+ * Collects what a clone copies from its template: a copy of every table in the
+ * perms with its metatable and entry count, as in a baseline, the metatables of
+ * the basic types, and the value to copy. Returns the perms and the result.
+ */
+static int clonesource_protected (lua_State *L) {
+	lua_Integer count;
+	int perms, source, type;
+	
+	luaL_checkstack(L, 8, NULL);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, JNLUA_PERMS) != LUA_TTABLE) {
+		return luaL_error(L, "no perms");
+	}
+	perms = lua_gettop(L);
+	lua_createtable(L, 0, 5);
+	source = lua_gettop(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushnil(L);
+	while (lua_next(L, perms)) {
+		lua_pop(L, 1);
+		if (lua_type(L, -1) != LUA_TTABLE) {
+			continue;
+		}
+		count = 0;
+		lua_pushvalue(L, -1);
+		lua_newtable(L);
+		lua_pushnil(L);
+		while (lua_next(L, -3)) {
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -4);
+			count++;
+		}
+		lua_rawset(L, source + 1);
+		lua_pushvalue(L, -1);
+		lua_pushinteger(L, count);
+		lua_rawset(L, source + 3);
+		if (lua_getmetatable(L, -1)) {
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, source + 2);
+		}
+	}
+	lua_newtable(L);
+	for (type = LUA_TNIL; type <= LUA_TTHREAD; type++) {
+		if (type == LUA_TTABLE || type == LUA_TUSERDATA) {
+			continue;
+		}
+		pushtypesample(L, type);
+		if (lua_getmetatable(L, -1)) {
+			lua_rawseti(L, source + 4, type);
+		}
+		lua_pop(L, 1);
+	}
+	lua_setfield(L, source, "types");
+	lua_setfield(L, source, "counts");
+	lua_setfield(L, source, "metatables");
+	lua_setfield(L, source, "tables");
+	lua_pushvalue(L, 1);
+	lua_setfield(L, source, "value");
+	return 2;
+}
+
+/*
+ * Copies what clonesource_protected() collected in the template into a state
+ * and restores its tables from the copy like a baseline. States that are not
+ * pooled get their perms tables built first.
+ */
+static int clonestate_protected (lua_State *L) {
+	lua_State *F = (lua_State *) lua_touserdata(L, 1);
+	int tables, types, type;
+	
+	lua_pop(L, 1);
+	luaL_checkstack(L, 8, NULL);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, JNLUA_UNPERMS) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		buildperms(L);
+		lua_getfield(L, LUA_REGISTRYINDEX, JNLUA_UNPERMS);
+	}
+	eris_clone(L, 1, F, -2, -1);
+	lua_getfield(L, 2, "tables");
+	tables = lua_gettop(L);
+	lua_getfield(L, 2, "metatables");
+	lua_getfield(L, 2, "counts");
+	lua_getfield(L, 2, "types");
+	types = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, tables)) {
+		restoretable(L, tables, lua_gettop(L) - 1, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	for (type = LUA_TNIL; type <= LUA_TTHREAD; type++) {
+		if (type == LUA_TTABLE || type == LUA_TUSERDATA) {
+			continue;
+		}
+		pushtypesample(L, type);
+		lua_rawgeti(L, types, type);
+		lua_setmetatable(L, -2);
+		lua_pop(L, 1);
+	}
+	lua_getfield(L, 2, "value");
+	return 1;
+}
+
 /* ---- Stream adapters ---- */
+/*
+ * Loads a chunk from a Java input stream. If the length of the chunk is known,
+ * it is read completely and passed to Lua in one piece, otherwise it is read
+ * in pieces the size of the load buffer.
+ */
+static void load (JNIEnv *env, lua_State *L, jobject inputStream, jint length, jstring chunkname, jstring mode) {
+	const char *chunkname_utf = NULL, *mode_utf = NULL;
+	Stream stream = { inputStream, NULL, NULL, 0, length };
+	LoadBuffer *lb = NULL;
+	jsize size;
+	int status;
+	
+	if (checknotnull(inputStream)
+			&& (chunkname_utf = getstringchars(env, chunkname))
+			&& (mode_utf = getstringchars(env, mode))
+			&& (lb = getloadbuffer(L))) {
+		size = length > 0 ? length : (lb->limit > 0 ? lb->limit : JNLUA_LOADBUFFERSIZE);
+		if ((stream.byte_array = acquireloadbuffer(env, lb, size))) {
+			status = lua_load(L, readhandler, &stream, chunkname_utf, mode_utf);
+			if (status != LUA_OK) {
+				throw(L, status);
+			}
+		}
+	}
+	if (stream.bytes) {
+		(*env)->ReleaseByteArrayElements(env, stream.byte_array, stream.bytes, JNI_ABORT);
+	}
+	if (stream.byte_array) {
+		releaseloadbuffer(env, lb, stream.byte_array);
+	}
+	if (chunkname_utf) {
+		releasestringchars(env, chunkname, chunkname_utf);
+	}
+	if (mode_utf) {
+		releasestringchars(env, mode, mode_utf);
+	}
+}
+
+/* Creates the load buffer of a state. */
+static int newloadbuffer_protected (lua_State *L) {
+	LoadBuffer *lb;
+	
+	lb = (LoadBuffer *) lua_newuserdata(L, sizeof(LoadBuffer));
+	lb->byte_array = NULL;
+	lb->capacity = 0;
+	lb->limit = JNLUA_LOADBUFFERSIZE;
+	lb->busy = 0;
+	if (luaL_newmetatable(L, JNLUA_LOADBUFFER)) {
+		lua_pushcfunction(L, gcloadbuffer);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &loadbuffer_key);
+	return 1;
+}
+
+/* Returns the load buffer of a state, creating it on first use. */
+static LoadBuffer *getloadbuffer (lua_State *L) {
+	LoadBuffer *lb;
+	int status;
+	
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &loadbuffer_key);
+	lb = (LoadBuffer *) lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (!lb) {
+		lua_pushcfunction(L, newloadbuffer_protected);
+		status = lua_pcall(L, 0, 1, 0);
+		if (status != LUA_OK) {
+			throw(L, status);
+			return NULL;
+		}
+		lb = (LoadBuffer *) lua_touserdata(L, -1);
+		lua_pop(L, 1);
+	}
+	return lb;
+}
+
+/*
+ * Returns a Java array of at least size bytes for loading. This is the cached
+ * array of the state unless an outer load is using it or size is beyond the
+ * configured limit, in which case it is a new local array.
+ */
+static jbyteArray acquireloadbuffer (JNIEnv *env, LoadBuffer *lb, jsize size) {
+	jbyteArray array;
+	
+	if (lb->busy || size > lb->limit) {
+		return newbytearray(env, size);
+	}
+	if (lb->capacity < size) {
+		if (!(array = newbytearray(env, size))) {
+			return NULL;
+		}
+		if (lb->byte_array) {
+			(*env)->DeleteGlobalRef(env, lb->byte_array);
+		}
+		lb->byte_array = (*env)->NewGlobalRef(env, array);
+		lb->capacity = lb->byte_array ? size : 0;
+		(*env)->DeleteLocalRef(env, array);
+		if (!check(lb->byte_array != NULL, luamemoryallocationexception_class, "JNI error: NewGlobalRef() failed")) {
+			return NULL;
+		}
+	}
+	lb->busy = 1;
+	return lb->byte_array;
+}
+
+/* Releases an array returned by acquireloadbuffer(). */
+static void releaseloadbuffer (JNIEnv *env, LoadBuffer *lb, jbyteArray array) {
+	if (array != lb->byte_array) {
+		(*env)->DeleteLocalRef(env, array);
+		return;
+	}
+	lb->busy = 0;
+	if (lb->capacity > lb->limit) {
+		(*env)->DeleteGlobalRef(env, lb->byte_array);
+		lb->byte_array = NULL;
+		lb->capacity = 0;
+	}
+}
+
+/* Finalizes load buffers. */
+static int gcloadbuffer (lua_State *L) {
+	JNIEnv *thread_env = getthreadenv();
+	LoadBuffer *lb;
+	
+	if (!thread_env) {
+		/* Environment has been cleared as the Java VM was destroyed. Nothing to do. */
+		return 0;
+	}
+	lb = (LoadBuffer *) lua_touserdata(L, 1);
+	if (lb->byte_array) {
+		(*thread_env)->DeleteGlobalRef(thread_env, lb->byte_array);
+		lb->byte_array = NULL;
+	}
+	return 0;
+}
+
 /* Lua reader for Java input streams. */
 static const char *readhandler (lua_State *L, void *ud, size_t *size) {
 	JNIEnv *thread_env = getthreadenv();
 	Stream *stream;
-	int read;
+	int read, n;
 
 	stream = (Stream *) ud;
-	read = (*thread_env)->CallIntMethod(thread_env, stream->stream, read_id, stream->byte_array);
-	if ((*thread_env)->ExceptionCheck(thread_env)) {
+	if (stream->chunk < 0) {
 		return NULL;
 	}
-	if (read == -1) {
+	if (stream->chunk > 0) {
+		/* Read the whole chunk, the stream may return it in pieces */
+		read = 0;
+		while (read < stream->chunk) {
+			n = (*thread_env)->CallIntMethod(thread_env, stream->stream, readrange_id, stream->byte_array, read, stream->chunk - read);
+			if ((*thread_env)->ExceptionCheck(thread_env)) {
+				return NULL;
+			}
+			if (n <= 0) {
+				break;
+			}
+			read += n;
+		}
+		stream->chunk = -1;
+	} else {
+		read = (*thread_env)->CallIntMethod(thread_env, stream->stream, read_id, stream->byte_array);
+		if ((*thread_env)->ExceptionCheck(thread_env)) {
+			return NULL;
+		}
+	}
+	if (read <= 0) {
 		return NULL;
 	}
 	if (stream->bytes && stream->is_copy) {
@@ -0,0 +1,54 @@
+-- Times numeric for-loops compiled to OP_FORIPREP/OP_FORILOOP (integer
+-- constant start and step) and to OP_FORPREP/OP_FORLOOP (everything else).
+-- Each case runs a few times and the best time is reported.
+-- Run from test/ with the runner that 'make check' in eris/ builds:
+-- ./runner bench/forloop.lua [n]
+
+local n = tonumber(arg and arg[1]) or 20000000
+local rounds = 5
+
+local cases = {
+  {"empty integer loop", function(n)
+    for i = 1, n do end
+  end},
+  {"empty float loop", function(n)
+    for x = 1.0, n do end
+  end},
+  {"integer sum", function(n)
+    local s = 0
+    for i = 1, n do s = s + i end
+    return s
+  end},
+  {"integer sum, variable start", function(n)
+    local s, first = 0, 1
+    for i = first, n do s = s + i end
+    return s
+  end},
+  {"nested integer loops", function(n)
+    local s = 0
+    for i = 1, n // 1000 do
+      for j = 1, 1000 do s = s + j end
+    end
+    return s
+  end},
+  {"array fill and read", function(n)
+    local t, s = {}, 0
+    for i = 1, n // 10 do t[i] = i end
+    for _ = 1, 10 do
+      for i = 1, #t do s = s + t[i] end
+    end
+    return s
+  end},
+}
+
+for _, case in ipairs(cases) do
+  local name, f = case[1], case[2]
+  local best = math.huge
+  for _ = 1, rounds do
+    local start = os.clock()
+    f(n)
+    best = math.min(best, os.clock() - start)
+  end
+  print(string.format("%-28s %8.1f ms %8.2f ns/iter", name, best * 1000,
+                      best * 1e9 / n))
+end
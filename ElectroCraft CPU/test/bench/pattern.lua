@@ -0,0 +1,66 @@
+-- Times string.find, match, gmatch and gsub with the patterns reused from the
+-- pattern cache, and with more distinct patterns than the cache holds, so that
+-- every call compiles its pattern again. Each case runs a few times and the
+-- best time is reported.
+-- Run from test/ with the runner that 'make check' in eris/ builds:
+-- ./runner bench/pattern.lua [n]
+
+local n = tonumber(arg and arg[1]) or 60000
+local rounds = 7
+
+-- 32-byte lines of a config-like file.
+local lines = {}
+for i = 1, 64 do
+  lines[i] = string.format("%-31s", string.format("  key_%d = value%d -- c", i,
+                                                   i * 7))
+end
+
+local patterns = {
+  "[=%-][^=%-]",
+  "%-%-%s*(%a+)",
+  "^%s*(.-)%s*$",
+  "^%s*(%w+)%s*=%s*([%w_]+)",
+  "%d+",
+  "[%a_][%w_]*",
+}
+
+-- More patterns than PATTCACHESIZE in lstrlib.c, used round robin.
+local distinct = {}
+for i = 1, 64 do
+  distinct[i] = "key_" .. i .. "%s*=%s*(%w+)"
+end
+
+local function bench(name, f)
+  local best = math.huge
+  for _ = 1, rounds do
+    local start = os.clock()
+    f()
+    best = math.min(best, os.clock() - start)
+  end
+  print(string.format("%-36s %8.4f s", name, best))
+end
+
+for _, p in ipairs(patterns) do
+  bench("find " .. p, function()
+    for i = 1, n do string.find(lines[i % 64 + 1], p) end
+  end)
+end
+
+bench("match, cached", function()
+  for i = 1, n do string.match(lines[i % 64 + 1], patterns[4]) end
+end)
+bench("match, distinct patterns", function()
+  for i = 1, n do string.match(lines[i % 64 + 1], distinct[i % 64 + 1]) end
+end)
+bench("gmatch %w+", function()
+  for i = 1, n // 8 do
+    for _ in string.gmatch(lines[i % 64 + 1], "%w+") do end
+  end
+end)
+bench("gsub %s+", function()
+  for i = 1, n do string.gsub(lines[i % 64 + 1], "%s+", " ") end
+end)
+bench("gsub with function", function()
+  local function upper(s) return s:upper() end
+  for i = 1, n do string.gsub(lines[i % 64 + 1], "%a+", upper) end
+end)
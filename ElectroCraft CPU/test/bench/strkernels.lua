@@ -0,0 +1,74 @@
+-- Times the string functions that use the vectorized kernels of lstrlib.c:
+-- plain substring search, scans over character classes and sets, and case
+-- conversion, on long strings and on short ones. To see what the kernels
+-- gain, compare against an interpreter built with -DLUA_NOVECTOR.
+-- Run from test/ with the runner that 'make check' in eris/ builds:
+-- ./runner bench/strkernels.lua [n]
+
+local n = tonumber(arg and arg[1]) or 200
+local rounds = 7
+
+-- 1 MiB of lower case text with spaces, and the same with a digit at the end.
+local words = {}
+for i = 1, 4096 do
+  words[i] = string.rep(string.char(97 + i % 26), 1 + i % 9)
+end
+local text = table.concat(words, " ")
+text = string.rep(text, math.ceil(1048576 / #text)):sub(1, 1048576)
+local tail = text:sub(1, -8) .. "needle1"
+local mixed = text:upper():sub(1, 524288) .. text:sub(524289)
+local short = text:sub(1, 64)
+
+local function bench(name, f)
+  local best = math.huge
+  for _ = 1, rounds do
+    local start = os.clock()
+    f()
+    best = math.min(best, os.clock() - start)
+  end
+  print(string.format("%-36s %8.4f s", name, best))
+end
+
+local function check(v)
+  assert(v, "benchmark lost its match")
+end
+
+bench("find plain, needle at end", function()
+  for _ = 1, n do check(tail:find("needle", 1, true)) end
+end)
+
+bench("find plain, frequent first char", function()
+  for _ = 1, n do check(tail:find("aneedle", 1, true) == nil) end
+end)
+
+bench("find no specials, needle at end", function()
+  for _ = 1, n do check(tail:find("needle1")) end
+end)
+
+bench("find %d", function()
+  for _ = 1, n do check(tail:find("%d")) end
+end)
+
+bench("find [^%a%s]", function()
+  for _ = 1, n do check(tail:find("[^%a%s]")) end
+end)
+
+bench("match ^[%a ]*", function()
+  for _ = 1, n do check(#text:match("^[%a ]*") == #text) end
+end)
+
+bench("upper", function()
+  for _ = 1, n do check(#text:upper() == #text) end
+end)
+
+bench("lower, half upper case", function()
+  for _ = 1, n do check(#mixed:lower() == #mixed) end
+end)
+
+bench("upper, 64 bytes", function()
+  for _ = 1, n * 1024 do check(#short:upper() == 64) end
+end)
+
+bench("find plain, 64 bytes", function()
+  for _ = 1, n * 1024 do check(short:find("zz", 1, true) == nil) end
+end)
@@ -0,0 +1,214 @@
+-- Runs functions as coroutines with an instruction budget of one, so that
+-- they yield for their budget before every instruction, and checks that
+-- they give the same results as without a budget. Resumes after such yields
+-- pass values that must be dropped, and the second pass also persists each
+-- suspended coroutine with Eris.
+-- Run by 'make check' in eris/, or alone from test/: ./runner budget.lua
+
+-- Suspended coroutines may hold any library function in their registers.
+local perms, uperms = {[_ENV] = "_ENV"}, {_ENV = _ENV}
+local function addperm(value, name)
+  if perms[value] == nil then
+    perms[value], uperms[name] = name, value
+  end
+end
+for libname, lib in pairs(package.loaded) do
+  if type(lib) == "table" then
+    for k, v in pairs(lib) do
+      if type(v) == "function" then addperm(v, libname .. "." .. k) end
+    end
+  end
+end
+addperm(ipairs({}), "ipairs iterator")
+
+local function roundtrip(value)
+  return eris.unpersist(uperms, eris.persist(perms, value))
+end
+
+local function id(...) return ... end
+
+-- Each case gets the arguments "a", 2, nil, 4. Several of them leave values
+-- on the stack up to the top for the next instruction (calls with multiple
+-- results as the last argument, varargs, table constructors), where values
+-- passed to a resume after a budget yield would show up.
+local cases = {
+  varargs = function(...)
+    local t = {...}
+    return select("#", ...), #t, ...
+  end,
+  multret = function(...)
+    local t = {id(id(1, 2, 3))}
+    return id(...), #t, id(id(...))
+  end,
+  setlist = function()
+    local t = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+               19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+               35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50,
+               51, 52, 53, 54, id(55, 56, 57)}
+    return #t, t[50], t[57], table.unpack(t, 52)
+  end,
+  tailcall = function()
+    local function sum(n, acc)
+      if n == 0 then return acc, n end
+      return sum(n - 1, acc + n)
+    end
+    return sum(20, 0)
+  end,
+  arith = function(a, b)
+    local x, y = 7, 2.5
+    return a .. b .. x, x // b, x % 3, y * b - x / 4, x & 5 | 8 ~ 3, ~x,
+           x << b, -y, x < y, x <= 7, a == "a", "z" > a, #a
+  end,
+  loops = function()
+    local acc = {}
+    for i = 1, 5 do acc[#acc + 1] = i end
+    for i = 10, 1, -3 do acc[#acc + 1] = i end
+    for i = 0.5, 2, 0.5 do acc[#acc + 1] = i end
+    for i, v in ipairs({"x", "y", "z"}) do acc[#acc + 1] = v .. i end
+    local n = 0
+    while n < 3 do n = n + 1 end
+    repeat n = n - 1 until n == 0
+    return table.concat(acc, ","), n
+  end,
+  closures = function()
+    local fs = {}
+    for i = 1, 3 do
+      local j = i * 10
+      fs[i] = function(k) j = j + k return j end
+    end
+    return fs[1](1), fs[2](2), fs[3](3), fs[1](4)
+  end,
+  metamethods = function()
+    local mt = {}
+    mt.__index = function(t, k) return k * 2 end
+    mt.__add = function(a, b) return "add" end
+    mt.__concat = function(a, b) return "concat" end
+    mt.__lt = function(a, b) return true end
+    mt.__call = function(self, ...) return select("#", ...), ... end
+    local o = setmetatable({}, mt)
+    return o[21], o + 1, o .. "x", o < o, o(id(1, 2, 3))
+  end,
+  pcalls = function()
+    local ok1, e1 = pcall(error, "plain")
+    local ok2, e2 = pcall(function() local t = nil; return t.x end)
+    local ok3, v3, w3 = pcall(id, id(5, 6))
+    return ok1, e1, ok2, e2 ~= nil, ok3, v3, w3
+  end,
+  yields = function(a)
+    local acc = a
+    for i = 1, 3 do
+      local x, y = coroutine.yield(i, i * 2)
+      acc = acc .. x .. y
+    end
+    coroutine.yield()  -- a yield without values, unlike a budget yield
+    local r = {coroutine.yield(id(7, 8, 9))}
+    return acc, #r, table.unpack(r)
+  end,
+}
+
+-- Turns results into a string to compare them.
+local function dump(t)
+  local out = {}
+  for i = 1, t.n do
+    out[i] = math.type(t[i]) == "float" and string.format("%.17g", t[i])
+             or tostring(t[i])
+  end
+  return table.concat(out, " ")
+end
+
+-- A budget that is never used up.
+local unlimited = 1 << 40
+
+-- Runs 'f' until it returns and records what it yields and returns. With
+-- 'budget', returns the number of budget yields, otherwise the number of
+-- instructions executed.
+local function run(f, budget, persist)
+  local co = coroutine.create(f)
+  local log, nbudget, nyield = {}, 0, 0
+  debug.setbudget(co, budget and 1 or unlimited)
+  local res = table.pack(coroutine.resume(co, "a", 2, nil, 4))
+  while true do
+    assert(res[1], res[2])
+    if coroutine.status(co) == "dead" then
+      log[#log + 1] = "return " .. dump(res)
+      if not budget then
+        return table.concat(log, "\n"), unlimited - debug.getbudget(co)
+      end
+      return table.concat(log, "\n"), nbudget
+    elseif coroutine.outofbudget(co) then
+      assert(budget and res.n == 1, "budget yield with values")
+      nbudget = nbudget + 1
+      if persist then
+        co = roundtrip(co)  -- budgets are not persisted
+      else
+        assert(debug.getbudget(co) == 0)
+      end
+      assert(coroutine.outofbudget(co))
+      debug.setbudget(co, 1)
+      res = table.pack(coroutine.resume(co, "junk", "junk", "junk"))
+    else
+      log[#log + 1] = "yield " .. dump(res)
+      nyield = nyield + 1
+      res = table.pack(coroutine.resume(co, "r" .. nyield, nyield))
+    end
+  end
+end
+
+local names = {}
+for name in pairs(cases) do names[#names + 1] = name end
+table.sort(names)
+
+for _, name in ipairs(names) do
+  local expected, ninstr = run(cases[name], false, false)
+  local got, n = run(cases[name], true, false)
+  assert(got == expected, name .. ":\n" .. got .. "\nexpected:\n" .. expected)
+  -- A yield before each instruction but the first. After a yield in a
+  -- comparison metamethod, the jump that follows the comparison runs as an
+  -- instruction of its own, so there may be more.
+  assert(n >= ninstr - 1, name .. ": not one yield per instruction")
+  local persisted, m = run(cases[name], true, true)
+  assert(persisted == expected,
+         name .. " (persisted):\n" .. persisted .. "\nexpected:\n" .. expected)
+  assert(m == n, name .. ": persisting changed the number of budget yields")
+end
+
+-- Real yields without values are not budget yields.
+local co = coroutine.create(function() coroutine.yield() end)
+assert(coroutine.resume(co))
+assert(not coroutine.outofbudget(co))
+assert(coroutine.resume(co))
+assert(not coroutine.outofbudget(co))
+
+-- Without a yieldable thread running out of the budget is an error.
+co = coroutine.create(function()
+  return table.concat({string.gsub("abc", "%w", function(c)
+    local t = {}
+    for i = 1, 100 do t[i] = c end
+    return t[1]
+  end)}, ",")
+end)
+debug.setbudget(co, 50)
+local ok, err = coroutine.resume(co)
+assert(not ok and err:find("instruction budget exceeded"))
+
+-- A throttled coroutine cannot lift its own budget, nor the one of a thread
+-- waiting for it.
+local main = coroutine.running()
+co = coroutine.create(function()
+  assert(not pcall(debug.setbudget, coroutine.running(), -1))
+  assert(not pcall(debug.setbudget, -1))
+  local inner = coroutine.create(function()
+    return pcall(debug.setbudget, main, -1)
+  end)
+  assert(select(2, coroutine.resume(inner)) == false)
+  for _ = 1, 1e6 do end
+  return "done"
+end)
+debug.setbudget(co, 100)
+ok, err = coroutine.resume(co)
+assert(ok and err == nil and coroutine.outofbudget(co))
+assert(debug.setbudget(co, -1) == 0)
+ok, err = coroutine.resume(co)
+assert(ok and err == "done" and not coroutine.outofbudget(co))
+
+print("OK")
@@ -0,0 +1,118 @@
+-- Checks numeric for-loops, in particular those compiled to OP_FORIPREP and
+-- OP_FORILOOP (integer initial value and step), across persisting and
+-- unpersisting suspended coroutines with Eris.
+-- Run by 'make check' in eris/, or alone from test/: ./runner forloop.lua
+
+local perms = {[_ENV] = "_ENV", [coroutine.yield] = "yield"}
+local uperms = {_ENV = _ENV, yield = coroutine.yield}
+
+local function roundtrip(value)
+  return eris.unpersist(uperms, eris.persist(perms, value))
+end
+
+-- Each loop yields its control variable, at least once if n > 0 unless it is
+-- the empty one. All but the last loop start at an integer constant and count
+-- with an integer constant step, so they use OP_FORIPREP and OP_FORILOOP.
+local loops = {
+  ascending = function(n) for i = 1, n do coroutine.yield(i) end end,
+  descending = function(n) for i = 5, 6 - n, -1 do coroutine.yield(i) end end,
+  stepped = function(n) for i = -3, 3 * n - 4, 3 do coroutine.yield(i) end end,
+  floatlimit = function(n) for i = 1, n + 0.5 do coroutine.yield(i) end end,
+  empty = function(n) for i = 1, -n do coroutine.yield(i) end end,
+  nested = function(n)
+    for i = 1, n do
+      for j = 2, 1, -1 do coroutine.yield(i * 100 + j) end
+    end
+  end,
+  nearmax = function(n)
+    for i = 9223372036854775800, 9223372036854775799 + n do
+      coroutine.yield(i)
+    end
+  end,
+  nearmin = function(n)
+    for i = -9223372036854775800, -9223372036854775799 - n, -1 do
+      coroutine.yield(i)
+    end
+  end,
+  float = function(n) for x = 0.5, n, 0.5 do coroutine.yield(x) end end,
+}
+
+-- Resumes a coroutine until it is dead and returns the values it yielded.
+local function drain(co, ...)
+  local values = {}
+  local ok, v = coroutine.resume(co, ...)
+  while true do
+    assert(ok, v)
+    if coroutine.status(co) == "dead" then
+      return values
+    end
+    values[#values + 1] = v
+    ok, v = coroutine.resume(co)
+  end
+end
+
+local function check(name, loop, n)
+  local expected = drain(coroutine.create(loop), n)
+  -- Persist the coroutine after every number of yields, and check that both
+  -- the original and the copy go through the rest of the loop unchanged.
+  for yields = 1, #expected do
+    local co = coroutine.create(loop)
+    assert(coroutine.resume(co, n))
+    for _ = 2, yields do
+      assert(coroutine.resume(co))
+    end
+    local copy = roundtrip(co)
+    local rest, restcopy = drain(co), drain(copy)
+    assert(#rest == #expected - yields, name)
+    assert(#restcopy == #rest, name)
+    for i = 1, #rest do
+      assert(rest[i] == expected[yields + i], name)
+      assert(restcopy[i] == rest[i], name)
+      assert(math.type(restcopy[i]) == math.type(rest[i]), name)
+    end
+  end
+  return #expected
+end
+
+for name, loop in pairs(loops) do
+  for _, n in ipairs{0, 1, 2, 5} do
+    local count = check(name, loop, n)
+    assert((count == 0) == (n == 0 or name == "empty"), name)
+  end
+end
+
+-- Integer loops keep integer control variables, float loops float ones.
+for i = 1, 3 do assert(math.type(i) == "integer") end
+for i = 1, 3.5 do assert(math.type(i) == "integer") end
+for i = 1.0, 3 do assert(math.type(i) == "float") end
+
+-- Replacing the hidden index of an integer loop with debug.setlocal must not
+-- leave a value with a wrong tag behind for the collector.
+local function setindex(value)
+  for l = 1, math.huge do
+    local name = debug.getlocal(2, l)
+    if name == "(for index)" then
+      debug.setlocal(2, l, value)
+      return
+    end
+  end
+end
+local count = 0
+for i = 10, 1, -1 do
+  count = count + 1
+  if count == 2 then setindex({}) end
+  if count == 3 then collectgarbage() break end
+end
+assert(count == 3)
+
+-- Functions with integer loops survive persisting and string.dump.
+local function sum(n)
+  local s = 0
+  for i = 1, n do s = s + i end
+  for i = n, 1, -2 do s = s - i end
+  return s
+end
+assert(roundtrip(sum)(100) == sum(100))
+assert(load(string.dump(sum))(100) == sum(100))
+
+print("OK")
@@ -0,0 +1,94 @@
+-- Checks string.packarray and string.unpackarray against string.pack and
+-- string.unpack, their errors, and the persistence of format handles.
+-- Run by 'make check' in eris/, or alone from test/: ./runner packarray.lua
+
+local function eq(a, b, msg)
+  if a ~= b then
+    error((msg or "") .. ": " .. tostring(a) .. " ~= " .. tostring(b), 2)
+  end
+end
+
+-- Packs 't[i]' to 't[j]' with one string.pack per 'k' values.
+local function concatpack(fmt, t, i, j, k)
+  local out = {}
+  for x = i, j, k do
+    out[#out + 1] = string.pack(fmt, table.unpack(t, x, x + k - 1))
+  end
+  return table.concat(out)
+end
+
+math.randomseed(7)
+
+-- Formats, the number of values per record, and a generator for the values.
+local fmts = {
+  {"<i4", 1, function() return math.random(-2^31, 2^31 - 1) end},
+  {">I2", 1, function() return math.random(0, 65535) end},
+  {"=j", 1, function() return math.random(-2^40, 2^40) * 7919 end},
+  {"<d", 1, function() return math.random() * 1e6 end},
+  {">f", 1, function() return 1.5 end},
+  {"!<b i4 x h", 3, function() return math.random(-128, 127) end},
+  {"<i3 B c3", 3, function(k)
+    if k % 3 == 0 then return "abc" end
+    return math.random(0, 255)
+  end},
+  {"<i16", 1, function() return math.random(-2^40, 2^40) * 7919 end},
+  {">!8 b Xd d", 2, function(k) return k % 2 == 1 and 3 or 2.25 end},
+  {"<" .. ("i2"):rep(20), 20, function() return math.random(-300, 300) end},
+}
+
+for _, f in ipairs(fmts) do
+  local fmt, k, gen = f[1], f[2], f[3]
+  local t = {}
+  for x = 1, k * 50 do t[x] = gen(x) end
+  local h = string.packformat(fmt)
+  local s1 = concatpack(fmt, t, 1, #t, k)
+  eq(string.packarray(fmt, t), s1, fmt)
+  eq(string.packarray(h, t), s1, fmt .. " handle")
+  eq(string.packarray(fmt, t, k + 1, 3 * k),
+     concatpack(fmt, t, k + 1, 3 * k, k), fmt .. " range")
+  local u, nextpos = string.unpackarray(h, s1)
+  eq(#u, #t, fmt .. " count")
+  eq(nextpos, #s1 + 1, fmt .. " position")
+  for x = 1, #t do
+    eq(u[x], t[x], fmt .. " value " .. x)
+  end
+  local rs = #string.pack(fmt, table.unpack(t, 1, k))
+  local u2, p2 = string.unpackarray(fmt, "xx" .. s1, 3, 2)
+  eq(#u2, 2 * k, fmt .. " partial count")
+  eq(p2, 3 + 2 * rs, fmt .. " partial position")
+  eq(u2[1], u[1], fmt .. " partial value")
+end
+
+eq(string.packarray("i4", {}), "")
+eq(#string.unpackarray("i4", ""), 0)
+
+local function err(f, ...)
+  local ok, e = pcall(f, ...)
+  assert(not ok, "expected an error")
+  return e
+end
+
+assert(err(string.packarray, "i4", {1, "x"}):find("invalid value %(string%) at index 2"))
+assert(err(string.packarray, "i1", {1, 200}):find("at index 2"))
+assert(err(string.packarray, "i4", {1.5}):find("at index 1"))
+assert(err(string.packarray, "c2", {"abc"}):find("at index 1"))
+assert(err(string.packarray, "i4 i4", {1, 2, 3}):find("multiple"))
+assert(err(string.packarray, "s4", {"x"}):find("variable%-length"))
+assert(err(string.packarray, "x", {}):find("no values"))
+assert(err(string.unpackarray, "i4", "abcdefg", 1, 2):find("too short"))
+assert(err(string.unpackarray, "i4", "abcd", 6):find("out of string"))
+assert(err(string.packformat, "i17"):find("out of limits"))
+
+-- Records of zero bytes used to divide by zero.
+assert(err(string.packarray, "c0", {""}):find("empty records"))
+assert(err(string.unpackarray, "c0", "abc"):find("empty records"))
+assert(err(string.packformat, "c0 c0"):find("empty records"))
+
+eq(tostring(string.packformat("<i4")), "packformat (<i4)")
+
+-- Handles are persisted as their format string.
+local h = string.packformat("<i2 i2")
+local h2 = eris.unpersist(eris.persist(h))
+eq(string.packarray(h2, {1, 2, 3, 4}), string.pack("<i2 i2 i2 i2", 1, 2, 3, 4))
+
+print("OK")
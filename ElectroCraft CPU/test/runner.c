@@ -0,0 +1,57 @@
+/*
+** runner, runs the Lua test scripts in this directory and its benchmarks.
+** Unlike a full interpreter, it takes one script and its arguments only.
+** See Copyright Notice in lua.h
+*/
+
+#define runner_c
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define PROGNAME "runner"
+
+static int
+traceback(lua_State *L) {
+  const char *msg = lua_tostring(L, 1);
+  if (msg == NULL)
+    msg = lua_pushfstring(L, "(error object is a %s value)",
+                          luaL_typename(L, 1));
+  luaL_traceback(L, L, msg, 1);
+  return 1;
+}
+
+int
+main(int argc, char **argv) {
+  lua_State *L;
+  int i, status;
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s script.lua [args]\n", PROGNAME);
+    return EXIT_FAILURE;
+  }
+  L = luaL_newstate();
+  if (L == NULL) {
+    fprintf(stderr, "%s: cannot create state: not enough memory\n", PROGNAME);
+    return EXIT_FAILURE;
+  }
+  luaL_openlibs(L);
+  /* arg[0] is the script, arg[1]... its arguments, as with lua.c */
+  lua_createtable(L, argc - 2, 1);
+  for (i = 1; i < argc; ++i) {
+    lua_pushstring(L, argv[i]);
+    lua_rawseti(L, -2, i - 1);
+  }
+  lua_setglobal(L, "arg");
+  lua_pushcfunction(L, traceback);
+  status = luaL_loadfile(L, argv[1]);
+  if (status == LUA_OK)
+    status = lua_pcall(L, 0, 0, 1);
+  if (status != LUA_OK)
+    fprintf(stderr, "%s: %s\n", PROGNAME, lua_tostring(L, -1));
+  lua_close(L);
+  return status == LUA_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
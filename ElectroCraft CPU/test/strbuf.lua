@@ -0,0 +1,40 @@
+-- Checks the strbuf library, in particular that the contents of builders are
+-- memory of the collector and survive persisting.
+-- Run by 'make check' in eris/, or alone from test/: ./runner strbuf.lua
+
+-- Garbage builders count as memory in use until they are collected.
+collectgarbage()
+collectgarbage("stop")
+local before = collectgarbage("count")
+for _ = 1, 200 do strbuf.new(65536) end
+assert(collectgarbage("count") - before >= 200 * 64)
+collectgarbage("restart")
+collectgarbage()
+assert(collectgarbage("count") < before + 64)
+
+-- Growing keeps the contents and the identity of the builder.
+local b = strbuf.new("ab")
+local parts = {"ab"}
+for i = 1, 1000 do
+  assert(b:append("x", i) == b)
+  parts[#parts + 1] = "x" .. i
+end
+assert(tostring(b) == table.concat(parts) and #b == #tostring(b))
+assert(b:appendf("%d-%s", 7, "y") == b)
+assert(tostring(b):sub(-3) == "7-y")
+
+-- Clearing and reserving.
+assert(b:clear() == b and #b == 0 and b:capacity() > 0)
+assert(b:clear(true) == b and b:capacity() == 0 and tostring(b) == "")
+b:append("q")
+assert(b:capacity(100) == 100 and tostring(b) == "q")
+assert(strbuf.new(10):capacity() == 10)
+assert(not pcall(strbuf.new, -1))
+
+-- Persisted builders come back with their contents.
+local copy = eris.unpersist({}, eris.persist({}, b))
+assert(tostring(copy) == "q" and copy ~= b)
+copy:append("r")
+assert(tostring(copy) == "qr" and tostring(b) == "q")
+
+print("OK")
@@ -0,0 +1,228 @@
+/*
+** eris-stat, prints statistics about persisted Eris images.
+** See Copyright Notice in lua.h
+*/
+
+#define erisstat_c
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "eris.h"
+
+#define PROGNAME "eris-stat"
+
+/* Size of the chunks we read image files in. */
+#define READSIZE (64 * 1024)
+
+static const char *progname = PROGNAME;
+
+typedef struct FileReader {
+  FILE *f;
+  char buff[READSIZE];
+} FileReader;
+
+static void
+usage(void) {
+  fprintf(stderr,
+  "usage: %s [-q] file...\n"
+  "Prints statistics about the contents of persisted Eris images.\n"
+  "Available options are:\n"
+  "  -q  print one line per file: name, size, code, debug, strings, tables\n",
+  progname);
+}
+
+static const char*
+reader(lua_State *L, void *ud, size_t *sz) {
+  FileReader *fr = (FileReader*)ud;
+  (void)L;
+  *sz = fread(fr->buff, 1, sizeof(fr->buff), fr->f);
+  return *sz > 0 ? fr->buff : NULL;
+}
+
+static lua_Integer
+getint(lua_State *L, int index, const char *key) {
+  lua_Integer value;
+  lua_getfield(L, index, key);
+  value = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return value;
+}
+
+static lua_Integer
+sumfields(lua_State *L, int index) {
+  lua_Integer sum = 0;
+  lua_pushnil(L);
+  while (lua_next(L, index)) {
+    sum += lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  }
+  return sum;
+}
+
+/* Prints the per type counts and sizes. Stack: ... res */
+static void
+printtypes(lua_State *L) {
+  lua_getfield(L, -1, "count");                               /* ... res count */
+  lua_getfield(L, -2, "bytes");                         /* ... res count bytes */
+  printf("  %-14s %10s %12s\n", "type", "count", "bytes");
+  lua_pushnil(L);                                   /* ... res count bytes nil */
+  while (lua_next(L, -3)) {                     /* ... res count bytes type n */
+    const char *type = lua_tostring(L, -2);
+    printf("  %-14s %10lld %12lld\n", type, (long long)lua_tointeger(L, -1),
+           (long long)getint(L, -3, type));
+    lua_pop(L, 1);                                /* ... res count bytes type */
+  }
+  lua_pop(L, 2);                                                    /* ... res */
+}
+
+/* Prints one of the lists of largest objects. Stack: ... res */
+static void
+printlist(lua_State *L, const char *name, const char *sizekey) {
+  int i, n;
+  lua_getfield(L, -1, name);                                   /* ... res list */
+  n = (int)luaL_len(L, -1);
+  if (n > 0) {
+    printf("largest %s:\n", name);
+  }
+  for (i = 1; i <= n; ++i) {
+    lua_rawgeti(L, -1, i);                               /* ... res list entry */
+    printf("  #%-8lld %12lld", (long long)getint(L, -1, "id"),
+           (long long)getint(L, -1, sizekey));
+    lua_getfield(L, -1, "preview");               /* ... res list entry prev? */
+    if (lua_isstring(L, -1)) {
+      const char *preview = lua_tostring(L, -1);
+      printf("  \"");
+      for (; *preview; ++preview) {
+        putchar((*preview >= ' ' && *preview < 127) ? *preview : '.');
+      }
+      printf("\"");
+    }
+    printf("\n");
+    lua_pop(L, 2);                                             /* ... res list */
+  }
+  lua_pop(L, 1);                                                    /* ... res */
+}
+
+/* Prints the permanent values referenced from the image. Stack: ... res */
+static void
+printperms(lua_State *L) {
+  lua_getfield(L, -1, "perms");                               /* ... res perms */
+  lua_pushnil(L);                                         /* ... res perms nil */
+  if (lua_next(L, -2)) {                              /* ... res perms name n */
+    printf("permanents:\n");
+    do {
+      printf("  %-40s %8lld\n", lua_tostring(L, -2),
+             (long long)lua_tointeger(L, -1));
+      lua_pop(L, 1);                                     /* ... res perms name */
+    } while (lua_next(L, -2));
+  }
+  lua_pop(L, 1);                                                    /* ... res */
+}
+
+static void
+printstats(lua_State *L, const char *filename, int quiet) {         /* ... res */
+  if (quiet) {
+    lua_getfield(L, -1, "count");                             /* ... res count */
+    printf("%s\t%lld\t%lld\t%lld\t%lld\t%lld\n", filename,
+           (long long)getint(L, -2, "size"),
+           (long long)getint(L, -2, "code"),
+           (long long)getint(L, -2, "debug"),
+           (long long)getint(L, -1, "string"),
+           (long long)getint(L, -1, "table"));
+    lua_pop(L, 1);                                                  /* ... res */
+    return;
+  }
+
+  printf("%s: %lld bytes\n", filename, (long long)getint(L, -1, "size"));
+  printtypes(L);
+  lua_getfield(L, -1, "count");                               /* ... res count */
+  printf("  %-14s %10lld\n", "total", (long long)sumfields(L, lua_gettop(L)));
+  lua_pop(L, 1);                                                    /* ... res */
+  printf("byte code: %lld bytes, debug info: %lld bytes\n",
+         (long long)getint(L, -1, "code"), (long long)getint(L, -1, "debug"));
+  printlist(L, "strings", "length");
+  printlist(L, "tables", "entries");
+  printperms(L);
+}
+
+static int
+pmain(lua_State *L) {
+  FileReader *fr = (FileReader*)lua_touserdata(L, 1);
+  eris_stat(L, reader, fr);
+  if (ferror(fr->f)) {
+    luaL_error(L, "%s", strerror(errno));
+  }
+  return 1;
+}
+
+int
+main(int argc, char *argv[]) {
+  lua_State *L;
+  FileReader *fr;
+  int i, quiet = 0, status = EXIT_SUCCESS;
+
+  if (argv[0] != NULL && argv[0][0]) {
+    progname = argv[0];
+  }
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "-q") == 0) {
+      quiet = 1;
+    }
+    else if (strcmp(argv[i], "--") == 0) {
+      ++i;
+      break;
+    }
+    else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (i >= argc) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  L = luaL_newstate();
+  fr = (FileReader*)malloc(sizeof(FileReader));
+  if (L == NULL || fr == NULL) {
+    fprintf(stderr, "%s: not enough memory\n", progname);
+    return EXIT_FAILURE;
+  }
+
+  /* We reuse the same state for all files, everything we create while
+   * collecting the statistics for one file is garbage after it. */
+  for (; i < argc; ++i) {
+    const char *filename = argv[i];
+    fr->f = fopen(filename, "rb");
+    if (fr->f == NULL) {
+      fprintf(stderr, "%s: cannot open %s: %s\n", progname, filename,
+              strerror(errno));
+      status = EXIT_FAILURE;
+      continue;
+    }
+    lua_pushcfunction(L, pmain);
+    lua_pushlightuserdata(L, fr);
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+      fprintf(stderr, "%s: %s: %s\n", progname, filename,
+              lua_tostring(L, -1));
+      status = EXIT_FAILURE;
+    }
+    else {
+      printstats(L, filename, quiet);
+    }
+    lua_pop(L, 1);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    fclose(fr->f);
+  }
+
+  free(fr);
+  lua_close(L);
+  return status;
+}